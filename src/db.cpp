@@ -14,9 +14,13 @@
 #endif
 
 #include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
 #include <boost/version.hpp>
 #include <openssl/rand.h>
 
+#include <leveldb/db.h>
+#include <leveldb/write_batch.h>
+
 using namespace std;
 using namespace boost;
 
@@ -231,8 +235,201 @@ void CDBEnv::CheckpointLSN(const std::string& strFile)
 }
 
 
+//
+// CLevelDBEnv
+//
+
+CLevelDBEnv ldbenv;
+
+CLevelDBEnv::~CLevelDBEnv()
+{
+    for (map<string, leveldb::DB*>::iterator mi = mapDb.begin(); mi != mapDb.end(); ++mi)
+        delete mi->second;
+    mapDb.clear();
+}
+
+filesystem::path CLevelDBEnv::GetPath(const string& strFile)
+{
+    return GetDataDir() / (filesystem::basename(strFile) + ".ldb");
+}
+
+bool CLevelDBEnv::Exists(const string& strFile) const
+{
+    return filesystem::exists(GetPath(strFile));
+}
+
+leveldb::DB* CLevelDBEnv::Open(const string& strFile, bool fCreate)
+{
+    AssertLockHeld(cs_ldb);
+    map<string, leveldb::DB*>::iterator mi = mapDb.find(strFile);
+    if (mi != mapDb.end())
+        return mi->second;
+
+    leveldb::Options options;
+    options.create_if_missing = fCreate;
+    leveldb::DB* pdb = NULL;
+    leveldb::Status status = leveldb::DB::Open(options, GetPath(strFile).string(), &pdb);
+    if (!status.ok())
+    {
+        LogPrintf("CLevelDBEnv::Open() : error opening %s: %s\n", GetPath(strFile).string(), status.ToString());
+        return NULL;
+    }
+    LogPrint("db", "Opened wallet store %s\n", GetPath(strFile).string());
+    mapDb[strFile] = pdb;
+    return pdb;
+}
+
+// An empty synced batch flushes the log holding every earlier write
+static bool SyncLevelDB(leveldb::DB* pdb)
+{
+    leveldb::WriteBatch batch;
+    leveldb::WriteOptions options;
+    options.sync = true;
+    return pdb->Write(options, &batch).ok();
+}
+
+bool CLevelDBEnv::Sync(const string& strFile)
+{
+    LOCK(cs_ldb);
+    map<string, leveldb::DB*>::iterator mi = mapDb.find(strFile);
+    if (mi == mapDb.end())
+        return true;
+    return SyncLevelDB(mi->second);
+}
+
+void CLevelDBEnv::Flush(bool fShutdown)
+{
+    LOCK(cs_ldb);
+    map<string, leveldb::DB*>::iterator mi = mapDb.begin();
+    while (mi != mapDb.end())
+    {
+        if (fShutdown && mapFileUseCount[mi->first] == 0)
+        {
+            LogPrint("db", "Closing wallet store %s\n", mi->first);
+            if (!SyncLevelDB(mi->second))
+                LogPrintf("CLevelDBEnv::Flush() : sync of %s failed\n", mi->first);
+            delete mi->second;
+            mapFileUseCount.erase(mi->first);
+            mapDb.erase(mi++);
+        }
+        else
+            mi++;
+    }
+}
+
+// Written into every store Backup() creates. Only a directory holding it is
+// ever deleted, so a path given to backupwallet cannot wipe anything else.
+static const char* BACKUP_MARKER = "walletbackup";
+
+static bool IsWalletBackup(const filesystem::path& path)
+{
+    return filesystem::is_regular_file(path / BACKUP_MARKER);
+}
+
+bool CLevelDBEnv::Backup(const string& strFile, const filesystem::path& pathDest)
+{
+    LOCK(cs_ldb);
+    leveldb::DB* pdb = Open(strFile, false);
+    if (!pdb)
+        return false;
+
+    if (filesystem::exists(pathDest) && filesystem::equivalent(pathDest, GetPath(strFile)))
+        return error("CLevelDBEnv::Backup() : %s is the wallet itself", pathDest.string());
+    if (filesystem::exists(pathDest) && !IsWalletBackup(pathDest))
+        return error("CLevelDBEnv::Backup() : %s already exists and is not a wallet backup", pathDest.string());
+
+    // Build the copy under a temporary name and only replace an earlier
+    // backup once it is complete
+    filesystem::path pathTmp = pathDest.string() + ".tmp";
+    if (filesystem::exists(pathTmp))
+    {
+        if (!IsWalletBackup(pathTmp))
+            return error("CLevelDBEnv::Backup() : %s already exists and is not a wallet backup", pathTmp.string());
+        filesystem::remove_all(pathTmp);
+    }
+
+    leveldb::Options options;
+    options.create_if_missing = true;
+    options.error_if_exists = true;
+    leveldb::DB* pdbDest = NULL;
+    leveldb::Status status = leveldb::DB::Open(options, pathTmp.string(), &pdbDest);
+    if (!status.ok())
+    {
+        LogPrintf("CLevelDBEnv::Backup() : error creating %s: %s\n", pathTmp.string(), status.ToString());
+        return false;
+    }
+    {
+        filesystem::ofstream marker(pathTmp / BACKUP_MARKER);
+        marker << strFile << "\n";
+    }
+
+    // Copy a consistent snapshot, in batches to bound memory
+    leveldb::ReadOptions readoptions;
+    readoptions.snapshot = pdb->GetSnapshot();
+    leveldb::Iterator* piter = pdb->NewIterator(readoptions);
+    leveldb::WriteBatch batch;
+    unsigned int nBatch = 0;
+    for (piter->SeekToFirst(); piter->Valid() && status.ok(); piter->Next())
+    {
+        batch.Put(piter->key(), piter->value());
+        if (++nBatch == 1000)
+        {
+            status = pdbDest->Write(leveldb::WriteOptions(), &batch);
+            batch.Clear();
+            nBatch = 0;
+        }
+    }
+    if (status.ok())
+        status = piter->status();
+    delete piter;
+    pdb->ReleaseSnapshot(readoptions.snapshot);
+
+    leveldb::WriteOptions writeoptions;
+    writeoptions.sync = true;
+    if (status.ok())
+        status = pdbDest->Write(writeoptions, &batch);
+    delete pdbDest;
+
+    if (!status.ok())
+    {
+        LogPrintf("CLevelDBEnv::Backup() : error writing %s: %s\n", pathTmp.string(), status.ToString());
+        return false;
+    }
+
+    try {
+        if (filesystem::exists(pathDest))
+            filesystem::remove_all(pathDest);
+        filesystem::rename(pathTmp, pathDest);
+    } catch (const filesystem::filesystem_error& e) {
+        return error("CLevelDBEnv::Backup() : %s", e.what());
+    }
+    return true;
+}
+
+
+//
+// CDBCursor
+//
+
+CDBCursor::~CDBCursor()
+{
+    if (pdbc)
+        pdbc->close();
+    delete piter;
+}
+
+
+//
+// CDB
+//
+
+bool CDB::UseLevelDB()
+{
+    return GetArg("-walletbackend", DEFAULT_WALLET_BACKEND) == "leveldb";
+}
+
 CDB::CDB(const std::string& strFilename, const char* pszMode) :
-    pdb(NULL), activeTxn(NULL)
+    pdb(NULL), activeTxn(NULL), pldb(NULL), fLevelTxn(false), fLevelUnsynced(false)
 {
     int ret;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
@@ -240,6 +437,26 @@ CDB::CDB(const std::string& strFilename, const char* pszMode) :
         return;
 
     bool fCreate = strchr(pszMode, 'c');
+
+    if (UseLevelDB())
+    {
+        LOCK(ldbenv.cs_ldb);
+        pldb = ldbenv.Open(strFilename, fCreate);
+        if (pldb == NULL)
+            throw runtime_error(strprintf("CDB : can't open wallet store %s", strFilename));
+        strFile = strFilename;
+        ++ldbenv.mapFileUseCount[strFile];
+
+        if (fCreate && !Exists(string("version")))
+        {
+            bool fTmp = fReadOnly;
+            fReadOnly = false;
+            WriteVersion(CLIENT_VERSION);
+            fReadOnly = fTmp;
+        }
+        return;
+    }
+
     unsigned int nFlags = DB_THREAD;
     if (fCreate)
         nFlags |= DB_CREATE;
@@ -296,6 +513,22 @@ CDB::CDB(const std::string& strFilename, const char* pszMode) :
 
 void CDB::Close()
 {
+    if (pldb)
+    {
+        fLevelTxn = false;
+        mapTxnWrites.clear();
+
+        // Like the checkpoint Berkeley DB takes below, a handle that wrote
+        // leaves its writes on disk when it closes
+        if (fLevelUnsynced && !SyncLevelDB(pldb))
+            LogPrintf("CDB::Close() : sync of %s failed\n", strFile);
+        fLevelUnsynced = false;
+        pldb = NULL;
+
+        LOCK(ldbenv.cs_ldb);
+        --ldbenv.mapFileUseCount[strFile];
+        return;
+    }
     if (!pdb)
         return;
     if (activeTxn)
@@ -316,6 +549,205 @@ void CDB::Close()
     }
 }
 
+bool CDB::LevelRead(const CDataStream& ssKey, string& strValue)
+{
+    string strKey(ssKey.begin(), ssKey.end());
+    if (fLevelTxn)
+    {
+        map<string, pair<bool, string> >::const_iterator mi = mapTxnWrites.find(strKey);
+        if (mi != mapTxnWrites.end())
+        {
+            if (mi->second.first)
+                return false;
+            strValue = mi->second.second;
+            return true;
+        }
+    }
+    return pldb->Get(leveldb::ReadOptions(), strKey, &strValue).ok();
+}
+
+bool CDB::LevelWrite(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite)
+{
+    if (!fOverwrite && LevelExists(ssKey))
+        return false;
+
+    string strKey(ssKey.begin(), ssKey.end());
+    string strValue(ssValue.begin(), ssValue.end());
+    if (fLevelTxn)
+    {
+        mapTxnWrites[strKey] = make_pair(false, strValue);
+        return true;
+    }
+
+    // Synced once when the handle closes, so a run of writes through one
+    // CDB, such as a block's, costs a single sync
+    fLevelUnsynced = true;
+    return pldb->Put(leveldb::WriteOptions(), strKey, strValue).ok();
+}
+
+bool CDB::LevelErase(const CDataStream& ssKey)
+{
+    string strKey(ssKey.begin(), ssKey.end());
+    if (fLevelTxn)
+    {
+        mapTxnWrites[strKey] = make_pair(true, string());
+        return true;
+    }
+    fLevelUnsynced = true;
+    return pldb->Delete(leveldb::WriteOptions(), strKey).ok();
+}
+
+bool CDB::LevelExists(const CDataStream& ssKey)
+{
+    string strValue;
+    return LevelRead(ssKey, strValue);
+}
+
+CDBCursor* CDB::GetCursor()
+{
+    if (pldb)
+        return new CDBCursor(pldb->NewIterator(leveldb::ReadOptions()));
+    if (!pdb)
+        return NULL;
+    Dbc* pcursor = NULL;
+    int ret = pdb->cursor(NULL, &pcursor, 0);
+    if (ret != 0)
+        return NULL;
+    return new CDBCursor(pcursor);
+}
+
+int CDB::ReadAtCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags)
+{
+    if (pcursor->piter)
+    {
+        leveldb::Iterator* piter = pcursor->piter;
+        if (fFlags == DB_SET_RANGE)
+            piter->Seek(string(ssKey.begin(), ssKey.end()));
+        else if (pcursor->fPositioned)
+            piter->Next();
+        else
+            piter->SeekToFirst();
+        pcursor->fPositioned = true;
+        if (!piter->Valid())
+            return piter->status().ok() ? DB_NOTFOUND : 99999;
+
+        ssKey.SetType(SER_DISK);
+        ssKey.clear();
+        ssKey.write(piter->key().data(), piter->key().size());
+        ssValue.SetType(SER_DISK);
+        ssValue.clear();
+        ssValue.write(piter->value().data(), piter->value().size());
+        return 0;
+    }
+
+    // Read at cursor
+    Dbt datKey;
+    if (fFlags == DB_SET || fFlags == DB_SET_RANGE || fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE)
+    {
+        datKey.set_data(&ssKey[0]);
+        datKey.set_size(ssKey.size());
+    }
+    Dbt datValue;
+    if (fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE)
+    {
+        datValue.set_data(&ssValue[0]);
+        datValue.set_size(ssValue.size());
+    }
+    datKey.set_flags(DB_DBT_MALLOC);
+    datValue.set_flags(DB_DBT_MALLOC);
+    int ret = pcursor->pdbc->get(&datKey, &datValue, fFlags);
+    if (ret != 0)
+        return ret;
+    else if (datKey.get_data() == NULL || datValue.get_data() == NULL)
+        return 99999;
+
+    // Convert to streams
+    ssKey.SetType(SER_DISK);
+    ssKey.clear();
+    ssKey.write((char*)datKey.get_data(), datKey.get_size());
+    ssValue.SetType(SER_DISK);
+    ssValue.clear();
+    ssValue.write((char*)datValue.get_data(), datValue.get_size());
+
+    // Clear and free memory
+    memset(datKey.get_data(), 0, datKey.get_size());
+    memset(datValue.get_data(), 0, datValue.get_size());
+    free(datKey.get_data());
+    free(datValue.get_data());
+    return 0;
+}
+
+bool CDB::TxnBegin()
+{
+    if (pldb)
+    {
+        if (fLevelTxn)
+            return false;
+        fLevelTxn = true;
+        mapTxnWrites.clear();
+        return true;
+    }
+    if (!pdb || activeTxn)
+        return false;
+    DbTxn* ptxn = bitdb.TxnBegin();
+    if (!ptxn)
+        return false;
+    activeTxn = ptxn;
+    return true;
+}
+
+bool CDB::TxnCommit()
+{
+    if (pldb)
+    {
+        if (!fLevelTxn)
+            return false;
+        leveldb::WriteBatch batch;
+        for (map<string, pair<bool, string> >::const_iterator mi = mapTxnWrites.begin(); mi != mapTxnWrites.end(); ++mi)
+        {
+            if (mi->second.first)
+                batch.Delete(mi->first);
+            else
+                batch.Put(mi->first, mi->second.second);
+        }
+        fLevelTxn = false;
+        mapTxnWrites.clear();
+
+        leveldb::WriteOptions options;
+        options.sync = true;
+        return pldb->Write(options, &batch).ok();
+    }
+    if (!pdb || !activeTxn)
+        return false;
+    int ret = activeTxn->commit(0);
+    activeTxn = NULL;
+    return (ret == 0);
+}
+
+bool CDB::TxnAbort()
+{
+    if (pldb)
+    {
+        if (!fLevelTxn)
+            return false;
+        fLevelTxn = false;
+        mapTxnWrites.clear();
+        return true;
+    }
+    if (!pdb || !activeTxn)
+        return false;
+    int ret = activeTxn->abort();
+    activeTxn = NULL;
+    return (ret == 0);
+}
+
+bool CDB::Sync()
+{
+    if (pldb)
+        return ldbenv.Sync(strFile);
+    return true;
+}
+
 void CDBEnv::CloseDb(const string& strFile)
 {
     {
@@ -342,6 +774,33 @@ bool CDBEnv::RemoveDb(const string& strFile)
 
 bool CDB::Rewrite(const string& strFile, const char* pszSkip)
 {
+    if (UseLevelDB())
+    {
+        LOCK(ldbenv.cs_ldb);
+        leveldb::DB* pdbStore = ldbenv.Open(strFile, false);
+        if (!pdbStore)
+            return false;
+
+        LogPrintf("Rewriting %s...\n", CLevelDBEnv::GetPath(strFile).string());
+        if (pszSkip)
+        {
+            leveldb::WriteBatch batch;
+            leveldb::Iterator* piter = pdbStore->NewIterator(leveldb::ReadOptions());
+            for (piter->Seek(pszSkip); piter->Valid() && piter->key().starts_with(pszSkip); piter->Next())
+                batch.Delete(piter->key());
+            delete piter;
+            leveldb::WriteOptions options;
+            options.sync = true;
+            if (!pdbStore->Write(options, &batch).ok())
+                return false;
+        }
+
+        // Compacting drops old versions of overwritten records, such as
+        // unencrypted keys, from the table files
+        pdbStore->CompactRange(NULL, NULL);
+        return true;
+    }
+
     while (true)
     {
         {
@@ -372,7 +831,7 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                         fSuccess = false;
                     }
 
-                    Dbc* pcursor = db.GetCursor();
+                    CDBCursor* pcursor = db.GetCursor();
                     if (pcursor)
                         while (fSuccess)
                         {
@@ -381,12 +840,12 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                             int ret = db.ReadAtCursor(pcursor, ssKey, ssValue, DB_NEXT);
                             if (ret == DB_NOTFOUND)
                             {
-                                pcursor->close();
+                                delete pcursor;
                                 break;
                             }
                             else if (ret != 0)
                             {
-                                pcursor->close();
+                                delete pcursor;
                                 fSuccess = false;
                                 break;
                             }
@@ -434,6 +893,108 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
 }
 
 
+bool CDB::MigrateToLevelDB(const string& strFile, bool& fMigratedRet)
+{
+    fMigratedRet = false;
+    if (!UseLevelDB() || ldbenv.Exists(strFile) || !filesystem::exists(GetDataDir() / strFile))
+        return true;
+
+    LogPrintf("Migrating %s to %s...\n", strFile, CLevelDBEnv::GetPath(strFile).string());
+    int64_t nStart = GetTimeMillis();
+
+    // Build the store under a temporary name, so that an interrupted
+    // migration is simply started over on the next run
+    filesystem::path pathStore = CLevelDBEnv::GetPath(strFile);
+    filesystem::path pathTmp = filesystem::path(pathStore.string() + ".tmp");
+    filesystem::remove_all(pathTmp);
+
+    if (!bitdb.Open(GetDataDir()))
+        return false;
+
+    Db db(&bitdb.dbenv, 0);
+    int ret = db.open(NULL, strFile.c_str(), "main", DB_BTREE, DB_RDONLY, 0);
+    if (ret != 0)
+        return error("MigrateToLevelDB() : can't open %s (%d)", strFile, ret);
+
+    leveldb::Options options;
+    options.create_if_missing = true;
+    leveldb::DB* pdbStore = NULL;
+    leveldb::Status status = leveldb::DB::Open(options, pathTmp.string(), &pdbStore);
+    if (!status.ok())
+    {
+        db.close(0);
+        return error("MigrateToLevelDB() : can't create %s: %s", pathTmp.string(), status.ToString());
+    }
+
+    leveldb::WriteBatch batch;
+    unsigned int nRecords = 0;
+    bool fSuccess = true;
+    Dbc* pcursor = NULL;
+    if (db.cursor(NULL, &pcursor, 0) != 0)
+        fSuccess = false;
+    while (fSuccess)
+    {
+        Dbt datKey, datValue;
+        datKey.set_flags(DB_DBT_MALLOC);
+        datValue.set_flags(DB_DBT_MALLOC);
+        ret = pcursor->get(&datKey, &datValue, DB_NEXT);
+        if (ret == DB_NOTFOUND)
+            break;
+        if (ret != 0 || datKey.get_data() == NULL || datValue.get_data() == NULL)
+        {
+            fSuccess = false;
+            break;
+        }
+        batch.Put(leveldb::Slice((const char*)datKey.get_data(), datKey.get_size()),
+                  leveldb::Slice((const char*)datValue.get_data(), datValue.get_size()));
+        memset(datKey.get_data(), 0, datKey.get_size());
+        memset(datValue.get_data(), 0, datValue.get_size());
+        free(datKey.get_data());
+        free(datValue.get_data());
+        nRecords++;
+    }
+    if (pcursor)
+        pcursor->close();
+    db.close(0);
+    bitdb.CheckpointLSN(strFile);
+
+    if (fSuccess)
+    {
+        leveldb::WriteOptions writeoptions;
+        writeoptions.sync = true;
+        status = pdbStore->Write(writeoptions, &batch);
+        fSuccess = status.ok();
+    }
+    delete pdbStore;
+
+    if (fSuccess)
+    {
+        try {
+            filesystem::rename(pathTmp, pathStore);
+        } catch (const filesystem::filesystem_error& e) {
+            return error("MigrateToLevelDB() : %s", e.what());
+        }
+    }
+    else
+    {
+        filesystem::remove_all(pathTmp);
+        return error("MigrateToLevelDB() : error copying %s", strFile);
+    }
+
+    // The store is now the wallet; the old file stops receiving keys and
+    // transactions and must not be loaded again
+    filesystem::path pathMigrated = GetDataDir() / (strFile + ".migrated");
+    try {
+        filesystem::rename(GetDataDir() / strFile, pathMigrated);
+    } catch (const filesystem::filesystem_error& e) {
+        return error("MigrateToLevelDB() : %s", e.what());
+    }
+    fMigratedRet = true;
+
+    LogPrintf("Migrated %u records from %s in %dms, the original file is kept as %s\n", nRecords, strFile, GetTimeMillis() - nStart, pathMigrated.string());
+    return true;
+}
+
 void CDBEnv::Flush(bool fShutdown)
 {
     int64_t nStart = GetTimeMillis();
@@ -24,8 +24,16 @@ class CDiskTxPos;
 class COutPoint;
 class CTxIndex;
 
+namespace leveldb {
+class DB;
+class Iterator;
+}
+
 extern unsigned int nWalletDBUpdated;
 
+/** Storage engine for wallet files, see -walletbackend */
+static const char* const DEFAULT_WALLET_BACKEND = "bdb";
+
 void ThreadFlushWalletDB(const std::string& strWalletFile);
 
 
@@ -89,7 +97,55 @@ public:
 extern CDBEnv bitdb;
 
 
-/** RAII class that provides access to a Berkeley database */
+/** Wallet files kept in an embedded LevelDB store instead of Berkeley DB.
+ * Each file is a directory next to it, wallet.dat becoming wallet.ldb.
+ */
+class CLevelDBEnv
+{
+public:
+    mutable CCriticalSection cs_ldb;
+    std::map<std::string, int> mapFileUseCount;
+    std::map<std::string, leveldb::DB*> mapDb;
+
+    ~CLevelDBEnv();
+
+    static boost::filesystem::path GetPath(const std::string& strFile);
+    bool Exists(const std::string& strFile) const;
+
+    // Returns the open store for strFile, opening it if needed. cs_ldb must be held.
+    leveldb::DB* Open(const std::string& strFile, bool fCreate);
+
+    // Make all unsynced writes durable
+    bool Sync(const std::string& strFile);
+    void Flush(bool fShutdown);
+
+    // Copy every record of strFile into a new store at pathDest
+    bool Backup(const std::string& strFile, const boost::filesystem::path& pathDest);
+};
+
+extern CLevelDBEnv ldbenv;
+
+
+/** Position in a CDB, over whichever backend the database uses */
+class CDBCursor
+{
+public:
+    Dbc* pdbc;
+    leveldb::Iterator* piter;
+    bool fPositioned;
+
+    explicit CDBCursor(Dbc* pdbcIn) : pdbc(pdbcIn), piter(NULL), fPositioned(false) {}
+    explicit CDBCursor(leveldb::Iterator* piterIn) : pdbc(NULL), piter(piterIn), fPositioned(false) {}
+    ~CDBCursor();
+
+private:
+    CDBCursor(const CDBCursor&);
+    void operator=(const CDBCursor&);
+};
+
+
+/** RAII class that provides access to a wallet database, held in Berkeley DB
+ * or, with -walletbackend=leveldb, in a CLevelDBEnv store */
 class CDB
 {
 protected:
@@ -98,6 +154,19 @@ protected:
     DbTxn *activeTxn;
     bool fReadOnly;
 
+    // LevelDB backend. Writes made inside a transaction are held here,
+    // keyed by serialized key with an erase flag, until TxnCommit. Writes
+    // outside one are synced when the handle closes.
+    leveldb::DB* pldb;
+    bool fLevelTxn;
+    bool fLevelUnsynced;
+    std::map<std::string, std::pair<bool, std::string> > mapTxnWrites;
+
+    bool LevelRead(const CDataStream& ssKey, std::string& strValue);
+    bool LevelWrite(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite);
+    bool LevelErase(const CDataStream& ssKey);
+    bool LevelExists(const CDataStream& ssKey);
+
     explicit CDB(const std::string& strFilename, const char* pszMode="r+");
     ~CDB() { Close(); }
 
@@ -112,13 +181,29 @@ protected:
     template<typename K, typename T>
     bool Read(const K& key, T& value)
     {
-        if (!pdb)
+        if (!pdb && !pldb)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (pldb)
+        {
+            std::string strValue;
+            if (!LevelRead(ssKey, strValue))
+                return false;
+            try {
+                CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+                ssValue >> value;
+            }
+            catch (std::exception &e) {
+                return false;
+            }
+            return true;
+        }
+
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Read
@@ -147,7 +232,7 @@ protected:
     template<typename K, typename T>
     bool Write(const K& key, const T& value, bool fOverwrite=true)
     {
-        if (!pdb)
+        if (!pdb && !pldb)
             return false;
         if (fReadOnly)
             assert(!"Write called on database in read-only mode");
@@ -156,12 +241,16 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
 
         // Value
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(10000);
         ssValue << value;
+
+        if (pldb)
+            return LevelWrite(ssKey, ssValue, fOverwrite);
+
+        Dbt datKey(&ssKey[0], ssKey.size());
         Dbt datValue(&ssValue[0], ssValue.size());
 
         // Write
@@ -176,7 +265,7 @@ protected:
     template<typename K>
     bool Erase(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !pldb)
             return false;
         if (fReadOnly)
             assert(!"Erase called on database in read-only mode");
@@ -185,6 +274,10 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (pldb)
+            return LevelErase(ssKey);
+
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Erase
@@ -198,13 +291,17 @@ protected:
     template<typename K>
     bool Exists(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !pldb)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (pldb)
+            return LevelExists(ssKey);
+
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Exists
@@ -215,85 +312,20 @@ protected:
         return (ret == 0);
     }
 
-    Dbc* GetCursor()
-    {
-        if (!pdb)
-            return NULL;
-        Dbc* pcursor = NULL;
-        int ret = pdb->cursor(NULL, &pcursor, 0);
-        if (ret != 0)
-            return NULL;
-        return pcursor;
-    }
+    // The caller deletes the cursor when done with it
+    CDBCursor* GetCursor();
 
-    int ReadAtCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags=DB_NEXT)
-    {
-        // Read at cursor
-        Dbt datKey;
-        if (fFlags == DB_SET || fFlags == DB_SET_RANGE || fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE)
-        {
-            datKey.set_data(&ssKey[0]);
-            datKey.set_size(ssKey.size());
-        }
-        Dbt datValue;
-        if (fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE)
-        {
-            datValue.set_data(&ssValue[0]);
-            datValue.set_size(ssValue.size());
-        }
-        datKey.set_flags(DB_DBT_MALLOC);
-        datValue.set_flags(DB_DBT_MALLOC);
-        int ret = pcursor->get(&datKey, &datValue, fFlags);
-        if (ret != 0)
-            return ret;
-        else if (datKey.get_data() == NULL || datValue.get_data() == NULL)
-            return 99999;
-
-        // Convert to streams
-        ssKey.SetType(SER_DISK);
-        ssKey.clear();
-        ssKey.write((char*)datKey.get_data(), datKey.get_size());
-        ssValue.SetType(SER_DISK);
-        ssValue.clear();
-        ssValue.write((char*)datValue.get_data(), datValue.get_size());
-
-        // Clear and free memory
-        memset(datKey.get_data(), 0, datKey.get_size());
-        memset(datValue.get_data(), 0, datValue.get_size());
-        free(datKey.get_data());
-        free(datValue.get_data());
-        return 0;
-    }
+    // fFlags is DB_NEXT or DB_SET_RANGE. Returns 0, or DB_NOTFOUND past the last record.
+    int ReadAtCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags=DB_NEXT);
 
 public:
-    bool TxnBegin()
-    {
-        if (!pdb || activeTxn)
-            return false;
-        DbTxn* ptxn = bitdb.TxnBegin();
-        if (!ptxn)
-            return false;
-        activeTxn = ptxn;
-        return true;
-    }
+    bool TxnBegin();
+    bool TxnCommit();
+    bool TxnAbort();
 
-    bool TxnCommit()
-    {
-        if (!pdb || !activeTxn)
-            return false;
-        int ret = activeTxn->commit(0);
-        activeTxn = NULL;
-        return (ret == 0);
-    }
-
-    bool TxnAbort()
-    {
-        if (!pdb || !activeTxn)
-            return false;
-        int ret = activeTxn->abort();
-        activeTxn = NULL;
-        return (ret == 0);
-    }
+    // Make writes made so far durable. Berkeley DB leaves this to its
+    // checkpoints, so it only matters for LevelDB.
+    bool Sync();
 
     bool ReadVersion(int& nVersion)
     {
@@ -307,6 +339,12 @@ public:
     }
 
     bool static Rewrite(const std::string& strFile, const char* pszSkip = NULL);
+
+    static bool UseLevelDB();
+    // Copy an existing Berkeley DB strFile into a new LevelDB store, unless
+    // there is nothing to migrate. strFile is then renamed to
+    // strFile.migrated so that it can't be loaded again by mistake.
+    static bool MigrateToLevelDB(const std::string& strFile, bool& fMigratedRet);
 };
 
 #endif // BITCOIN_DB_H
@@ -128,6 +128,9 @@ void Shutdown()
 #endif
     StopNode();
     UnregisterNodeSignals(GetNodeSignals());
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        DumpMempool();
+    FlushBlockFile(true);
     DumpMasternodes();
     {
         LOCK(cs_main);
@@ -138,7 +141,10 @@ void Shutdown()
     }
 #ifdef ENABLE_WALLET
     if (pwalletMain)
+    {
         bitdb.Flush(true);
+        ldbenv.Flush(true);
+    }
 #endif
     boost::filesystem::remove(GetPidFile());
     UnregisterAllWallets();
@@ -199,6 +205,12 @@ std::string HelpMessage()
     strUsage += "  -wallet=<dir>          " + _("Specify wallet file (within data directory)") + "\n";
     strUsage += "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 100)") + "\n";
     strUsage += "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n";
+    strUsage += "  -dbprofile=<profile>   " + _("LevelDB tuning profile: auto, ibd or steady (default: auto)") + "\n";
+    strUsage += "  -dbwritebuffer=<n>     " + _("Set LevelDB write buffer size in megabytes (default: 64 in ibd profile, 8 otherwise)") + "\n";
+    strUsage += "  -dbmaxopenfiles=<n>    " + _("Maximum number of LevelDB table files kept open (default: 64)") + "\n";
+    strUsage += "  -dbblocksize=<n>       " + _("Set LevelDB block size in kilobytes (default: 16)") + "\n";
+    strUsage += "  -dbcompression         " + _("Compress LevelDB blocks when supported (default: 1)") + "\n";
+    strUsage += "  -dbsync                " + _("Sync transaction database commits to disk outside initial download (default: 1)") + "\n";
     strUsage += "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n";
     strUsage += "  -proxy=<ip:port>       " + _("Connect through SOCKS5 proxy") + "\n";
     strUsage += "  -tor=<ip:port>         " + _("Use proxy to reach tor hidden services (default: same as -proxy)") + "\n";
@@ -227,6 +239,9 @@ std::string HelpMessage()
     strUsage += "  -upnp                  " + _("Use UPnP to map the listening port (default: 0)") + "\n";
 #endif
 #endif
+    strUsage += "  -maxmempool=<n>        " + strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE) + "\n";
+    strUsage += "  -mempoolexpiry=<n>     " + strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY) + "\n";
+    strUsage += "  -persistmempool        " + strprintf(_("Save the transaction memory pool on shutdown and reload it on startup (default: %u)"), DEFAULT_PERSIST_MEMPOOL) + "\n";
     strUsage += "  -paytxfee=<amt>        " + _("Fee per KB to add to transactions you send") + "\n";
     strUsage += "  -mininput=<amt>        " + _("When creating transactions, ignore inputs with value less than this (default: 0.01)") + "\n";
     if (fHaveGUI)
@@ -240,7 +255,7 @@ std::string HelpMessage()
     strUsage +=                               _("If <category> is not supplied, output all debugging information.") + "\n";
     strUsage +=                               _("<category> can be:");
     strUsage +=                                 " addrman, alert, db, lock, rand, rpc, selectcoins, mempool, net,"; // Don't translate these and qt below
-    strUsage +=                                 " coinage, coinstake, creation, stakemodifier";
+    strUsage +=                                 " coinage, coinstake, creation, stakemodifier, prune";
     if (fHaveGUI){
         strUsage += ", qt.\n";
     }else{
@@ -267,11 +282,17 @@ std::string HelpMessage()
     strUsage += "  -upgradewallet         " + _("Upgrade wallet to latest format") + "\n";
     strUsage += "  -createwalletbackups=<n> " + _("Number of automatic wallet backups (default: 10)") + "\n";
     strUsage += "  -keypool=<n>           " + _("Set key pool size to <n> (default: 1000) (litemode: 100)") + "\n";
+    strUsage += "  -usehd                 " + strprintf(_("Derive new keys from a seed kept in the wallet, so that a backup also covers keys created after it (default: %u)"), DEFAULT_USE_HD_WALLET) + "\n";
     strUsage += "  -rescan                " + _("Rescan the block chain for missing wallet transactions") + "\n";
     strUsage += "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n";
+    strUsage += "  -walletbackend=<name>  " + strprintf(_("Wallet storage engine, bdb or leveldb. Switching to leveldb moves an existing wallet.dat into wallet.ldb for good (default: %s)"), DEFAULT_WALLET_BACKEND) + "\n";
     strUsage += "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 500, 0 = all)") + "\n";
     strUsage += "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n";
+    strUsage += "  -importthreads=<n>     " + _("Number of threads checking blocks during -loadblock and bootstrap.dat imports (default: 0 = auto)") + "\n";
+    strUsage += "  -prune=<n>             " + strprintf(_("Reduce storage by deleting old block files down to <n> megabytes (default: 0 = disabled, minimum: %u)"), MIN_PRUNE_TARGET_MB) + "\n";
+    strUsage += "  -prunekeepblocks=<n>   " + strprintf(_("Number of recent blocks a pruned node keeps for reorgs and serving (default and minimum: %u)"), MIN_BLOCKS_TO_KEEP) + "\n";
+    strUsage += "  -maxorphantxsize=<n>   " + strprintf(_("Keep at most <n> megabytes of unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TX_SIZE) + "\n";
     strUsage += "  -maxorphanblocks=<n>   " + strprintf(_("Keep at most <n> unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
     strUsage += "  -backtoblock=<n>       " + _("Rollback local block chain to block height <n>") + "\n";
     strUsage += "  -maxblockheight=<n>    " + _("Stop sync when block height reaches <n>") + "\n";
@@ -498,6 +519,22 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     fConfChange = GetBoolArg("-confchange", false);
 
+    if (GetArg("-prune", 0) > 0)
+    {
+        if (GetBoolArg("-addrindex", false) || GetBoolArg("-reindexaddr", false))
+            return InitError(_("Pruning is incompatible with -addrindex and -reindexaddr."));
+        uint64_t nPruneTargetMB = GetArg("-prune", 0);
+        if (nPruneTargetMB < MIN_PRUNE_TARGET_MB)
+            return InitError(strprintf(_("Prune target must be at least %u MB."), MIN_PRUNE_TARGET_MB));
+        nPruneTarget = nPruneTargetMB * 1024 * 1024;
+        nPruneKeepBlocks = std::max((unsigned int)GetArg("-prunekeepblocks", MIN_BLOCKS_TO_KEEP), MIN_BLOCKS_TO_KEEP);
+        LogPrintf("Prune mode: keeping block files under %u MB and at least the last %u blocks\n", nPruneTargetMB, nPruneKeepBlocks);
+    }
+
+    // The pool has to hold at least a few blocks worth of transactions
+    if (GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) < 5)
+        return InitError(strprintf(_("-maxmempool must be at least %d MB"), 5));
+
 #ifdef ENABLE_WALLET
     if (mapArgs.count("-mininput"))
     {
@@ -657,6 +694,13 @@ bool AppInit2(boost::thread_group& threadGroup)
             }
         }
 
+        // Once migrated the LevelDB store is the wallet, and a Berkeley DB
+        // file next to it would be stale
+        if (!CDB::UseLevelDB() && ldbenv.Exists(strWalletFileName))
+            return InitError(strprintf(_("The wallet has been moved to %s, start with -walletbackend=leveldb"), CLevelDBEnv::GetPath(strWalletFileName).string()));
+        if (CDB::UseLevelDB() && GetBoolArg("-salvagewallet", false))
+            return InitError(_("-salvagewallet only works on the bdb wallet backend"));
+
         if (GetBoolArg("-salvagewallet", false))
         {
             // Recover readable keypairs:
@@ -664,7 +708,7 @@ bool AppInit2(boost::thread_group& threadGroup)
                 return false;
         }
 
-        if (filesystem::exists(GetDataDir() / strWalletFileName))
+        if (filesystem::exists(GetDataDir() / strWalletFileName) && !(CDB::UseLevelDB() && ldbenv.Exists(strWalletFileName)))
         {
             CDBEnv::VerifyResult r = bitdb.Verify(strWalletFileName, CWalletDB::Recover);
             if (r == CDBEnv::RECOVER_OK)
@@ -679,6 +723,14 @@ bool AppInit2(boost::thread_group& threadGroup)
                 return InitError(_("wallet.dat corrupt, salvage failed"));
         }
 
+        bool fMigrated;
+        if (!CDB::MigrateToLevelDB(strWalletFileName, fMigrated))
+            return InitError(strprintf(_("Error copying %s into the LevelDB wallet store"), strWalletFileName));
+        if (fMigrated)
+            InitWarning(strprintf(_("Warning: %s was copied into %s and renamed to %s.migrated. It is no longer updated"
+                                    " and keeps any unencrypted keys it held; delete it once you have a new backup."),
+                                  strWalletFileName, CLevelDBEnv::GetPath(strWalletFileName).string(), strWalletFileName));
+
     } // (!fDisableWallet)
 #endif // ENABLE_WALLET
     // ********************************************************* Step 6: network initialization
@@ -812,6 +864,16 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
     LogPrintf(" block index %15dms\n", GetTimeMillis() - nStart);
 
+    // Pruned history cannot be served, so stop advertising as a full node
+    if (nPruneTarget || fHavePruned)
+    {
+        if (fHavePruned && !nPruneTarget)
+            InitWarning(_("Warning: Block files were pruned earlier, this node can only serve recent blocks."));
+        if (GetBoolArg("-rescan", false))
+            InitWarning(_("Warning: Rescanning a pruned node only covers the blocks still on disk."));
+        nLocalServices = (nLocalServices & ~NODE_NETWORK) | NODE_NETWORK_LIMITED;
+    }
+
     if (GetBoolArg("-printblockindex", false) || GetBoolArg("-printblocktree", false))
     {
         PrintBlockTree();
@@ -976,6 +1038,10 @@ bool AppInit2(boost::thread_group& threadGroup)
             vImportFiles.push_back(strFile);
     }
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        threadGroup.create_thread(boost::bind(&LoopForever<bool (*)()>, "dumpmempool", &DumpMempool, DUMP_MEMPOOL_INTERVAL * 1000));
+    if (nPruneTarget)
+        threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "prune", &PruneBlockFiles, PRUNE_CHECK_INTERVAL * 1000));
 
     // ********************************************************* Step 10: load peers
 
@@ -227,9 +227,12 @@ uint256 ComputeStakeModifierV2(const CBlockIndex* pindexPrev, const uint256& ker
 //   quantities so as to generate blocks faster, degrading the system back into
 //   a proof-of-work situation.
 //
-bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
+bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CStakeCandidate& candidate, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
-    if (nTimeTx < txPrev.nTime)  // Transaction timestamp violation
+    const COutPoint& prevout = candidate.prevout;
+    unsigned int nTimeBlockFrom = candidate.nTimeBlockFrom;
+
+    if (nTimeTx < candidate.nTimeTxPrev)  // Transaction timestamp violation
         return error("CheckStakeKernelHash() : nTime violation");
 
     // Base target
@@ -237,7 +240,7 @@ bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned
     bnTarget.SetCompact(nBits);
 
     // Weighted target
-    int64_t nValueIn = txPrev.vout[prevout.n].nValue;
+    int64_t nValueIn = candidate.nValue;
     CBigNum bnWeight = CBigNum(nValueIn);
     bnTarget *= bnWeight;
 
@@ -252,7 +255,7 @@ bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned
     CDataStream ss(SER_GETHASH, 0);
 
     ss << bnStakeModifierV2;
-    ss << txPrev.nTime << prevout.hash << prevout.n << nTimeTx;
+    ss << candidate.nTimeTxPrev << prevout.hash << prevout.n << nTimeTx;
     hashProofOfStake = Hash_echo512(ss.begin(), ss.end());
 
     if (fPrintProofOfStake)
@@ -263,7 +266,7 @@ bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned
             DateTimeStrFormat(nTimeBlockFrom));
         LogPrintf("CheckStakeKernelHash() : check modifier=0x%016x nTimeBlockFrom=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             nStakeModifier,
-            nTimeBlockFrom, txPrev.nTime, prevout.n, nTimeTx,
+            nTimeBlockFrom, candidate.nTimeTxPrev, prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
@@ -280,13 +283,23 @@ bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned
             DateTimeStrFormat(nTimeBlockFrom));
         LogPrintf("CheckStakeKernelHash() : pass modifier=0x%016x nTimeBlockFrom=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             nStakeModifier,
-            nTimeBlockFrom, txPrev.nTime, prevout.n, nTimeTx,
+            nTimeBlockFrom, candidate.nTimeTxPrev, prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
     return true;
 }
 
+bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
+{
+    CStakeCandidate candidate;
+    candidate.prevout = prevout;
+    candidate.nTimeBlockFrom = nTimeBlockFrom;
+    candidate.nTimeTxPrev = txPrev.nTime;
+    candidate.nValue = txPrev.vout[prevout.n].nValue;
+    return CheckStakeKernelHash(pindexPrev, nBits, candidate, nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
+}
+
 // Check kernel hash target and coinstake signature
 bool CheckProofOfStake(CBlockIndex* pindexPrev, const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake)
 {
@@ -353,3 +366,150 @@ bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, con
 
     return CheckStakeKernelHash(pindexPrev, nBits, block.GetBlockTime(), txPrev, prevout, nTime, hashProofOfStake, targetProofOfStake);
 }
+
+bool CStakeCandidate::IsValid() const
+{
+    if (IsNull())
+        return false;
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlockFrom);
+    if (mi == mapBlockIndex.end())
+        return false;
+    CBlockIndex* pindex = (*mi).second;
+    return pindex->nHeight == nHeightBlockFrom && pindex->IsInMainChain();
+}
+
+bool GetStakeCandidate(CTxDB& txdb, const COutPoint& prevout, CStakeCandidate& candidate)
+{
+    candidate.SetNull();
+
+    CTransaction txPrev;
+    CTxIndex txindex;
+    if (!txPrev.ReadFromDisk(txdb, prevout, txindex))
+        return false;
+
+    // Read block header
+    CBlock block;
+    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+        return false;
+
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    if (mi == mapBlockIndex.end() || !(*mi).second->IsInMainChain())
+        return false;
+
+    candidate.prevout = prevout;
+    candidate.hashBlockFrom = block.GetHash();
+    candidate.nHeightBlockFrom = (*mi).second->nHeight;
+    candidate.nTimeBlockFrom = block.GetBlockTime();
+    candidate.nTxPrevOffset = txindex.pos.nTxPos - txindex.pos.nBlockPos;
+    candidate.nTimeTxPrev = txPrev.nTime;
+    candidate.nValue = txPrev.vout[prevout.n].nValue;
+    return true;
+}
+
+bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const CStakeCandidate& candidate)
+{
+    uint256 hashProofOfStake, targetProofOfStake;
+
+    // Min age requirement, equivalent to IsConfirmedInNPrevBlocks() for an
+    // input on the main chain
+    if (candidate.IsNull() || pindexPrev->nHeight - candidate.nHeightBlockFrom < nStakeMinConfirmations - 1)
+        return false;
+
+    return CheckStakeKernelHash(pindexPrev, nBits, candidate, nTime, hashProofOfStake, targetProofOfStake);
+}
+
+bool GetStakeKernelTarget(unsigned int nBits, int64_t nValue, uint256& targetRet)
+{
+    targetRet = 0;
+
+    // Same decoding as CBigNum::SetCompact(); a negative target is never met
+    unsigned int nSize = nBits >> 24;
+    uint64_t nWord = nBits & 0x007fffff;
+    if ((nBits & 0x00800000) || nWord == 0 || nValue <= 0)
+        return true;
+    if (nSize <= 3)
+        nWord >>= 8 * (3 - nSize);
+
+    // A 23 bit mantissa times a 63 bit value fits in 86 bits
+    uint256 nProductHigh = nWord * ((uint64_t)nValue >> 32);
+    targetRet = nProductHigh << 32;
+    targetRet += nWord * ((uint64_t)nValue & 0xffffffff);
+
+    // Scale by the exponent, checking that no bits are lost
+    if (nSize > 3)
+    {
+        unsigned int nShift = 8 * (nSize - 3);
+        if (nShift >= 256 || targetRet > (~uint256(0) >> nShift))
+            return false;
+        targetRet <<= nShift;
+    }
+    return true;
+}
+
+void CStakeKernelSearch::Reset(CBlockIndex* pindexPrevIn, unsigned int nBitsIn, const std::vector<CStakeCandidate>& vCandidatesIn)
+{
+    pindexPrev = pindexPrevIn;
+    nBits = nBitsIn;
+    vCandidates.clear();
+    vchKernels.clear();
+    vTargets.clear();
+    vfUnbounded.clear();
+    if (!pindexPrev)
+        return;
+
+    vCandidates.reserve(vCandidatesIn.size());
+    BOOST_FOREACH(const CStakeCandidate& candidate, vCandidatesIn)
+    {
+        // Min age requirement
+        if (candidate.IsNull() || pindexPrev->nHeight - candidate.nHeightBlockFrom < nStakeMinConfirmations - 1)
+            continue;
+        vCandidates.push_back(candidate);
+    }
+
+    vchKernels.resize(vCandidates.size() * KERNEL_SIZE);
+    vTargets.resize(vCandidates.size());
+    vfUnbounded.resize(vCandidates.size());
+    for (size_t i = 0; i < vCandidates.size(); i++)
+    {
+        const CStakeCandidate& candidate = vCandidates[i];
+        CDataStream ss(SER_GETHASH, 0);
+        ss << pindexPrev->bnStakeModifierV2;
+        ss << candidate.nTimeTxPrev << candidate.prevout.hash << candidate.prevout.n << (unsigned int)0;
+        assert(ss.size() == KERNEL_SIZE);
+        memcpy(&vchKernels[i * KERNEL_SIZE], &ss[0], KERNEL_SIZE);
+
+        vfUnbounded[i] = !GetStakeKernelTarget(nBits, candidate.nValue, vTargets[i]);
+    }
+}
+
+bool CStakeKernelSearch::Search(unsigned int nTimeTx, int64_t nSearchInterval, size_t& nIndex, unsigned int& nTimeRet, uint256& hashProofOfStakeRet) const
+{
+    unsigned char pchKernel[KERNEL_SIZE];
+    for (; nIndex < vCandidates.size(); nIndex++)
+    {
+        boost::this_thread::interruption_point();
+
+        const CStakeCandidate& candidate = vCandidates[nIndex];
+        memcpy(pchKernel, &vchKernels[nIndex * KERNEL_SIZE], KERNEL_SIZE);
+        for (int64_t n = 0; n < nSearchInterval; n++)
+        {
+            unsigned int nTime = nTimeTx - n;
+            // Only masked timestamps can be used for a coinstake, and the
+            // kernel may not predate its input
+            if ((nTime & STAKE_TIMESTAMP_MASK) != 0)
+                continue;
+            if (nTime < candidate.nTimeTxPrev)
+                break;
+
+            memcpy(pchKernel + KERNEL_TIME_OFFSET, &nTime, sizeof(nTime));
+            uint256 hashProofOfStake = Hash_echo512(pchKernel, pchKernel + KERNEL_SIZE);
+            if (!vfUnbounded[nIndex] && hashProofOfStake > vTargets[nIndex])
+                continue;
+
+            nTimeRet = nTime;
+            hashProofOfStakeRet = hashProofOfStake;
+            return true;
+        }
+    }
+    return false;
+}
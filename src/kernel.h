@@ -15,6 +15,41 @@ static const int STAKE_TIMESTAMP_MASK = 15;
 // ratio of group interval length between the last group and the first group
 static const int MODIFIER_INTERVAL_RATIO = 3;
 
+// Everything the kernel hash needs to know about a staking input, so that
+// the kernel search can run in memory once the candidate has been loaded
+class CStakeCandidate
+{
+public:
+    COutPoint prevout;
+    uint256 hashBlockFrom;
+    int nHeightBlockFrom;
+    unsigned int nTimeBlockFrom;
+    unsigned int nTxPrevOffset;
+    unsigned int nTimeTxPrev;
+    int64_t nValue;
+
+    CStakeCandidate()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        prevout.SetNull();
+        hashBlockFrom = 0;
+        nHeightBlockFrom = -1;
+        nTimeBlockFrom = 0;
+        nTxPrevOffset = 0;
+        nTimeTxPrev = 0;
+        nValue = 0;
+    }
+
+    bool IsNull() const { return nHeightBlockFrom < 0; }
+
+    // Whether the block holding the input is still part of the main chain
+    bool IsValid() const;
+};
+
 // Compute the hash modifier for proof-of-stake
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier);
 uint256 ComputeStakeModifierV2(const CBlockIndex* pindexPrev, const uint256& kernel);
@@ -23,6 +58,8 @@ uint256 ComputeStakeModifierV2(const CBlockIndex* pindexPrev, const uint256& ker
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
 
+bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CStakeCandidate& candidate, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
+
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
 bool CheckProofOfStake(CBlockIndex* pindexPrev, const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake);
@@ -38,4 +75,49 @@ int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd);
 // Convenient for searching a kernel
 bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, int64_t* pBlockTime = NULL);
 
+// Load the kernel input of prevout from the tx index
+bool GetStakeCandidate(CTxDB& txdb, const COutPoint& prevout, CStakeCandidate& candidate);
+
+// Same as above on a preloaded candidate, without any disk access
+bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const CStakeCandidate& candidate);
+
+// Kernel search over a set of stake inputs and a window of timestamps.
+// The constant part of every kernel is serialized once, so each attempt only
+// patches the timestamp and hashes; targets are computed once per input with
+// fixed width arithmetic instead of CBigNum.
+class CStakeKernelSearch
+{
+public:
+    // Serialized kernel is modifier(32) + nTimeTxPrev(4) + prevout(36) + nTimeTx(4)
+    enum { KERNEL_SIZE = 76, KERNEL_TIME_OFFSET = 72 };
+
+    CStakeKernelSearch() : pindexPrev(NULL), nBits(0) {}
+
+    // Prepare the kernels of vCandidatesIn for staking on top of pindexPrevIn.
+    // Inputs that do not meet the min age yet are left out.
+    void Reset(CBlockIndex* pindexPrevIn, unsigned int nBitsIn, const std::vector<CStakeCandidate>& vCandidatesIn);
+    bool IsCurrent(const CBlockIndex* pindexPrevIn, unsigned int nBitsIn) const { return pindexPrev && pindexPrev == pindexPrevIn && nBits == nBitsIn; }
+    void SetNull() { Reset(NULL, 0, std::vector<CStakeCandidate>()); }
+
+    // Find the first input at or after nIndex that meets its target at a
+    // valid timestamp in (nTimeTx - nSearchInterval, nTimeTx], newest first.
+    // On success nIndex is the input found and nTimeRet its timestamp.
+    bool Search(unsigned int nTimeTx, int64_t nSearchInterval, size_t& nIndex, unsigned int& nTimeRet, uint256& hashProofOfStakeRet) const;
+
+    const CStakeCandidate& operator[](size_t i) const { return vCandidates[i]; }
+    size_t size() const { return vCandidates.size(); }
+
+private:
+    CBlockIndex* pindexPrev;
+    unsigned int nBits;
+    std::vector<CStakeCandidate> vCandidates;
+    std::vector<unsigned char> vchKernels;  // KERNEL_SIZE bytes per input
+    std::vector<uint256> vTargets;
+    std::vector<char> vfUnbounded;          // weighted target exceeds 256 bits
+};
+
+// Base target of nBits weighted by nValue, as computed by CheckStakeKernelHash().
+// Returns false if the result does not fit in 256 bits.
+bool GetStakeKernelTarget(unsigned int nBits, int64_t nValue, uint256& targetRet);
+
 #endif // PPCOIN_KERNEL_H
@@ -6,6 +6,12 @@
 #include "keystore.h"
 #include "script.h"
 
+#include <boost/functional/hash.hpp>
+
+size_t CScriptHasher::operator()(const CScript& script) const
+{
+    return boost::hash_range(script.begin(), script.end());
+}
 
 bool CKeyStore::GetPubKey(const CKeyID &address, CPubKey &vchPubKeyOut) const
 {
@@ -20,10 +26,20 @@ bool CKeyStore::AddKey(const CKey &key) {
     return AddKeyPubKey(key, key.GetPubKey());
 }
 
+void CBasicKeyStore::AddMineScripts(const CPubKey &pubkey)
+{
+    AssertLockHeld(cs_KeyStore);
+    setMineScripts.insert(GetScriptForDestination(pubkey.GetID()));
+    CScript scriptPubKey;
+    scriptPubKey << pubkey << OP_CHECKSIG;
+    setMineScripts.insert(scriptPubKey);
+}
+
 bool CBasicKeyStore::AddKeyPubKey(const CKey& key, const CPubKey &pubkey)
 {
     LOCK(cs_KeyStore);
     mapKeys[pubkey.GetID()] = key;
+    AddMineScripts(pubkey);
     return true;
 }
 
@@ -34,6 +50,7 @@ bool CBasicKeyStore::AddCScript(const CScript& redeemScript)
 
     LOCK(cs_KeyStore);
     mapScripts[redeemScript.GetID()] = redeemScript;
+    setMineScripts.insert(GetScriptForDestination(redeemScript.GetID()));
     return true;
 }
 
@@ -59,6 +76,7 @@ bool CBasicKeyStore::AddWatchOnly(const CScript &dest)
 {
     LOCK(cs_KeyStore);
     setWatchOnly.insert(dest);
+    setMineScripts.insert(dest);
     return true;
 }
 
@@ -81,3 +99,21 @@ bool CBasicKeyStore::HaveWatchOnly() const
     return (!setWatchOnly.empty());
 }
 
+
+static bool IsLongPush(const CScript &script, unsigned int nPos)
+{
+    return nPos < script.size() && script[nPos] >= OP_PUSHDATA1 && script[nPos] <= OP_PUSHDATA4;
+}
+
+bool CBasicKeyStore::MayBeMine(const CScript &script) const
+{
+    // Bare multisig is matched on its keys rather than on the whole script
+    if (!script.empty() && script.back() == OP_CHECKMULTISIG)
+        return true;
+    // Solver also accepts P2PK and P2PKH whose key or hash is pushed with
+    // OP_PUSHDATA*, which the set only holds in canonical form
+    if (IsLongPush(script, 0) || IsLongPush(script, 2))
+        return true;
+    LOCK(cs_KeyStore);
+    return setMineScripts.count(script) > 0;
+}
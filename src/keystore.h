@@ -11,6 +11,7 @@
 #include <boost/signals2/signal.hpp>
 #include "script.h"
 
+#include <boost/unordered_set.hpp>
 #include <boost/variant.hpp>
 
 class CScript;
@@ -44,12 +45,21 @@ public:
     virtual bool RemoveWatchOnly(const CScript &dest) =0;
     virtual bool HaveWatchOnly(const CScript &dest) const =0;
     virtual bool HaveWatchOnly() const =0;
+
+    // False only if IsMine() would certainly report the script as not ours
+    virtual bool MayBeMine(const CScript &script) const { return true; }
 };
 
 typedef std::map<CKeyID, CKey> KeyMap;
 typedef std::map<CScriptID, CScript > ScriptMap;
 typedef std::set<CScript> WatchOnlySet;
 
+struct CScriptHasher
+{
+    size_t operator()(const CScript& script) const;
+};
+typedef boost::unordered_set<CScript, CScriptHasher> MineScriptSet;
+
 /** Basic key store, that keeps keys in an address->secret map */
 class CBasicKeyStore : public CKeyStore
 {
@@ -58,6 +68,12 @@ protected:
     ScriptMap mapScripts;
     WatchOnlySet setWatchOnly;
 
+    // Every scriptPubKey IsMine() can match outside bare multisig: P2PKH and
+    // P2PK of each key, P2SH of each redeem script and the watch-only scripts.
+    // Entries are never removed, so the set stays a superset.
+    MineScriptSet setMineScripts;
+    void AddMineScripts(const CPubKey &pubkey);
+
 public:
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey);
     bool HaveKey(const CKeyID &address) const
@@ -103,6 +119,8 @@ public:
     virtual bool RemoveWatchOnly(const CScript &dest);
     virtual bool HaveWatchOnly(const CScript &dest) const;
     virtual bool HaveWatchOnly() const;
+
+    virtual bool MayBeMine(const CScript &script) const;
 };
 
 typedef std::map<CKeyID, std::pair<CPubKey, std::vector<unsigned char> > > CryptedKeyMap;
@@ -62,6 +62,9 @@ CBlockIndex* pindexBest = NULL;
 int64_t nTimeBestReceived = 0;
 bool fImporting = false;
 bool fReindex = false;
+uint64_t nPruneTarget = 0;
+unsigned int nPruneKeepBlocks = MIN_BLOCKS_TO_KEEP;
+bool fHavePruned = false;
 bool fAddrIndex = false;
 bool fHaveGUI = false;
 bool fRollingCheckpoint = false;
@@ -76,8 +79,17 @@ map<uint256, COrphanBlock*> mapOrphanBlocks;
 multimap<uint256, COrphanBlock*> mapOrphanBlocksByPrev;
 set<pair<COutPoint, unsigned int> > setStakeSeenOrphan;
 
-map<uint256, CTransaction> mapOrphanTransactions;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+struct COrphanTx
+{
+    CTransaction tx;
+    NodeId fromPeer;
+    int64_t nTimeExpire;
+    unsigned int nSize;
+    set<COutPoint> setMissing; // inputs whose previous transaction isn't confirmed yet
+};
+map<uint256, COrphanTx> mapOrphanTransactions;
+map<COutPoint, set<uint256> > mapOrphanTransactionsByPrev;
+void EraseOrphansFor(NodeId peer);
 
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
@@ -245,6 +257,8 @@ void FinalizeNode(NodeId nodeid) {
     BOOST_FOREACH(const uint256& hash, state->vBlocksToDownload)
         mapBlocksToDownload.erase(hash);
 
+    EraseOrphansFor(nodeid);
+
     mapNodeState.erase(nodeid);
 }
 
@@ -348,7 +362,64 @@ bool AbortNode(const std::string &strMessage, const std::string &userMessage) {
 // mapOrphanTransactions
 //
 
-bool AddOrphanTx(const CTransaction& tx)
+// Per peer bookkeeping, so that one peer can't fill the pool
+struct COrphanPeer
+{
+    size_t nBytes;
+    set<pair<int64_t, uint256> > setOrphans; // by expiry time, oldest first
+
+    COrphanPeer() : nBytes(0) {}
+};
+static map<NodeId, COrphanPeer> mapOrphanPeers;
+static size_t nOrphanBytes = 0;
+static int64_t nNextOrphanSweep = 0;
+
+// Confirmed transactions whose outputs orphans may be waiting for, filled
+// while connecting blocks and drained by RetryOrphans() once the new tip is set
+static vector<uint256> vOrphanParentsConfirmed;
+
+void static EraseOrphanTx(uint256 hash)
+{
+    map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
+    if (it == mapOrphanTransactions.end())
+        return;
+    const COrphanTx& orphan = it->second;
+    BOOST_FOREACH(const COutPoint& prevout, orphan.setMissing)
+    {
+        map<COutPoint, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(prevout);
+        if (itPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+        itPrev->second.erase(hash);
+        if (itPrev->second.empty())
+            mapOrphanTransactionsByPrev.erase(itPrev);
+    }
+
+    map<NodeId, COrphanPeer>::iterator itPeer = mapOrphanPeers.find(orphan.fromPeer);
+    if (itPeer != mapOrphanPeers.end())
+    {
+        itPeer->second.nBytes -= orphan.nSize;
+        itPeer->second.setOrphans.erase(make_pair(orphan.nTimeExpire, hash));
+        if (itPeer->second.setOrphans.empty())
+            mapOrphanPeers.erase(itPeer);
+    }
+    nOrphanBytes -= orphan.nSize;
+    mapOrphanTransactions.erase(it);
+}
+
+// Index the inputs of an orphan that still wait for a confirmed parent.
+// Returns false if none do.
+bool static IndexOrphanTx(CTxDB& txdb, const uint256& hash, COrphanTx& orphan)
+{
+    orphan.setMissing.clear();
+    BOOST_FOREACH(const CTxIn& txin, orphan.tx.vin)
+        if (!txdb.ContainsTx(txin.prevout.hash))
+            orphan.setMissing.insert(txin.prevout);
+    BOOST_FOREACH(const COutPoint& prevout, orphan.setMissing)
+        mapOrphanTransactionsByPrev[prevout].insert(hash);
+    return !orphan.setMissing.empty();
+}
+
+bool AddOrphanTx(CTxDB& txdb, const CTransaction& tx, NodeId peer)
 {
     uint256 hash = tx.GetHash();
     if (mapOrphanTransactions.count(hash))
@@ -370,48 +441,141 @@ bool AddOrphanTx(const CTransaction& tx)
         return false;
     }
 
-    mapOrphanTransactions[hash] = tx;
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    orphan.tx = tx;
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nSize = nSize;
+    if (!IndexOrphanTx(txdb, hash, orphan))
+    {
+        mapOrphanTransactions.erase(hash);
+        return false;
+    }
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u)\n", hash.ToString(),
-        mapOrphanTransactions.size());
-    return true;
+    COrphanPeer& orphanPeer = mapOrphanPeers[peer];
+    orphanPeer.nBytes += nSize;
+    orphanPeer.setOrphans.insert(make_pair(orphan.nTimeExpire, hash));
+    nOrphanBytes += nSize;
+
+    // A single peer may only use a share of the pool, drop its oldest
+    size_t nMaxPeerBytes = GetArg("-maxorphantxsize", DEFAULT_MAX_ORPHAN_TX_SIZE) * 1000000 / ORPHAN_TX_PEER_SHARE;
+    while (mapOrphanPeers.count(peer) && mapOrphanPeers[peer].nBytes > nMaxPeerBytes)
+        EraseOrphanTx(mapOrphanPeers[peer].setOrphans.begin()->second);
+
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u, %u bytes)\n", hash.ToString(),
+        mapOrphanTransactions.size(), nOrphanBytes);
+    return mapOrphanTransactions.count(hash);
 }
 
-void static EraseOrphanTx(uint256 hash)
+void EraseOrphansFor(NodeId peer)
 {
-    map<uint256, CTransaction>::iterator it = mapOrphanTransactions.find(hash);
-    if (it == mapOrphanTransactions.end())
+    map<NodeId, COrphanPeer>::iterator itPeer = mapOrphanPeers.find(peer);
+    if (itPeer == mapOrphanPeers.end())
         return;
-    BOOST_FOREACH(const CTxIn& txin, it->second.vin)
-    {
-        map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
-        if (itPrev == mapOrphanTransactionsByPrev.end())
-            continue;
-        itPrev->second.erase(hash);
-        if (itPrev->second.empty())
-            mapOrphanTransactionsByPrev.erase(itPrev);
-    }
-    mapOrphanTransactions.erase(it);
+    vector<uint256> vErase;
+    for (set<pair<int64_t, uint256> >::const_iterator mi = itPeer->second.setOrphans.begin(); mi != itPeer->second.setOrphans.end(); ++mi)
+        vErase.push_back(mi->second);
+    BOOST_FOREACH(const uint256& hash, vErase)
+        EraseOrphanTx(hash);
+    LogPrint("mempool", "Erased %d orphan tx from peer %d\n", vErase.size(), peer);
 }
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxBytes)
 {
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
-    {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, CTransaction>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
+
+    // Sweep out expired orphans every few minutes
+    int64_t nNow = GetTime();
+    if (nNextOrphanSweep <= nNow)
+    {
+        vector<uint256> vExpired;
+        for (map<uint256, COrphanTx>::const_iterator mi = mapOrphanTransactions.begin(); mi != mapOrphanTransactions.end(); ++mi)
+            if (mi->second.nTimeExpire <= nNow)
+                vExpired.push_back(mi->first);
+        BOOST_FOREACH(const uint256& hash, vExpired)
+            EraseOrphanTx(hash);
+        nEvicted += vExpired.size();
+        nNextOrphanSweep = nNow + ORPHAN_TX_EXPIRE_INTERVAL;
+        if (!vExpired.empty())
+            LogPrint("mempool", "Erased %d expired orphan tx\n", vExpired.size());
+    }
+
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanBytes > nMaxBytes)
+    {
+        // Evict the oldest orphan of the peer holding the most bytes
+        map<NodeId, COrphanPeer>::iterator itLargest = mapOrphanPeers.begin();
+        for (map<NodeId, COrphanPeer>::iterator mi = mapOrphanPeers.begin(); mi != mapOrphanPeers.end(); ++mi)
+            if (mi->second.nBytes > itLargest->second.nBytes)
+                itLargest = mi;
+        if (itLargest == mapOrphanPeers.end())
+            break;
+        EraseOrphanTx(itLargest->second.setOrphans.begin()->second);
         ++nEvicted;
     }
     return nEvicted;
 }
 
+// Retry, as one batch, the orphans whose last missing input was created by a
+// transaction that has just been confirmed. Orphans are not retried when a
+// parent only enters the memory pool: acceptance requires confirmed inputs.
+void static RetryOrphans()
+{
+    vector<uint256> vParents;
+    vParents.swap(vOrphanParentsConfirmed);
+    if (mapOrphanTransactions.empty())
+        return;
+
+    set<uint256> setUnblocked;
+    BOOST_FOREACH(const uint256& hashParent, vParents)
+    {
+        map<COutPoint, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.lower_bound(COutPoint(hashParent, 0));
+        while (itPrev != mapOrphanTransactionsByPrev.end() && itPrev->first.hash == hashParent)
+        {
+            BOOST_FOREACH(const uint256& hash, itPrev->second)
+            {
+                COrphanTx& orphan = mapOrphanTransactions[hash];
+                orphan.setMissing.erase(itPrev->first);
+                if (orphan.setMissing.empty())
+                    setUnblocked.insert(hash);
+            }
+            mapOrphanTransactionsByPrev.erase(itPrev++);
+        }
+    }
+    if (setUnblocked.empty())
+        return;
+
+    vector<uint256> vOrphanHash(setUnblocked.begin(), setUnblocked.end());
+    vector<CTransaction> vOrphanTx;
+    BOOST_FOREACH(const uint256& hash, vOrphanHash)
+        vOrphanTx.push_back(mapOrphanTransactions[hash].tx);
+
+    vector<int> vResult;
+    AcceptToMemoryPoolBatch(mempool, vOrphanTx, true, vResult);
+
+    CTxDB txdb("r");
+    for (unsigned int i = 0; i < vOrphanHash.size(); i++)
+    {
+        const uint256& hash = vOrphanHash[i];
+        if (vResult[i] == BATCH_ACCEPTED)
+        {
+            LogPrint("mempool", "   accepted orphan tx %s\n", hash.ToString());
+            RelayTransaction(vOrphanTx[i], hash);
+        }
+        else if (vResult[i] == BATCH_MISSING_INPUTS && IndexOrphanTx(txdb, hash, mapOrphanTransactions[hash]))
+        {
+            // Still waiting on another parent
+            continue;
+        }
+        else
+        {
+            // Has inputs but not accepted to mempool
+            // Probably non-standard or insufficient fee/priority
+            LogPrint("mempool", "   removed orphan tx %s\n", hash.ToString());
+        }
+        EraseOrphanTx(hash);
+    }
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // CTransaction and CTxIndex
@@ -822,8 +986,18 @@ int64_t GetMinFee(const CTransaction& tx, unsigned int nBytes, bool fAllowFree,
 }
 
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees, bool fFixSpentCoins)
+void LimitMempoolSize(CTxMemPool& pool, size_t nLimit, int64_t nAge)
+{
+    int nExpired = pool.Expire(GetTime() - nAge);
+    if (nExpired != 0)
+        LogPrint("mempool", "Expired %i transactions from the memory pool\n", nExpired);
+
+    pool.TrimToSize(nLimit);
+}
+
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectInsaneFee, bool ignoreFees,
+                                bool fFixSpentCoins, bool fScriptsChecked)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -875,6 +1049,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
     }
     }
 
+    CTxMemPoolEntry entry;
     {
         CTxDB txdb("r");
 
@@ -961,6 +1136,16 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
             }
         }
 
+        // Once the pool has been full, require the fee rate it was trimmed at
+        if (!ignoreFees && !mapMNengineBroadcastTxes.count(hash))
+        {
+            int64_t nMempoolMinFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000) * nSize / 1000;
+            if (fLimitFree && nFees < nMempoolMinFee)
+                return error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                            hash.ToString(),
+                            nFees, nMempoolMinFee);
+        }
+
         if (fRejectInsaneFee && nFees > MIN_RELAY_TX_FEE * 10000)
             return error("AcceptableInputs: : insane fees %s, %d > %d",
                          hash.ToString(),
@@ -968,7 +1153,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, STANDARD_SCRIPT_VERIFY_FLAGS))
+        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, STANDARD_SCRIPT_VERIFY_FLAGS, !fScriptsChecked))
         {
             return error("AcceptToMemoryPool : ConnectInputs failed %s", hash.ToString());
         }
@@ -982,25 +1167,165 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, MANDATORY_SCRIPT_VERIFY_FLAGS))
+        if (!fScriptsChecked && !tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, MANDATORY_SCRIPT_VERIFY_FLAGS))
         {
             return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
+
+        // Priority is sum(valuein * age) / txsize; it keeps aging in the pool
+        double dPriority = 0;
+        int64_t nInChainInputValue = 0;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            const pair<CTxIndex, CTransaction>& prev = mapInputs[txin.prevout.hash];
+            int64_t nValueIn = prev.second.vout[txin.prevout.n].nValue;
+            nInChainInputValue += nValueIn;
+            dPriority += (double)nValueIn * prev.first.GetDepthInMainChain();
+        }
+        entry = CTxMemPoolEntry(tx, nFees, nAcceptTime, dPriority / nSize, nBestHeight, nInChainInputValue, nSigOps);
     }
 
     // Store transaction in memory
-    pool.addUnchecked(hash, tx);
+    pool.addUnchecked(hash, entry);
+
+    LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+    if (!pool.exists(hash))
+        return error("AcceptToMemoryPool : mempool full, %s not accepted", hash.ToString());
+
     setValidatedTx.insert(hash);
+    if (&pool == &mempool)
+        WakeStakeMiner(STAKE_WAKE_TX);
 
     SyncWithWallets(tx, NULL, true, fFixSpentCoins);
 
     LogPrint("mempool", "AcceptToMemoryPool : accepted %s (poolsz %u)\n",
            hash.ToString(),
-           pool.mapTx.size());
+           pool.size());
 
     return true;
 }
 
+bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees, bool fFixSpentCoins)
+{
+    return AcceptToMemoryPoolWithTime(pool, tx, fLimitFree, pfMissingInputs, GetTime(), fRejectInsaneFee, ignoreFees, fFixSpentCoins, false);
+}
+
+// Input lookup and script verification for a batch of loose transactions,
+// spread over worker threads that each use their own CTxDB handle. Neither
+// needs cs_main: a previous transaction never changes once it is on disk,
+// and whether its outputs are still unspent is checked again on acceptance.
+class CTxBatchChecker
+{
+public:
+    const vector<CTransaction>& vtx;
+    vector<int> vState; // 1 scripts valid, -1 invalid, 0 some input not on disk
+
+    CTxBatchChecker(const vector<CTransaction>& vtxIn) : vtx(vtxIn), vState(vtxIn.size(), 0) {}
+
+    void Check(unsigned int nWorker, unsigned int nWorkers)
+    {
+        CTxDB txdb("r");
+        map<uint256, CTransaction> mapPrevTx;
+        for (unsigned int i = nWorker; i < vtx.size(); i += nWorkers)
+        {
+            const CTransaction& tx = vtx[i];
+            int nState = 1;
+            for (unsigned int n = 0; n < tx.vin.size() && nState == 1; n++)
+            {
+                const COutPoint& prevout = tx.vin[n].prevout;
+                map<uint256, CTransaction>::iterator mi = mapPrevTx.find(prevout.hash);
+                if (mi == mapPrevTx.end())
+                {
+                    CTransaction txPrev;
+                    if (!txdb.ReadDiskTx(prevout.hash, txPrev))
+                    {
+                        nState = 0;
+                        break;
+                    }
+                    mi = mapPrevTx.insert(make_pair(prevout.hash, txPrev)).first;
+                }
+                if (prevout.n >= mi->second.vout.size())
+                    nState = 0;
+                else if (!VerifySignature(mi->second, tx, n, STANDARD_SCRIPT_VERIFY_FLAGS, 0))
+                    nState = -1;
+            }
+            vState[i] = nState;
+        }
+    }
+};
+
+void AcceptToMemoryPoolBatch(CTxMemPool& pool, vector<CTransaction>& vtx, bool fLimitFree,
+                             vector<int>& vResult, const vector<int64_t>* pvAcceptTime)
+{
+    vResult.assign(vtx.size(), BATCH_REJECTED);
+    if (vtx.empty())
+        return;
+
+    CTxBatchChecker checker(vtx);
+    unsigned int nWorkers = std::min((unsigned int)vtx.size() / 4, std::min(boost::thread::hardware_concurrency(), 8u));
+    if (nWorkers <= 1)
+        checker.Check(0, 1);
+    else
+    {
+        boost::thread_group threads;
+        for (unsigned int i = 0; i < nWorkers; i++)
+            threads.create_thread(boost::bind(&CTxBatchChecker::Check, &checker, i, nWorkers));
+        threads.join_all();
+    }
+
+    // Order the batch so that transactions spending outputs of other batch
+    // members come after them
+    map<uint256, unsigned int> mapIndex;
+    for (unsigned int i = 0; i < vtx.size(); i++)
+        mapIndex[vtx[i].GetHash()] = i;
+    vector<vector<unsigned int> > vChildren(vtx.size());
+    vector<unsigned int> vParents(vtx.size(), 0);
+    for (unsigned int i = 0; i < vtx.size(); i++)
+    {
+        BOOST_FOREACH(const CTxIn& txin, vtx[i].vin)
+        {
+            map<uint256, unsigned int>::const_iterator mi = mapIndex.find(txin.prevout.hash);
+            if (mi != mapIndex.end() && mi->second != i)
+            {
+                vChildren[mi->second].push_back(i);
+                vParents[i]++;
+            }
+        }
+    }
+    vector<unsigned int> vOrder;
+    vOrder.reserve(vtx.size());
+    for (unsigned int i = 0; i < vtx.size(); i++)
+        if (vParents[i] == 0)
+            vOrder.push_back(i);
+    for (unsigned int k = 0; k < vOrder.size(); k++)
+        BOOST_FOREACH(unsigned int nChild, vChildren[vOrder[k]])
+            if (--vParents[nChild] == 0)
+                vOrder.push_back(nChild);
+
+    // Accept under cs_main, 100 at a time so that block processing isn't
+    // held up by a large batch
+    for (unsigned int k = 0; k < vOrder.size(); )
+    {
+        LOCK(cs_main);
+        for (unsigned int nEnd = std::min(k + 100, (unsigned int)vOrder.size()); k < nEnd; k++)
+        {
+            unsigned int i = vOrder[k];
+            if (checker.vState[i] < 0)
+            {
+                LogPrint("mempool", "AcceptToMemoryPoolBatch : script check failed %s\n", vtx[i].GetHash().ToString());
+                continue;
+            }
+            bool fMissingInputs = false;
+            int64_t nAcceptTime = pvAcceptTime ? (*pvAcceptTime)[i] : GetTime();
+            if (AcceptToMemoryPoolWithTime(pool, vtx[i], fLimitFree, &fMissingInputs, nAcceptTime, false, false, false, checker.vState[i] > 0))
+                vResult[i] = BATCH_ACCEPTED;
+            else if (fMissingInputs)
+                vResult[i] = BATCH_MISSING_INPUTS;
+        }
+    }
+}
+
 bool AcceptableInputs(CTxMemPool& pool, const CTransaction &txo, bool fLimitFree,
                          bool* pfMissingInputs, bool fRejectInsaneFee, bool isDSTX)
 {
@@ -1142,7 +1467,7 @@ bool AcceptableInputs(CTxMemPool& pool, const CTransaction &txo, bool fLimitFree
 
     /*LogPrint("mempool", "AcceptableInputs : accepted %s (poolsz %u)\n",
            hash.ToString(),
-           pool.mapTx.size());
+           pool.size());
     */
     return true;
 }
@@ -1798,10 +2123,30 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
 
 bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
-    // Disconnect in reverse order
-    for (int i = vtx.size()-1; i >= 0; i--)
-        if (!vtx[i].DisconnectInputs(txdb))
-            return false;
+    uint256 hashBlock = pindex->GetBlockHash();
+
+    // Blocks connected with undo data are rolled back from one sequential
+    // read; older blocks fall back to rewriting each spent txindex.
+    CDiskBlockPos posUndo;
+    CBlockUndo blockundo;
+    if (txdb.ReadBlockUndoPos(hashBlock, posUndo) && blockundo.ReadFromDisk(posUndo, hashBlock))
+    {
+        for (int i = vtx.size()-1; i >= 0; i--)
+            txdb.EraseTxIndex(vtx[i]);
+
+        BOOST_FOREACH(const PAIRTYPE(uint256, CTxIndex)& item, blockundo.vtxindexPrev)
+            if (!txdb.UpdateTxIndex(item.first, item.second))
+                return error("DisconnectBlock() : UpdateTxIndex failed");
+
+        txdb.EraseBlockUndoPos(hashBlock);
+    }
+    else
+    {
+        // Disconnect in reverse order
+        for (int i = vtx.size()-1; i >= 0; i--)
+            if (!vtx[i].DisconnectInputs(txdb))
+                return false;
+    }
 
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
@@ -1944,6 +2289,8 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
     map<uint256, CTxIndex> mapQueuedChanges;
+    CBlockUndo blockundo;
+    set<uint256> setSpentPrev;
     int64_t nFees = 0;
     int64_t nValueIn = 0;
     int64_t nValueOut = 0;
@@ -1998,6 +2345,19 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             if (tx.IsCoinStake())
                 nStakeReward = nTxValueOut - nTxValueIn;
 
+            // Remember the pre-block state of each txindex we are about to
+            // mark spent. The first fetch of a prev tx always comes from the
+            // db, later ones see mapQueuedChanges and are skipped here.
+            if (!fJustCheck)
+            {
+                BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                {
+                    const uint256& hashPrev = txin.prevout.hash;
+                    if (mapQueuedChanges.count(hashPrev) || !setSpentPrev.insert(hashPrev).second)
+                        continue;
+                    blockundo.vtxindexPrev.push_back(make_pair(hashPrev, mapInputs[hashPrev].first));
+                }
+            }
 
             if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags))
                 return false;
@@ -2044,6 +2404,14 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return error("ConnectBlock() : UpdateTxIndex failed");
     }
 
+    // Write undo data next to the block so a disconnect never has to
+    // reconstruct spent pointers from the index
+    CDiskBlockPos posUndo(pindex->nFile, 0);
+    if (!blockundo.WriteToDisk(posUndo, pindex->GetBlockHash()))
+        return error("ConnectBlock() : CBlockUndo::WriteToDisk failed");
+    if (!txdb.WriteBlockUndoPos(pindex->GetBlockHash(), posUndo))
+        return error("ConnectBlock() : WriteBlockUndoPos failed");
+
     if(GetBoolArg("-addrindex", false))
     {
         // Write Address Index
@@ -2232,10 +2600,9 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         AcceptToMemoryPool(mempool, tx, false, NULL);
 
     // Delete redundant memory transactions that are in the connected branch
-    BOOST_FOREACH(CTransaction& tx, vDelete) {
-        mempool.remove(tx);
-        mempool.removeConflicts(tx);
-    }
+    mempool.removeForBlock(vDelete);
+    BOOST_FOREACH(const CTransaction& tx, vDelete)
+        vOrphanParentsConfirmed.push_back(tx.GetHash());
 
     LogPrintf("REORGANIZE: done\n");
 
@@ -2262,8 +2629,9 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
     pindexNew->pprev->pnext = pindexNew;
 
     // Delete redundant memory transactions
-    BOOST_FOREACH(CTransaction& tx, vtx)
-        mempool.remove(tx);
+    mempool.removeForBlock(vtx);
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+        vOrphanParentsConfirmed.push_back(tx.GetHash());
 
     return true;
 }
@@ -2272,6 +2640,11 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
 {
     uint256 hash = GetHash();
 
+    // The txdb is written without sync during initial download and may
+    // reach disk in any order relative to the block files, so every block
+    // the new best chain references must be on disk before it is recorded
+    FlushBlockFile();
+
     if (!txdb.TxnBegin())
         return error("SetBestChain() : TxnBegin failed");
 
@@ -2335,6 +2708,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
 
     // Update best block in wallet (so we can detect restored wallets)
     bool fIsInitialDownload = IsInitialBlockDownload();
+    txdb.SetInitialDownload(fIsInitialDownload);
     if ((pindexNew->nHeight % 20160) == 0 || (!fIsInitialDownload && (pindexNew->nHeight % 144) == 0))
     {
         const CBlockLocator locator(pindexNew);
@@ -2349,6 +2723,10 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
+    WakeStakeMiner(STAKE_WAKE_TIP);
+
+    // Orphans waiting on the transactions just confirmed
+    RetryOrphans();
 
     uint256 nBestBlockTrust = pindexBest->nHeight != 0 ? (pindexBest->nChainTrust - pindexBest->pprev->nChainTrust) : pindexBest->nChainTrust;
 
@@ -3070,7 +3448,7 @@ void Misbehaving(NodeId pnode, int howmuch)
         LogPrintf("Misbehaving: %s (%d -> %d)\n", state->name.c_str(), state->nMisbehavior-howmuch, state->nMisbehavior);
 }
 
-bool ProcessBlock(CNode* pfrom, CBlock* pblock)
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool fPrechecked)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
@@ -3105,8 +3483,9 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
         return error("ProcessBlock(): bad block signature encoding");
     }
 
-    // Preliminary checks
-    if (!pblock->CheckBlock())
+    // Preliminary checks. Imported blocks had their proof of work, signature
+    // and merkle root verified by the import workers already.
+    if (!pblock->CheckBlock(!fPrechecked, !fPrechecked, !fPrechecked))
         return error("ProcessBlock() : CheckBlock FAILED");
 
     // If we don't already have its previous block, shunt it off to holding area until we get it
@@ -3236,6 +3615,7 @@ bool CBlock::SignBlock(CWallet& wallet, int64_t nFees)
         return true;
 
     static int64_t nLastCoinStakeSearchTime = GetAdjustedTime(); // startup timestamp
+    static uint256 hashLastCoinStakeSearchPrev = 0;
 
     CKey key;
     CTransaction txCoinStake;
@@ -3243,7 +3623,8 @@ bool CBlock::SignBlock(CWallet& wallet, int64_t nFees)
 
     int64_t nSearchTime = txCoinStake.nTime; // search to current time
 
-    if (nSearchTime > nLastCoinStakeSearchTime)
+    // A new tip brings a new stake modifier, so search the current slot again
+    if (nSearchTime > nLastCoinStakeSearchTime || hashPrevBlock != hashLastCoinStakeSearchPrev)
     {
         int64_t nSearchInterval = 1;
         if (wallet.CreateCoinStake(wallet, nBits, nSearchInterval, nFees, txCoinStake, key))
@@ -3266,8 +3647,10 @@ bool CBlock::SignBlock(CWallet& wallet, int64_t nFees)
                 return key.Sign(GetHash(), vchBlockSig);
             }
         }
-        nLastCoinStakeSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
+        if (nSearchTime > nLastCoinStakeSearchTime)
+            nLastCoinStakeSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
         nLastCoinStakeSearchTime = nSearchTime;
+        hashLastCoinStakeSearchPrev = hashPrevBlock;
     }
 
     return false;
@@ -3331,7 +3714,7 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
         return NULL;
     if (nBlockPos != 0 && !strchr(pszMode, 'a') && !strchr(pszMode, 'w'))
     {
-        if (fseek(file, nBlockPos, SEEK_SET) != 0)
+        if (!FileSeek(file, nBlockPos))
         {
             fclose(file);
             return NULL;
@@ -3342,25 +3725,236 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
 
 static unsigned int nCurrentBlockFile = 1;
 
-FILE* AppendBlockFile(unsigned int& nFileRet)
+// The block file being appended to is kept open between writes. Files are
+// preallocated in chunks, so the append position is tracked here rather
+// than taken from the file size.
+static FILE* fileCurrentBlock = NULL;
+static unsigned int nCurrentBlockFileEnd = 0;
+static unsigned int nCurrentBlockFileAlloc = 0;
+static unsigned int nCurrentBlockFileLastPos = 0;
+static bool fBlockFileDirty = false;
+
+// Locates the end of block data in a (possibly preallocated) block file
+// from the position of the last indexed block in it.
+static bool FindBlockFileEnd(FILE* file, unsigned int nLastBlockPos, unsigned int& nEndRet)
+{
+    nEndRet = 0;
+    if (nLastBlockPos == 0)
+        return true;
+
+    unsigned int nSize = 0;
+    if (!FileSeek(file, nLastBlockPos - sizeof(nSize)) || fread(&nSize, sizeof(nSize), 1, file) != 1)
+        return false;
+    nEndRet = nLastBlockPos + nSize;
+    return true;
+}
+
+FILE* AppendBlockFile(unsigned int& nFileRet, unsigned int nAddSize)
 {
     nFileRet = 0;
+
+    // FAT32 file size max 4GB and the index stores 32-bit block positions.
+    // Pruning nodes use much smaller files so old history can be released
+    unsigned int nMaxFileSize = nPruneTarget ? PRUNE_BLOCKFILE_SIZE : MAX_BLOCKFILE_SIZE;
+
     while (true)
     {
-        FILE* file = OpenBlockFile(nCurrentBlockFile, 0, "ab");
-        if (!file)
-            return NULL;
-        if (fseek(file, 0, SEEK_END) != 0)
-            return NULL;
-        // FAT32 file size max 4GB, fseek and ftell max 2GB, so we must stay under 2GB
-        if (ftell(file) < (long)(0x7F000000 - MAX_SIZE))
+        if (!fileCurrentBlock)
         {
-            nFileRet = nCurrentBlockFile;
-            return file;
+            fileCurrentBlock = OpenBlockFile(nCurrentBlockFile, 0, "rb+");
+            if (!fileCurrentBlock)
+                fileCurrentBlock = OpenBlockFile(nCurrentBlockFile, 0, "wb+");
+            if (!fileCurrentBlock)
+                return NULL;
+            if (!FindBlockFileEnd(fileCurrentBlock, nCurrentBlockFileLastPos, nCurrentBlockFileEnd))
+            {
+                fclose(fileCurrentBlock);
+                fileCurrentBlock = NULL;
+                return NULL;
+            }
+            nCurrentBlockFileLastPos = 0;
+            if (!FileSeek(fileCurrentBlock, 0, SEEK_END))
+                return NULL;
+            int64_t nFileSize = FileTell(fileCurrentBlock);
+            nCurrentBlockFileAlloc = nFileSize < 0 ? 0 : (unsigned int)std::min(nFileSize, (int64_t)MAX_BLOCKFILE_SIZE);
         }
-        fclose(file);
+
+        if ((uint64_t)nCurrentBlockFileEnd + nAddSize < nMaxFileSize)
+            break;
+
+        // Move on to the next file, releasing the unused preallocated tail
+        FlushBlockFile(true);
+        fclose(fileCurrentBlock);
+        fileCurrentBlock = NULL;
         nCurrentBlockFile++;
     }
+
+    if (nCurrentBlockFileEnd + nAddSize > nCurrentBlockFileAlloc)
+    {
+        unsigned int nNewChunks = (nCurrentBlockFileEnd + nAddSize + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE;
+        unsigned int nNewAlloc = std::min(nNewChunks * BLOCKFILE_CHUNK_SIZE, nMaxFileSize);
+        if (nNewAlloc > nCurrentBlockFileAlloc && CheckDiskSpace(nNewAlloc - nCurrentBlockFileAlloc))
+        {
+            AllocateFileRange(fileCurrentBlock, nCurrentBlockFileAlloc, nNewAlloc - nCurrentBlockFileAlloc);
+            nCurrentBlockFileAlloc = nNewAlloc;
+        }
+    }
+
+    if (!FileSeek(fileCurrentBlock, nCurrentBlockFileEnd))
+        return NULL;
+    nFileRet = nCurrentBlockFile;
+    return fileCurrentBlock;
+}
+
+void FlushBlockFile(bool fFinalize)
+{
+    LOCK(cs_main);
+
+    if (!fileCurrentBlock || (!fFinalize && !fBlockFileDirty))
+        return;
+    if (fFinalize && TruncateFile(fileCurrentBlock, nCurrentBlockFileEnd))
+        nCurrentBlockFileAlloc = nCurrentBlockFileEnd;
+    FileCommit(fileCurrentBlock);
+    fBlockFileDirty = false;
+}
+
+bool CBlock::WriteToDisk(unsigned int& nFileRet, unsigned int& nBlockPosRet)
+{
+    LOCK(cs_main);
+
+    // Open history file to append. The handle stays owned by AppendBlockFile.
+    unsigned int nSize = ::GetSerializeSize(*this, SER_DISK, CLIENT_VERSION);
+    CAutoFile fileout = CAutoFile(AppendBlockFile(nFileRet, nSize + MESSAGE_START_SIZE + sizeof(nSize)), SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("CBlock::WriteToDisk() : AppendBlockFile failed");
+
+    try {
+        // Write index header
+        fileout << FLATDATA(Params().MessageStart()) << nSize;
+
+        // Write block
+        int64_t nFileOutPos = FileTell(fileout);
+        if (nFileOutPos < 0)
+        {
+            fileout.release();
+            return error("CBlock::WriteToDisk() : ftell failed");
+        }
+        nBlockPosRet = (unsigned int)nFileOutPos;
+        fileout << *this;
+    }
+    catch (std::exception &e) {
+        fileout.release();
+        return error("%s() : I/O error", __PRETTY_FUNCTION__);
+    }
+    nCurrentBlockFileEnd = nBlockPosRet + nSize;
+
+    // Flush stdio buffers so readers see the block. During initial download
+    // the data sync is left to SetBestChain, which commits the file before
+    // the txdb batch that makes this block part of the best chain.
+    fflush(fileout);
+    if (IsInitialBlockDownload())
+        fBlockFileDirty = true;
+    else
+        FileCommit(fileout);
+
+    fileout.release();
+    return true;
+}
+
+static uint64_t GetBlockFileSize(const filesystem::path& path)
+{
+    boost::system::error_code ec;
+    uint64_t nSize = filesystem::file_size(path, ec);
+    return ec ? 0 : nSize;
+}
+
+static uint64_t CalculateBlockFilesSize()
+{
+    uint64_t nTotal = 0;
+    for (unsigned int nFile = 1; nFile <= nCurrentBlockFile; nFile++)
+    {
+        nTotal += GetBlockFileSize(BlockFilePath(nFile));
+        nTotal += GetBlockFileSize(GetBlockPosFilename(CDiskBlockPos(nFile, 0), "rev"));
+    }
+    return nTotal;
+}
+
+void PruneBlockFiles()
+{
+    static int nLastPruneCheckHeight = 0;
+
+    uint64_t nSize;
+    unsigned int nKeepFromFile;
+    {
+        LOCK(cs_main);
+        if (!nPruneTarget || !pindexBest)
+            return;
+
+        // The in-use scan walks the whole tx index, so only look again after
+        // a reasonable amount of new data has been written
+        if (nLastPruneCheckHeight && nBestHeight < nLastPruneCheckHeight + 500)
+            return;
+        nLastPruneCheckHeight = nBestHeight;
+
+        nSize = CalculateBlockFilesSize();
+        if (nSize <= nPruneTarget)
+            return;
+
+        // Never touch files holding blocks inside the retained window
+        nKeepFromFile = nCurrentBlockFile;
+        CBlockIndex* pindex = pindexBest;
+        for (unsigned int i = 0; pindex && i < nPruneKeepBlocks; i++, pindex = pindex->pprev)
+            nKeepFromFile = std::min(nKeepFromFile, pindex->nFile);
+        if (pindex == NULL)
+            return;
+    }
+
+    // Validation still reads unspent outputs, and outputs spent inside the
+    // window may be needed again if those spends are reorganized away. The
+    // scan reads a snapshot of the tx index, so it runs without cs_main;
+    // blocks connected meanwhile only make files it found in use less so.
+    CTxDB txdb("r+");
+    set<unsigned int> setFilesInUse;
+    if (!txdb.FindBlockFilesInUse(nKeepFromFile, setFilesInUse))
+        return;
+
+    LOCK(cs_main);
+    int64_t nStart = GetTimeMillis();
+    vector<pair<unsigned int, uint64_t> > vPrune;
+    for (unsigned int nFile = 1; nFile < nKeepFromFile && nSize > nPruneTarget; nFile++)
+    {
+        if (setFilesInUse.count(nFile))
+            continue;
+        uint64_t nFileSize = GetBlockFileSize(BlockFilePath(nFile)) + GetBlockFileSize(GetBlockPosFilename(CDiskBlockPos(nFile, 0), "rev"));
+        if (nFileSize == 0)
+            continue;
+        vPrune.push_back(make_pair(nFile, nFileSize));
+        nSize -= std::min(nSize, nFileSize);
+    }
+    if (vPrune.empty())
+        return;
+
+    // Record that history is missing before any of it goes, so a crash
+    // can't leave a node that believes it has every block
+    if (!fHavePruned)
+    {
+        if (!txdb.WritePrunedFlag(true))
+        {
+            LogPrintf("PruneBlockFiles() : Error: writing the pruned flag failed\n");
+            return;
+        }
+        fHavePruned = true;
+    }
+
+    for (unsigned int i = 0; i < vPrune.size(); i++)
+    {
+        boost::system::error_code ec;
+        filesystem::remove(BlockFilePath(vPrune[i].first), ec);
+        filesystem::remove(GetBlockPosFilename(CDiskBlockPos(vPrune[i].first, 0), "rev"), ec);
+        LogPrint("prune", "Pruned block file %u (%d bytes)\n", vPrune[i].first, vPrune[i].second);
+    }
+    LogPrintf("PruneBlockFiles() : removed %u block files in %dms, %dMB of block data left\n",
+        vPrune.size(), GetTimeMillis() - nStart, nSize / 1048576);
 }
 
 bool LoadBlockIndex(bool fAllowNew)
@@ -3374,6 +3968,14 @@ bool LoadBlockIndex(bool fAllowNew)
     if (!txdb.LoadBlockIndex())
         return false;
 
+    // Continue appending after the newest file in use instead of recreating
+    // files that may have been pruned
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        nCurrentBlockFile = std::max(nCurrentBlockFile, item.second->nFile);
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        if (item.second->nFile == nCurrentBlockFile)
+            nCurrentBlockFileLastPos = std::max(nCurrentBlockFileLastPos, item.second->nBlockPos);
+
     //
     // Init with genesis block
     //
@@ -3470,63 +4072,260 @@ void PrintBlockTree()
     }
 }
 
-bool LoadExternalBlockFile(FILE* fileIn)
+namespace {
+
+/** A block travelling through the import pipeline */
+struct CImportBlock
 {
-    int64_t nStart = GetTimeMillis();
+    std::vector<char> vchBlock;
+    size_t nSize;
+    CBlock block;
+    bool fValid;
+};
 
-    int nLoaded = 0;
+/** Three stage block file importer. A reader thread carves raw blocks out
+ *  of the file with large sequential reads, worker threads deserialize them
+ *  and run the checks that need no chain context (proof of work, block
+ *  signature, merkle root, transaction sanity), and the calling thread
+ *  hands the results to ProcessBlock strictly in file order.
+ */
+class CBlockImporter
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condReader;
+    boost::condition_variable condWorker;
+    boost::condition_variable condConnect;
+
+    FILE* fileIn;
+    std::deque<std::pair<uint64_t, CImportBlock*> > queueRaw;
+    std::map<uint64_t, CImportBlock*> mapChecked;
+    uint64_t nRead;
+    unsigned int nInFlight;
+    uint64_t nBytesInFlight;
+    bool fReadDone;
+    bool fAbort;
+
+    bool Aborted()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return fAbort;
+    }
+
+    void Push(std::vector<char>& vchBlock)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while ((nInFlight >= MAX_IMPORT_BLOCKS_IN_FLIGHT || (nInFlight > 0 && nBytesInFlight >= MAX_IMPORT_BYTES_IN_FLIGHT)) && !fAbort)
+            condReader.wait(lock);
+        if (fAbort)
+            return;
+        CImportBlock* pimport = new CImportBlock();
+        pimport->nSize = vchBlock.size();
+        pimport->vchBlock.swap(vchBlock);
+        queueRaw.push_back(std::make_pair(nRead++, pimport));
+        nInFlight++;
+        nBytesInFlight += pimport->nSize;
+        condWorker.notify_one();
+    }
+
+    void ThreadRead()
     {
+        RenameThread("DigitalNote-importread");
+
+        const MessageStartChars& pchMessageStart = Params().MessageStart();
+        std::vector<char> vBuf;
+        size_t nBegin = 0;
+        bool fEof = false;
+
+        while (!Aborted())
+        {
+            // Find the next message start in what is buffered
+            size_t nMagic = nBegin;
+            while (nMagic + MESSAGE_START_SIZE <= vBuf.size() && memcmp(&vBuf[nMagic], pchMessageStart, MESSAGE_START_SIZE) != 0)
+                nMagic++;
+
+            size_t nNeed = nMagic + MESSAGE_START_SIZE + sizeof(unsigned int);
+            unsigned int nSize = 0;
+            if (nNeed <= vBuf.size())
+            {
+                memcpy(&nSize, &vBuf[nMagic + MESSAGE_START_SIZE], sizeof(nSize));
+                if (nSize == 0 || nSize > MAX_BLOCK_SIZE)
+                {
+                    // Not a real header, keep scanning after it
+                    nBegin = nMagic + 1;
+                    continue;
+                }
+                nNeed += nSize;
+            }
+
+            if (nNeed > vBuf.size())
+            {
+                if (fEof)
+                    break;
+
+                // Drop what was consumed and top the buffer up
+                nBegin = std::min(nMagic, vBuf.size());
+                vBuf.erase(vBuf.begin(), vBuf.begin() + nBegin);
+                nBegin = 0;
+                size_t nOld = vBuf.size();
+                vBuf.resize(nOld + std::max((size_t)IMPORT_READ_CHUNK_SIZE, nNeed - nMagic));
+                size_t nGot = fread(&vBuf[nOld], 1, vBuf.size() - nOld, fileIn);
+                vBuf.resize(nOld + nGot);
+                if (nGot == 0)
+                    fEof = true;
+                continue;
+            }
+
+            size_t nStart = nMagic + MESSAGE_START_SIZE + sizeof(unsigned int);
+            std::vector<char> vchBlock(vBuf.begin() + nStart, vBuf.begin() + nStart + nSize);
+            Push(vchBlock);
+            nBegin = nStart + nSize;
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fReadDone = true;
+        condWorker.notify_all();
+        condConnect.notify_all();
+    }
+
+    void ThreadCheck()
+    {
+        RenameThread("DigitalNote-importcheck");
+
+        while (true)
+        {
+            std::pair<uint64_t, CImportBlock*> item;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queueRaw.empty() && !fReadDone && !fAbort)
+                    condWorker.wait(lock);
+                if (fAbort || queueRaw.empty())
+                    return;
+                item = queueRaw.front();
+                queueRaw.pop_front();
+            }
+
+            CImportBlock* pimport = item.second;
+            pimport->fValid = false;
+            try {
+                CDataStream ss(pimport->vchBlock, SER_DISK, CLIENT_VERSION);
+                ss >> pimport->block;
+                pimport->fValid = CheckBlockContextFree(pimport->block);
+            }
+            catch (std::exception &e) {
+                LogPrintf("%s() : Deserialize error caught during load\n", __PRETTY_FUNCTION__);
+            }
+            std::vector<char>().swap(pimport->vchBlock);
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            mapChecked[item.first] = pimport;
+            condConnect.notify_one();
+        }
+    }
+
+    static bool CheckBlockContextFree(const CBlock& block)
+    {
+        if (block.vtx.empty())
+            return error("CheckBlockContextFree() : no transactions");
+        if (block.IsProofOfWork() && !CheckProofOfWork(block.GetPoWHash(), block.nBits))
+            return error("CheckBlockContextFree() : proof of work failed");
+        if (!block.CheckBlockSignature())
+            return error("CheckBlockContextFree() : bad block signature");
+        if (block.hashMerkleRoot != block.BuildMerkleTree())
+            return error("CheckBlockContextFree() : hashMerkleRoot mismatch");
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            if (!tx.CheckTransaction())
+                return error("CheckBlockContextFree() : CheckTransaction failed");
+        return true;
+    }
+
+    void Stop(boost::thread_group& threads)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fAbort = true;
+            condReader.notify_all();
+            condWorker.notify_all();
+        }
+        threads.join_all();
+
+        while (!queueRaw.empty())
+        {
+            delete queueRaw.front().second;
+            queueRaw.pop_front();
+        }
+        for (std::map<uint64_t, CImportBlock*>::iterator it = mapChecked.begin(); it != mapChecked.end(); ++it)
+            delete it->second;
+        mapChecked.clear();
+    }
+
+public:
+    CBlockImporter(FILE* fileInIn) : fileIn(fileInIn), nRead(0), nInFlight(0), nBytesInFlight(0), fReadDone(false), fAbort(false) {}
+
+    int Run()
+    {
+        int nThreads = GetArg("-importthreads", 0);
+        if (nThreads <= 0)
+            nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency() - 1, 8));
+
+        boost::thread_group threads;
+        threads.create_thread(boost::bind(&CBlockImporter::ThreadRead, this));
+        for (int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&CBlockImporter::ThreadCheck, this));
+
+        // The workers reference this object, so they are stopped and joined
+        // on every way out, ProcessBlock errors included
+        int nLoaded = 0;
+        CImportBlock* pimport = NULL;
         try {
-            CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
-            unsigned int nPos = 0;
-            while (nPos != (unsigned int)-1 && blkdat.good())
+            for (uint64_t nNext = 0; ; nNext++)
             {
-                boost::this_thread::interruption_point();
-                unsigned char pchData[65536];
-                do {
-                    fseek(blkdat, nPos, SEEK_SET);
-                    int nRead = fread(pchData, 1, sizeof(pchData), blkdat);
-                    if (nRead <= 8)
-                    {
-                        nPos = (unsigned int)-1;
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    while (!mapChecked.count(nNext) && !(fReadDone && nNext >= nRead))
+                        condConnect.wait(lock);
+                    if (!mapChecked.count(nNext))
                         break;
-                    }
-                    void* nFind = memchr(pchData, Params().MessageStart()[0], nRead+1-MESSAGE_START_SIZE);
-                    if (nFind)
-                    {
-                        if (memcmp(nFind, Params().MessageStart(), MESSAGE_START_SIZE)==0)
-                        {
-                            nPos += ((unsigned char*)nFind - pchData) + MESSAGE_START_SIZE;
-                            break;
-                        }
-                        nPos += ((unsigned char*)nFind - pchData) + 1;
-                    }
-                    else
-                        nPos += sizeof(pchData) - MESSAGE_START_SIZE + 1;
-                    boost::this_thread::interruption_point();
-                } while(true);
-                if (nPos == (unsigned int)-1)
-                    break;
-                fseek(blkdat, nPos, SEEK_SET);
-                unsigned int nSize;
-                blkdat >> nSize;
-                if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
+                    pimport = mapChecked[nNext];
+                    mapChecked.erase(nNext);
+                    nInFlight--;
+                    nBytesInFlight -= pimport->nSize;
+                    condReader.notify_one();
+                }
+
+                boost::this_thread::interruption_point();
+                if (pimport->fValid)
                 {
-                    CBlock block;
-                    blkdat >> block;
                     LOCK(cs_main);
-                    if (ProcessBlock(NULL,&block))
-                    {
+                    if (ProcessBlock(NULL, &pimport->block, true))
                         nLoaded++;
-                        nPos += 4 + nSize;
-                    }
                 }
+                delete pimport;
+                pimport = NULL;
             }
         }
-        catch (std::exception &e) {
-            LogPrintf("%s() : Deserialize or I/O error caught during load\n",
-                   __PRETTY_FUNCTION__);
+        catch (...) {
+            delete pimport;
+            Stop(threads);
+            throw;
         }
+
+        Stop(threads);
+        return nLoaded;
+    }
+};
+
+} // anon namespace
+
+bool LoadExternalBlockFile(FILE* fileIn)
+{
+    int64_t nStart = GetTimeMillis();
+
+    int nLoaded = 0;
+    {
+        CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
+        CBlockImporter importer(blkdat);
+        nLoaded = importer.Run();
     }
     LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
     return nLoaded > 0;
@@ -3568,6 +4367,132 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
             RenameOver(pathBootstrap, pathBootstrapOld);
         }
     }
+
+    // Reload the memory pool once the chain is imported
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        LoadMempool();
+}
+
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+// Set once the saved pool has been reloaded (or there was none), so that a
+// dump can't replace mempool.dat with a partially loaded pool
+static bool fMempoolLoaded = false;
+
+bool DumpMempool()
+{
+    if (!fMempoolLoaded)
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+
+    vector<pair<CTransaction, int64_t> > vEntries;
+    {
+        LOCK(mempool.cs);
+        vEntries.reserve(mempool.mapTx.size());
+        for (map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+            vEntries.push_back(make_pair(mi->second.GetTx(), mi->second.GetTime()));
+    }
+
+    int64_t nMid = GetTimeMillis();
+
+    boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("DumpMempool() : open failed");
+
+    try {
+        fileout << MEMPOOL_DUMP_VERSION;
+        fileout << (uint64_t)vEntries.size();
+        for (unsigned int i = 0; i < vEntries.size(); i++)
+            fileout << vEntries[i].first << vEntries[i].second;
+    }
+    catch (std::exception &e) {
+        return error("DumpMempool() : I/O error %s", e.what());
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, GetDataDir() / "mempool.dat"))
+        return error("DumpMempool() : Rename-into-place failed");
+
+    LogPrint("mempool", "Dumped %u mempool transactions: %dms to copy, %dms to write\n",
+             vEntries.size(), nMid - nStart, GetTimeMillis() - nMid);
+    return true;
+}
+
+bool LoadMempool()
+{
+    int64_t nStart = GetTimeMillis();
+    int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+
+    FILE *file = fopen((GetDataDir() / "mempool.dat").string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+    {
+        LogPrintf("LoadMempool() : no mempool.dat, starting with an empty pool\n");
+        fMempoolLoaded = true;
+        return false;
+    }
+
+    vector<CTransaction> vtx;
+    vector<int64_t> vTime;
+    int nExpired = 0;
+    try {
+        uint64_t nVersion;
+        filein >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+        {
+            fMempoolLoaded = true;
+            return error("LoadMempool() : unknown version %d", nVersion);
+        }
+
+        uint64_t nNum;
+        filein >> nNum;
+        int64_t nNow = GetTime();
+        while (nNum--)
+        {
+            CTransaction tx;
+            int64_t nTime;
+            filein >> tx >> nTime;
+            if (nTime + nExpiryTimeout > nNow)
+            {
+                vtx.push_back(tx);
+                vTime.push_back(nTime);
+            }
+            else
+                nExpired++;
+        }
+    }
+    catch (std::exception &e) {
+        LogPrintf("LoadMempool() : failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+    }
+    filein.fclose();
+
+    // Accept in batches of 1000, checking for shutdown in between
+    int nAccepted = 0, nFailed = 0;
+    for (unsigned int i = 0; i < vtx.size(); i += 1000)
+    {
+        unsigned int nEnd = std::min(i + 1000, (unsigned int)vtx.size());
+        vector<CTransaction> vBatch(vtx.begin() + i, vtx.begin() + nEnd);
+        vector<int64_t> vBatchTime(vTime.begin() + i, vTime.begin() + nEnd);
+        vector<int> vResult;
+        AcceptToMemoryPoolBatch(mempool, vBatch, false, vResult, &vBatchTime);
+        BOOST_FOREACH(int nResult, vResult)
+        {
+            if (nResult == BATCH_ACCEPTED)
+                nAccepted++;
+            else
+                nFailed++;
+        }
+        boost::this_thread::interruption_point();
+    }
+
+    fMempoolLoaded = true;
+    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i expired  %dms\n",
+              nAccepted, nFailed, nExpired, GetTimeMillis() - nStart);
+    return true;
 }
 
 
@@ -3701,7 +4626,12 @@ void static ProcessGetData(CNode* pfrom)
                 if (mi != mapBlockIndex.end())
                 {
                     CBlock block;
-                    block.ReadFromDisk((*mi).second);
+                    if (!block.ReadFromDisk((*mi).second))
+                    {
+                        // Pruned from disk
+                        vNotFound.push_back(inv);
+                        continue;
+                    }
                     pfrom->PushMessage("block", block);
 
                     // Trigger them to send a getblocks request for the next batch of inventory
@@ -4109,6 +5039,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         // Send the rest of the chain
         if (pindex)
             pindex = pindex->pnext;
+        // A pruned node only serves the retained window of recent blocks
+        if (fHavePruned && pindex && pindex->nHeight < nBestHeight - (int)nPruneKeepBlocks)
+        {
+            LogPrint("net", "getblocks from %d is below the pruned window\n", pindex->nHeight);
+            pindex = NULL;
+        }
         int nLimit = 5000;
         LogPrint("net", "getblocks %d to %s limit %d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), nLimit);
         for (; pindex; pindex = pindex->pnext)
@@ -4173,8 +5109,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "tx"|| strCommand == "dstx")
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
 
         //masternode signed transaction
@@ -4247,48 +5181,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (AcceptToMemoryPool(mempool, tx, true, &fMissingInputs, false, ignoreFees))
         {
             RelayTransaction(tx, inv.hash);
-            vWorkQueue.push_back(inv.hash);
-
-            // Recursively process any orphan transactions that depended on this one
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const uint256& orphanTxHash = *mi;
-                    CTransaction& orphanTx = mapOrphanTransactions[orphanTxHash];
-                    bool fMissingInputs2 = false;
-
-                    if (AcceptToMemoryPool(mempool, orphanTx, true, &fMissingInputs2))
-                    {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanTxHash.ToString());
-                        RelayTransaction(orphanTx, orphanTxHash);
-                        vWorkQueue.push_back(orphanTxHash);
-                        vEraseQueue.push_back(orphanTxHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        vEraseQueue.push_back(orphanTxHash);
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanTxHash.ToString());
-                    }
-                }
-            }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
         }
         else if (fMissingInputs)
         {
-            AddOrphanTx(tx);
+            AddOrphanTx(txdb, tx, pfrom->GetId());
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
+            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS, GetArg("-maxorphantxsize", DEFAULT_MAX_ORPHAN_TX_SIZE) * 1000000);
             if (nEvicted > 0)
                 LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
         }
@@ -4512,7 +5411,7 @@ FILE* OpenDiskFile(const CDiskBlockPos &pos, const char *prefix, bool fReadOnly)
         return NULL;
     }
     if (pos.nPos) {
-        if (fseek(file, pos.nPos, SEEK_SET)) {
+        if (!FileSeek(file, pos.nPos)) {
             LogPrintf("Unable to seek to position %u of %s\n", pos.nPos, path.string());
             fclose(file);
             return NULL;
@@ -4534,6 +5433,67 @@ boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char
     return GetDataDir() / "blocks" / strprintf("%s%05u.dat", prefix, pos.nFile);
 }
 
+bool CBlockUndo::WriteToDisk(CDiskBlockPos& pos, const uint256& hashBlock)
+{
+    // Undo records are appended to the rev file matching the block's file
+    CAutoFile fileout = CAutoFile(OpenUndoFile(pos, false), SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("CBlockUndo::WriteToDisk() : OpenUndoFile failed");
+    if (!FileSeek(fileout, 0, SEEK_END))
+        return error("CBlockUndo::WriteToDisk() : fseek failed");
+
+    // Write index header
+    unsigned int nSize = fileout.GetSerializeSize(*this);
+    fileout << FLATDATA(Params().MessageStart()) << nSize;
+
+    // Write undo data
+    int64_t fileOutPos = FileTell(fileout);
+    if (fileOutPos < 0)
+        return error("CBlockUndo::WriteToDisk() : ftell failed");
+    pos.nPos = (unsigned int)fileOutPos;
+    fileout << *this;
+
+    // Calculate & write checksum
+    CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+    hasher << hashBlock;
+    hasher << *this;
+    fileout << hasher.GetHash();
+
+    // Flush stdio buffers and commit to disk before returning
+    fflush(fileout);
+    if (!IsInitialBlockDownload())
+        FileCommit(fileout);
+
+    return true;
+}
+
+bool CBlockUndo::ReadFromDisk(const CDiskBlockPos& pos, const uint256& hashBlock)
+{
+    // Open history file to read
+    CAutoFile filein = CAutoFile(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("CBlockUndo::ReadFromDisk() : OpenUndoFile failed");
+
+    // Read block
+    uint256 hashChecksum;
+    try {
+        filein >> *this;
+        filein >> hashChecksum;
+    }
+    catch (std::exception &e) {
+        return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+    }
+
+    // Verify checksum
+    CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+    hasher << hashBlock;
+    hasher << *this;
+    if (hashChecksum != hasher.GetHash())
+        return error("CBlockUndo::ReadFromDisk() : checksum mismatch");
+
+    return true;
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
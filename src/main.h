@@ -8,7 +8,6 @@
 #include "chain.h"
 #include "bignum.h"
 #include "sync.h"
-#include "txmempool.h"
 #include "net.h"
 #include "script.h"
 #include "scrypt.h"
@@ -21,6 +20,7 @@
 #include <list>
 
 class CValidationState;
+class CTxMemPool;
 class CBlock;
 class CBlockIndex;
 class CInv;
@@ -51,8 +51,24 @@ static const unsigned int MAX_P2SH_SIGOPS = 15;
 static unsigned int MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 /** The maximum number of orphan transactions kept in memory */
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
+/** Default for -maxorphantxsize, maximum megabytes of orphan transactions kept in memory */
+static const unsigned int DEFAULT_MAX_ORPHAN_TX_SIZE = 10;
+/** A single peer may fill at most 1/ORPHAN_TX_PEER_SHARE of the orphan pool */
+static const unsigned int ORPHAN_TX_PEER_SHARE = 4;
+/** Expiration time for orphan transactions in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum time between orphan transaction expire time checks in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
 /** Default for -maxorphanblocks, maximum number of orphan blocks kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 10000;
+/** Default for -maxmempool, maximum megabytes of memory used by the transaction memory pool */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, expiration time for transaction memory pool entries in hours */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Default for -persistmempool, save the memory pool on shutdown and reload it on startup */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Seconds between periodic writes of mempool.dat */
+static const unsigned int DUMP_MEMPOOL_INTERVAL = 15 * 60;
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
 static const int64_t MIN_TX_FEE = 0.0001*COIN;
 /** Fees smaller than this (in satoshi) are considered zero fee (for relaying) */
@@ -75,6 +91,24 @@ static const unsigned int BLOCK_DOWNLOAD_TIMEOUT = 60;
 static const unsigned int BLOCK_REORG_MAX_DEPTH = 150;
 /** Minimum block reorganize depth (consider else an invalid fork) */
 static const unsigned int BLOCK_REORG_MIN_DEPTH = 15;
+/** Minimum number of recent blocks a pruned node keeps on disk for reorgs and serving */
+static const unsigned int MIN_BLOCKS_TO_KEEP = 1440;
+/** Smallest -prune target in megabytes */
+static const uint64_t MIN_PRUNE_TARGET_MB = 550;
+/** Block files are capped at this size while pruning so whole files can be dropped */
+static const unsigned int PRUNE_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
+/** Seconds between checks of the block files against the -prune target */
+static const unsigned int PRUNE_CHECK_INTERVAL = 10;
+/** Maximum size of a blk?????.dat file; block positions in the index are 32-bit offsets */
+static const unsigned int MAX_BLOCKFILE_SIZE = 0xF0000000; // 3.75 GiB
+/** Block files are preallocated in chunks of this size */
+static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
+/** Raw blocks an import may hold in memory between the reader and the connect stage */
+static const unsigned int MAX_IMPORT_BLOCKS_IN_FLIGHT = 512;
+/** Raw block bytes an import may hold in memory at once */
+static const uint64_t MAX_IMPORT_BYTES_IN_FLIGHT = 0x10000000; // 256 MiB
+/** Size of the sequential reads done when importing a block file */
+static const unsigned int IMPORT_READ_CHUNK_SIZE = 0x800000; // 8 MiB
 /** Depth for rolling checkpoing block */
 static const unsigned int BLOCK_TEMP_CHECKPOINT_DEPTH = 12;
 /** Defaults to yes, adaptively increase/decrease max/min/priority along with the re-calculated block size **/
@@ -107,6 +141,9 @@ extern const std::string strMessageMagic;
 extern int64_t nTimeBestReceived;
 extern bool fImporting;
 extern bool fReindex;
+extern uint64_t nPruneTarget;
+extern unsigned int nPruneKeepBlocks;
+extern bool fHavePruned;
 struct COrphanBlock;
 extern std::map<uint256, COrphanBlock*> mapOrphanBlocks;
 extern bool fHaveGUI;
@@ -143,10 +180,12 @@ void RegisterNodeSignals(CNodeSignals& nodeSignals);
 void UnregisterNodeSignals(CNodeSignals& nodeSignals);
 
 void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd);
-bool ProcessBlock(CNode* pfrom, CBlock* pblock);
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool fPrechecked=false);
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
-FILE* AppendBlockFile(unsigned int& nFileRet);
+FILE* AppendBlockFile(unsigned int& nFileRet, unsigned int nAddSize);
+void FlushBlockFile(bool fFinalize = false);
+void PruneBlockFiles();
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
@@ -162,14 +201,52 @@ uint256 WantedByOrphan(const COrphanBlock* pblockOrphan);
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake);
 void ThreadStakeMiner(CWallet *pwallet);
 
+/** Events the stake miner waits on instead of polling */
+enum
+{
+    STAKE_WAKE_TIP    = (1U << 0),
+    STAKE_WAKE_TX     = (1U << 1),
+    STAKE_WAKE_WALLET = (1U << 2),
+};
+void WakeStakeMiner(unsigned int nEvents);
+
 
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fRejectinsaneFee=false, bool ignoreFees=false, bool fFixSpentCoins=false);
 
+/** As AcceptToMemoryPool, with the entry time given. fScriptsChecked skips
+ * script verification for callers that already verified the inputs. */
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectInsaneFee, bool ignoreFees,
+                                bool fFixSpentCoins, bool fScriptsChecked);
+
 bool AcceptableInputs(CTxMemPool& pool, const CTransaction &txo, bool fLimitFree,
                         bool* pfMissingInputs, bool fRejectinsaneFee=false, bool isDSTX=false);
 
+/** Results of AcceptToMemoryPoolBatch */
+enum
+{
+    BATCH_REJECTED = 0,
+    BATCH_ACCEPTED,
+    BATCH_MISSING_INPUTS,
+};
+
+/** Add a batch of transactions to the memory pool. Inputs are read and
+ * scripts verified on worker threads without cs_main, then the transactions
+ * are accepted in dependency order, taking cs_main for 100 at a time.
+ * pvAcceptTime optionally gives the entry time of each transaction. */
+void AcceptToMemoryPoolBatch(CTxMemPool& pool, std::vector<CTransaction>& vtx, bool fLimitFree,
+                             std::vector<int>& vResult, const std::vector<int64_t>* pvAcceptTime = NULL);
+
+/** Expire old memory pool entries, then trim the pool to nLimit bytes */
+void LimitMempoolSize(CTxMemPool& pool, size_t nLimit, int64_t nAge);
+
+/** Write the memory pool to mempool.dat */
+bool DumpMempool();
+/** Reload mempool.dat, dropping expired entries */
+bool LoadMempool();
+
 
 bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint256> &vtxhash);
 
@@ -354,7 +431,7 @@ public:
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
 
         // Read transaction
-        if (fseek(filein, pos.nTxPos, SEEK_SET) != 0)
+        if (!FileSeek(filein, pos.nTxPos))
             return error("CTransaction::ReadFromDisk() : fseek failed");
 
         try {
@@ -367,7 +444,7 @@ public:
         // Return file pointer
         if (pfileRet)
         {
-            if (fseek(filein, pos.nTxPos, SEEK_SET) != 0)
+            if (!FileSeek(filein, pos.nTxPos))
                 return error("CTransaction::ReadFromDisk() : second fseek failed");
             *pfileRet = filein.release();
         }
@@ -805,31 +882,7 @@ public:
     }
 
 
-    bool WriteToDisk(unsigned int& nFileRet, unsigned int& nBlockPosRet)
-    {
-        // Open history file to append
-        CAutoFile fileout = CAutoFile(AppendBlockFile(nFileRet), SER_DISK, CLIENT_VERSION);
-        if (!fileout)
-            return error("CBlock::WriteToDisk() : AppendBlockFile failed");
-
-        // Write index header
-        unsigned int nSize = fileout.GetSerializeSize(*this);
-        fileout << FLATDATA(Params().MessageStart()) << nSize;
-
-        // Write block
-        long fileOutPos = ftell(fileout);
-        if (fileOutPos < 0)
-            return error("CBlock::WriteToDisk() : ftell failed");
-        nBlockPosRet = fileOutPos;
-        fileout << *this;
-
-        // Flush stdio buffers and commit to disk before returning
-        fflush(fileout);
-        if (!IsInitialBlockDownload() || (nBestHeight+1) % 500 == 0)
-            FileCommit(fileout);
-
-        return true;
-    }
+    bool WriteToDisk(unsigned int& nFileRet, unsigned int& nBlockPosRet);
 
     bool ReadFromDisk(unsigned int nFile, unsigned int nBlockPos, bool fReadTransactions=true)
     {
@@ -935,6 +988,27 @@ struct CDiskBlockPos
 
 };
 
+/** Undo information for one connected block: the transaction index entries
+ * of every previous transaction it spends from, as they were before the
+ * block was connected. Disconnecting the block restores these entries in a
+ * single batch instead of re-reading and rewriting each spent txindex.
+ * Transactions created and spent inside the same block are left out since
+ * disconnecting erases their index entries anyway.
+ */
+class CBlockUndo
+{
+public:
+    std::vector<std::pair<uint256, CTxIndex> > vtxindexPrev;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(vtxindexPrev);
+    )
+
+    bool WriteToDisk(CDiskBlockPos& pos, const uint256& hashBlock);
+    bool ReadFromDisk(const CDiskBlockPos& pos, const uint256& hashBlock);
+};
+
 /** The block chain is a tree shaped structure starting with the
  * genesis block at the root, with each block potentially having multiple
  * candidates to be the next block.  pprev and pnext link a path through the
@@ -1471,6 +1545,9 @@ protected:
     friend void ::UnregisterAllWallets();
 };
 
+// Mempool entries hold a complete CTransaction
+#include "txmempool.h"
+
 #endif
 /** Open a block file (blk?????.dat) */
 FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly);
@@ -57,49 +57,286 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
         ((uint32_t*)pstate)[i] = ctx.h[i];
 }
 
-// Some explaining would be appreciated
-class COrphan
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+int64_t nLastCoinStakeSearchInterval = 0;
+
+// Check a pool transaction against the block being assembled: its inputs must
+// be in the chain or earlier in the block, and it must still connect. Spent
+// outputs are recorded in mapTestPool. ConnectInputs isn't const, so tx is a
+// copy of the pool's transaction.
+static bool TestBlockTransaction(CTxDB& txdb, CTransaction tx, CBlockIndex* pindexPrev, map<uint256, CTxIndex>& mapTestPool,
+                                 int64_t& nTxFees, unsigned int& nTxSigOps)
+{
+    MapPrevTx mapInputs;
+    bool fInvalid;
+    if (!tx.FetchInputs(txdb, mapTestPool, false, true, mapInputs, fInvalid))
+        return false;
+
+    nTxFees = tx.GetValueMapIn(mapInputs)-tx.GetValueOut();
+    nTxSigOps = GetLegacySigOpCount(tx) + GetP2SHSigOpCount(tx, mapInputs);
+
+    // Note that flags: we don't want to set mempool/IsStandard()
+    // policy here, but we still have to ensure that the block we
+    // create only contains transactions that are valid in new blocks.
+    if (!tx.ConnectInputs(txdb, mapInputs, mapTestPool, CDiskTxPos(1,1,1), pindexPrev, false, true, MANDATORY_SCRIPT_VERIFY_FLAGS))
+        return false;
+    mapTestPool[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
+    return true;
+}
+
+// Fills a block with memory pool transactions. Transactions are added as
+// packages: a transaction together with its ancestors not yet in the block,
+// ranked by the fee rate of the whole package. Packages whose ancestors made
+// it into the block are re-ranked in mapModified. Caller holds cs_main and
+// mempool.cs.
+class CBlockTxCollector
 {
 public:
-    CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
+    CBlock* pblock;
+    CTxDB& txdb;
+    CBlockIndex* pindexPrev;
+    int nHeight;
+    int64_t nMaxTxTime;
+    unsigned int nBlockMaxSize;
+
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    unsigned int nBlockSigOps;
+    int64_t nFees;
+
+    CBlockTxCollector(CBlock* pblockIn, CTxDB& txdbIn, CBlockIndex* pindexPrevIn, int64_t nMaxTxTimeIn, unsigned int nBlockMaxSizeIn)
+        : pblock(pblockIn), txdb(txdbIn), pindexPrev(pindexPrevIn), nHeight(pindexPrevIn->nHeight + 1),
+          nMaxTxTime(nMaxTxTimeIn), nBlockMaxSize(nBlockMaxSizeIn), nBlockSize(1000), nBlockTx(0), nBlockSigOps(100), nFees(0)
+    {
+    }
 
-    COrphan(CTransaction* ptxIn)
+    // High priority transactions first, regardless of their fees
+    void AddPriorityTxs(unsigned int nBlockPrioritySize)
     {
-        ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
+        if (nBlockPrioritySize == 0)
+            return;
+
+        vector<pair<double, uint256> > vecPriority;
+        vecPriority.reserve(mempool.mapTx.size());
+        for (map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+            if (mi->second.GetParents().empty())
+                vecPriority.push_back(make_pair(mi->second.GetPriority(nHeight), mi->first));
+        make_heap(vecPriority.begin(), vecPriority.end());
+
+        while (!vecPriority.empty())
+        {
+            double dPriority = vecPriority.front().first;
+            uint256 hash = vecPriority.front().second;
+            pop_heap(vecPriority.begin(), vecPriority.end());
+            vecPriority.pop_back();
+
+            const CTxMemPoolEntry& entry = mempool.mapTx[hash];
+            if (nBlockSize + entry.GetTxSize() >= nBlockPrioritySize || dPriority < COIN * 144 / 250)
+                break;
+            if (!AddPackage(hash, dPriority))
+                continue;
+
+            // Children become candidates once all their parents are in
+            BOOST_FOREACH(const uint256& hashChild, entry.GetChildren())
+            {
+                const CTxMemPoolEntry& child = mempool.mapTx[hashChild];
+                bool fReady = true;
+                BOOST_FOREACH(const uint256& hashParent, child.GetParents())
+                    fReady &= setInBlock.count(hashParent) > 0;
+                if (fReady)
+                {
+                    vecPriority.push_back(make_pair(child.GetPriority(nHeight), hashChild));
+                    push_heap(vecPriority.begin(), vecPriority.end());
+                }
+            }
+        }
     }
-};
 
+    // Then the best fee rate packages, until the block is full or the
+    // remaining packages don't pay nMinTxFee per kilobyte
+    void AddPackageTxs(int64_t nMinTxFee, unsigned int nBlockMinSize)
+    {
+        set<CMemPoolScore>::const_iterator mi = mempool.setByAncestorScore.begin();
+        int nConsecutiveFailed = 0;
+        while (true)
+        {
+            // Skip entries already handled, or whose score changed
+            while (mi != mempool.setByAncestorScore.end() &&
+                   (setInBlock.count(mi->hash) || setFailed.count(mi->hash) || mapModified.count(mi->hash)))
+                ++mi;
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
-int64_t nLastCoinStakeSearchInterval = 0;
- 
-// We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
-class TxPriorityCompare
-{
-    bool byFee;
-public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
-    bool operator()(const TxPriority& a, const TxPriority& b)
+            bool fModified;
+            if (mi == mempool.setByAncestorScore.end())
+            {
+                if (setModified.empty())
+                    break;
+                fModified = true;
+            }
+            else
+                fModified = !setModified.empty() && *setModified.begin() < *mi;
+
+            CMemPoolScore score = fModified ? *setModified.begin() : *mi;
+            if (fModified)
+            {
+                setModified.erase(setModified.begin());
+                mapModified.erase(score.hash);
+            }
+            else
+                ++mi;
+
+            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
+            // client code rounds up the size to the nearest 1K. That's good, because it gives an
+            // incentive to create smaller transactions.
+            double dFeePerKb = double(score.nFees) / (double(score.nSize)/1000.0);
+            if (dFeePerKb < nMinTxFee && nBlockSize + score.nSize >= nBlockMinSize)
+                break;
+
+            if (nBlockSize + score.nSize >= nBlockMaxSize)
+            {
+                setFailed.insert(score.hash);
+                // Give up once the block is nearly full and nothing fits
+                if (++nConsecutiveFailed > 1000 && nBlockSize + 4000 > nBlockMaxSize)
+                    break;
+                continue;
+            }
+
+            if (AddPackage(score.hash, 0))
+                nConsecutiveFailed = 0;
+            else
+                setFailed.insert(score.hash);
+        }
+    }
+
+private:
+    set<uint256> setInBlock;
+    set<uint256> setFailed;
+    map<uint256, CMemPoolScore> mapModified;
+    set<CMemPoolScore> setModified;
+
+    // Add hash and its ancestors not yet in the block, all or nothing
+    bool AddPackage(const uint256& hash, double dPriority)
     {
-        if (byFee)
+        set<uint256> setAncestors;
+        mempool.CalculateMemPoolAncestors(hash, setAncestors);
+
+        vector<pair<uint64_t, uint256> > vPackage;
+        vPackage.push_back(make_pair(mempool.mapTx[hash].GetCountWithAncestors(), hash));
+        BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
         {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
+            if (setInBlock.count(hashAncestor))
+                continue;
+            if (setFailed.count(hashAncestor))
+                return false;
+            vPackage.push_back(make_pair(mempool.mapTx[hashAncestor].GetCountWithAncestors(), hashAncestor));
         }
-        else
+        // Fewer ancestors first puts parents before their children
+        sort(vPackage.begin(), vPackage.end());
+
+        // Remember the test pool entries the package touches, to undo a
+        // partially connected package
+        map<uint256, CTxIndex> mapUndo;
+        set<uint256> setAdded;
+        uint64_t nPackageSize = 0;
+        unsigned int nPackageSigOps = 0;
+        int64_t nPackageFees = 0;
+        bool fOk = true;
+        for (unsigned int i = 0; i < vPackage.size() && fOk; i++)
+        {
+            const CTransaction& tx = mempool.mapTx[vPackage[i].second].GetTx();
+            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+                fOk = false;
+            // Timestamp limit
+            else if (tx.nTime > GetAdjustedTime() || tx.nTime > nMaxTxTime)
+                fOk = false;
+            if (!fOk)
+                break;
+
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            {
+                if (setAdded.count(txin.prevout.hash))
+                    continue;
+                map<uint256, CTxIndex>::iterator it = mapTestPool.find(txin.prevout.hash);
+                if (it != mapTestPool.end())
+                    mapUndo.insert(*it);
+                else
+                    setAdded.insert(txin.prevout.hash);
+            }
+            if (!mapUndo.count(vPackage[i].second))
+                setAdded.insert(vPackage[i].second);
+
+            int64_t nTxFees;
+            unsigned int nTxSigOps;
+            fOk = TestBlockTransaction(txdb, tx, pindexPrev, mapTestPool, nTxFees, nTxSigOps);
+            nPackageSize += ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            nPackageSigOps += nTxSigOps;
+            nPackageFees += nTxFees;
+        }
+
+        if (fOk && (nBlockSize + nPackageSize >= nBlockMaxSize || nBlockSigOps + nPackageSigOps >= MAX_BLOCK_SIGOPS))
+            fOk = false;
+
+        if (!fOk)
         {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+            BOOST_FOREACH(const uint256& hashAdded, setAdded)
+                mapTestPool.erase(hashAdded);
+            for (map<uint256, CTxIndex>::iterator it = mapUndo.begin(); it != mapUndo.end(); ++it)
+                mapTestPool[it->first] = it->second;
+            return false;
         }
+
+        for (unsigned int i = 0; i < vPackage.size(); i++)
+        {
+            const uint256& hashTx = vPackage[i].second;
+            const CTxMemPoolEntry& entry = mempool.mapTx[hashTx];
+            pblock->vtx.push_back(entry.GetTx());
+            setInBlock.insert(hashTx);
+            nBlockTx++;
+
+            map<uint256, CMemPoolScore>::iterator mi = mapModified.find(hashTx);
+            if (mi != mapModified.end())
+            {
+                setModified.erase(mi->second);
+                mapModified.erase(mi);
+            }
+
+            if (fDebug && GetBoolArg("-printpriority", false))
+            {
+                LogPrintf("priority %.1f fee %d size %u txid %s\n",
+                       dPriority, entry.GetFee(), entry.GetTxSize(), hashTx.ToString());
+            }
+        }
+        nBlockSize += nPackageSize;
+        nBlockSigOps += nPackageSigOps;
+        nFees += nPackageFees;
+
+        for (unsigned int i = 0; i < vPackage.size(); i++)
+            UpdateDescendants(vPackage[i].second);
+        return true;
     }
+
+    // Take a transaction now in the block out of its descendants' packages
+    void UpdateDescendants(const uint256& hash)
+    {
+        const CTxMemPoolEntry& entry = mempool.mapTx[hash];
+        set<uint256> setDescendants;
+        mempool.CalculateDescendants(hash, setDescendants);
+        BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+        {
+            if (setInBlock.count(hashDescendant))
+                continue;
+            map<uint256, CMemPoolScore>::iterator mi = mapModified.find(hashDescendant);
+            if (mi == mapModified.end())
+                mi = mapModified.insert(make_pair(hashDescendant, CTxMemPool::GetAncestorScore(mempool.mapTx[hashDescendant], hashDescendant))).first;
+            else
+                setModified.erase(mi->second);
+            mi->second.nFees -= entry.GetFee();
+            mi->second.nSize -= entry.GetTxSize();
+            setModified.insert(mi->second);
+        }
+    }
+
+    map<uint256, CTxIndex> mapTestPool;
 };
 
 // CreateNewBlock: create new block (without proof-of-work/proof-of-stake)
@@ -184,183 +421,15 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
     {
         LOCK2(cs_main, mempool.cs);
         CTxDB txdb("r");
-//> XDN <
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
 
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
-        {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
-                continue;
+        int64_t nMaxTxTime = fProofOfStake ? (int64_t)pblock->vtx[0].nTime : std::numeric_limits<int64_t>::max();
+        CBlockTxCollector collector(pblock.get(), txdb, pindexPrev, nMaxTxTime, nBlockMaxSize);
+        collector.AddPriorityTxs(nBlockPrioritySize);
+        collector.AddPackageTxs(nMinTxFee, nBlockMinSize);
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64_t nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = txindex.GetDepthInMainChain();
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
-            }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
-        }
-
-        // Collect transactions into block
-        map<uint256, CTxIndex> mapTestPool;
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Timestamp limit
-            if (tx.nTime > GetAdjustedTime() || (fProofOfStake && tx.nTime > pblock->vtx[0].nTime))
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            if (fSortedByFee && (dFeePerKb < nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            // Connecting shouldn't fail due to dependency on other memory pool transactions
-            // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-            MapPrevTx mapInputs;
-            bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
-                continue;
-
-            int64_t nTxFees = tx.GetValueMapIn(mapInputs)-tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, mapInputs);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true, MANDATORY_SCRIPT_VERIFY_FLAGS))
-                continue;
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
-            swap(mapTestPool, mapTestPoolTmp);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fDebug && GetBoolArg("-printpriority", false))
-            {
-                LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
+        uint64_t nBlockSize = collector.nBlockSize;
+        uint64_t nBlockTx = collector.nBlockTx;
+        nFees = collector.nFees;
 
         nLastBlockTx = nBlockTx;
         nLastBlockSize = nBlockSize;
@@ -628,6 +697,81 @@ bool CheckStake(CBlock* pblock, CWallet& wallet)
     return true;
 }
 
+// Stake miner wake-up events and the count of tip changes, set by
+// WakeStakeMiner()
+static boost::mutex csStakeMinerEvents;
+static boost::condition_variable condStakeMinerEvents;
+static unsigned int nStakeMinerEvents = 0;
+static int64_t nStakeMinerTipMicros = 0;
+static unsigned int nTipUpdates = 0;
+
+static CCriticalSection cs_stakeMinerStats;
+static CStakeMinerStats stakeMinerStats;
+
+void WakeStakeMiner(unsigned int nEvents)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(csStakeMinerEvents);
+        nStakeMinerEvents |= nEvents;
+        if (nEvents & STAKE_WAKE_TIP)
+        {
+            nStakeMinerTipMicros = GetTimeMicros();
+            nTipUpdates++;
+        }
+    }
+    condStakeMinerEvents.notify_all();
+}
+
+// Wait up to nMilliseconds for one of nMask events; returns and clears the
+// events that are pending
+static unsigned int WaitForStakeEvents(unsigned int nMask, int64_t nMilliseconds)
+{
+    boost::unique_lock<boost::mutex> lock(csStakeMinerEvents);
+    boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(nMilliseconds);
+    while (!(nStakeMinerEvents & nMask))
+        if (!condStakeMinerEvents.timed_wait(lock, deadline))
+            break;
+    unsigned int nEvents = nStakeMinerEvents & nMask;
+    nStakeMinerEvents &= ~nMask;
+    return nEvents;
+}
+
+unsigned int GetTipUpdates()
+{
+    boost::lock_guard<boost::mutex> lock(csStakeMinerEvents);
+    return nTipUpdates;
+}
+
+bool WaitForTipUpdate(unsigned int nTipUpdatesSeen, int64_t nMilliseconds)
+{
+    boost::unique_lock<boost::mutex> lock(csStakeMinerEvents);
+    boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(nMilliseconds);
+    while (nTipUpdates == nTipUpdatesSeen)
+        if (!condStakeMinerEvents.timed_wait(lock, deadline))
+            break;
+    return nTipUpdates != nTipUpdatesSeen;
+}
+
+CStakeMinerStats GetStakeMinerStats()
+{
+    LOCK(cs_stakeMinerStats);
+    return stakeMinerStats;
+}
+
+static void RecordStakeAttempt(int64_t nStartMicros, int64_t nTipMicros, bool fFirstOnTip)
+{
+    int64_t nNow = GetTimeMicros();
+    int64_t nElapsed = nNow - nStartMicros;
+
+    LOCK(cs_stakeMinerStats);
+    stakeMinerStats.nAttempts++;
+    stakeMinerStats.nLastAttemptMicros = nElapsed;
+    stakeMinerStats.nTotalAttemptMicros += nElapsed;
+    stakeMinerStats.nMaxAttemptMicros = max(stakeMinerStats.nMaxAttemptMicros, nElapsed);
+    if (fFirstOnTip && nTipMicros > 0)
+        stakeMinerStats.nLastTipLatencyMicros = nNow - nTipMicros;
+}
+
 void ThreadStakeMiner(CWallet *pwallet)
 {
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
@@ -639,19 +783,31 @@ void ThreadStakeMiner(CWallet *pwallet)
 
     bool fTryToSync = true;
 
+    // Block template, reused while neither the tip nor the mempool changes
+    CBlock blockTemplate;
+    bool fHaveTemplate = false;
+    int64_t nTemplateFees = 0;
+    int64_t nTemplateMillis = 0;
+    unsigned int nTemplateTxUpdated = 0;
+
+    // Timestamp slot and tip of the last attempt; SignBlock() has nothing
+    // new to search until one of them changes
+    int64_t nLastAttemptSlot = 0;
+    uint256 hashLastAttemptPrev = 0;
+
     while (true)
     {
         while (pwallet->IsLocked())
         {
             nLastCoinStakeSearchInterval = 0;
-            MilliSleep(1000);
+            WaitForStakeEvents(STAKE_WAKE_WALLET, 1000);
         }
 
         while (vNodes.empty() || IsInitialBlockDownload())
         {
             nLastCoinStakeSearchInterval = 0;
             fTryToSync = true;
-            MilliSleep(1000);
+            WaitForStakeEvents(STAKE_WAKE_TIP, 1000);
         }
 
         if (fTryToSync)
@@ -659,41 +815,67 @@ void ThreadStakeMiner(CWallet *pwallet)
             fTryToSync = false;
             if (vNodes.size() < 3 || pindexBest->GetBlockTime() < GetTime() - 10 * 60)
             {
-                MilliSleep(10000);
+                WaitForStakeEvents(STAKE_WAKE_TIP, 10000);
                 continue;
             }
         }
 
+        int64_t nSlot = GetAdjustedTime() & ~STAKE_TIMESTAMP_MASK;
+        bool fNewTip = hashBestChain != hashLastAttemptPrev;
+        bool fAttempt = fNewTip || nSlot != nLastAttemptSlot;
+
         //
-        // Create new block
+        // Create new block, or refresh the template when the mempool changed
         //
-        int64_t nFees;
-            #ifdef __GNUC__
-        #define GCC_VERSION (__GNUC__ * 10000 \
-                            + __GNUC_MINOR__ * 100 \
-                            + __GNUC_PATCHLEVEL__)
-
-        /* Test for GCC < 6.3.0 */
-        #if GCC_VERSION > 60300
-            unique_ptr<CBlock> pblock(CreateNewBlock(reservekey, true, &nFees));
-        #else
-            auto_ptr<CBlock> pblock(CreateNewBlock(reservekey, true, &nFees));
-        #endif
-        #else
-            unique_ptr<CBlock> pblock(CreateNewBlock(reservekey, true, &nFees));
-        #endif
-        if (!pblock.get())
-            return;
+        int64_t nNowMillis = GetTimeMillis();
+        bool fMempoolChanged = mempool.GetTransactionsUpdated() != nTemplateTxUpdated;
+        if (!fHaveTemplate || blockTemplate.hashPrevBlock != hashBestChain || nNowMillis - nTemplateMillis > 60 * 1000 ||
+            (fMempoolChanged && (fAttempt || nNowMillis - nTemplateMillis >= nMinerSleep)))
+        {
+            nTemplateTxUpdated = mempool.GetTransactionsUpdated();
+            int64_t nFees;
+            CBlock* pblock = CreateNewBlock(reservekey, true, &nFees);
+            if (!pblock)
+                return;
+            blockTemplate = *pblock;
+            delete pblock;
+            fHaveTemplate = true;
+            nTemplateFees = nFees;
+            nTemplateMillis = nNowMillis;
+
+            LOCK(cs_stakeMinerStats);
+            stakeMinerStats.nTemplates++;
+        }
 
-        // Trying to sign a block
-        if (pblock->SignBlock(*pwallet, nFees))
+        if (fAttempt)
         {
-            SetThreadPriority(THREAD_PRIORITY_NORMAL);
-            CheckStake(pblock.get(), *pwallet);
-            SetThreadPriority(THREAD_PRIORITY_LOWEST);
-            MilliSleep(500);
+            int64_t nTipMicros;
+            {
+                boost::lock_guard<boost::mutex> lock(csStakeMinerEvents);
+                nTipMicros = nStakeMinerTipMicros;
+            }
+            nLastAttemptSlot = nSlot;
+            hashLastAttemptPrev = blockTemplate.hashPrevBlock;
+
+            // Trying to sign a block
+            CBlock block(blockTemplate);
+            int64_t nStartMicros = GetTimeMicros();
+            bool fSigned = block.SignBlock(*pwallet, nTemplateFees);
+            RecordStakeAttempt(nStartMicros, nTipMicros, fNewTip);
+            if (fSigned)
+            {
+                SetThreadPriority(THREAD_PRIORITY_NORMAL);
+                CheckStake(&block, *pwallet);
+                SetThreadPriority(THREAD_PRIORITY_LOWEST);
+                fHaveTemplate = false;
+                WaitForStakeEvents(STAKE_WAKE_TIP, 500);
+                continue;
+            }
         }
-        else
-            MilliSleep(nMinerSleep);
+
+        // Sleep until the next timestamp slot unless a new tip or new
+        // transactions arrive first
+        int64_t nWaitMillis = (nSlot + STAKE_TIMESTAMP_MASK + 1 - GetAdjustedTime()) * 1000;
+        WaitForStakeEvents(STAKE_WAKE_TIP | STAKE_WAKE_TX, max(nWaitMillis, (int64_t)100));
     }
 }
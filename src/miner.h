@@ -24,6 +24,26 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
 /** Check mined proof-of-stake block */
 bool CheckStake(CBlock* pblock, CWallet& wallet);
 
+/** Stake miner timings, reported by getstakinginfo */
+struct CStakeMinerStats
+{
+    uint64_t nAttempts;
+    uint64_t nTemplates;
+    int64_t nLastAttemptMicros;
+    int64_t nTotalAttemptMicros;
+    int64_t nMaxAttemptMicros;
+    int64_t nLastTipLatencyMicros; // from a new tip to the end of the first attempt on it
+
+    CStakeMinerStats() : nAttempts(0), nTemplates(0), nLastAttemptMicros(0), nTotalAttemptMicros(0), nMaxAttemptMicros(0), nLastTipLatencyMicros(0) {}
+};
+CStakeMinerStats GetStakeMinerStats();
+
+/** Number of best chain changes seen so far, for WaitForTipUpdate() */
+unsigned int GetTipUpdates();
+/** Wait up to nMilliseconds for the best chain to change after
+ * GetTipUpdates() returned nTipUpdates; returns true if it did */
+bool WaitForTipUpdate(unsigned int nTipUpdates, int64_t nMilliseconds);
+
 /** Base sha256 mining transform */
 void SHA256Transform(void* pstate, void* pinput, const void* pinit);
 
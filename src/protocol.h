@@ -60,6 +60,8 @@ class CMessageHeader
 enum
 {
     NODE_NETWORK = (1 << 0),
+    // Pruned node: serves only the most recent blocks (MIN_BLOCKS_TO_KEEP or more)
+    NODE_NETWORK_LIMITED = (1 << 10),
 };
 
 /** A CService with information about it as peer */
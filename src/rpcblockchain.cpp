@@ -7,6 +7,7 @@
 #include "main.h"
 #include "kernel.h"
 #include "checkpoints.h"
+#include "txdb.h"
 
 using namespace json_spirit;
 using namespace std;
@@ -212,6 +213,25 @@ Value getrawmempool(const Array& params, bool fHelp)
     return a;
 }
 
+Value getmempoolinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmempoolinfo\n"
+            "Returns details on the memory pool: transaction count, serialized bytes,\n"
+            "estimated memory usage, the -maxmempool limit and the current minimum fee per kB.");
+
+    size_t nMaxMempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+
+    Object ret;
+    ret.push_back(Pair("size", (int64_t)mempool.size()));
+    ret.push_back(Pair("bytes", (int64_t)mempool.GetTotalTxSize()));
+    ret.push_back(Pair("usage", (int64_t)mempool.DynamicMemoryUsage()));
+    ret.push_back(Pair("maxmempool", (int64_t)nMaxMempool));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount(std::max(mempool.GetMinFee(nMaxMempool), MIN_RELAY_TX_FEE))));
+    return ret;
+}
+
 Value getblockhash(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -292,3 +312,44 @@ Value getcheckpoint(const Array& params, bool fHelp)
 
     return result;
 }
+
+Value getdbstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getdbstats\n"
+            "Returns LevelDB statistics for the transaction database.\n");
+
+    LOCK(cs_main);
+
+    CTxDB txdb("r");
+    Object result;
+    result.push_back(Pair("profile", GetDBProfile() == DB_PROFILE_IBD ? "ibd" : "steady"));
+
+    string strValue;
+    if (txdb.GetProperty("leveldb.stats", strValue))
+        result.push_back(Pair("stats", strValue));
+
+    Array files;
+    for (int nLevel = 0; nLevel < 7; nLevel++)
+    {
+        if (!txdb.GetProperty(strprintf("leveldb.num-files-at-level%d", nLevel), strValue))
+            break;
+        files.push_back(atoi(strValue));
+    }
+    result.push_back(Pair("filesperlevel", files));
+
+    Object sizes;
+    uint64_t nTotal = 0;
+    const char* pszPrefixes[] = { "tx", "blockindex", "adr" };
+    BOOST_FOREACH(const char* pszPrefix, pszPrefixes)
+    {
+        uint64_t nSize = txdb.GetApproximateSize(pszPrefix);
+        sizes.push_back(Pair(pszPrefix, (boost::int64_t)nSize));
+        nTotal += nSize;
+    }
+    sizes.push_back(Pair("total", (boost::int64_t)nTotal));
+    result.push_back(Pair("approximatesizes", sizes));
+
+    return result;
+}
@@ -143,6 +143,8 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "sendalert", 6 },
     { "sendmany", 1 },
     { "sendmany", 2 },
+    { "sendpayouts", 1 },
+    { "sendpayouts", 2 },
     { "reservebalance", 0 },
     { "reservebalance", 1 },
     { "createmultisig", 0 },
@@ -157,6 +157,14 @@ Value getstakinginfo(const Array& params, bool fHelp)
 
     obj.push_back(Pair("stakethreshold", GetStakeCombineThreshold() / COIN));
 
+    CStakeMinerStats stats = GetStakeMinerStats();
+    obj.push_back(Pair("attempts", stats.nAttempts));
+    obj.push_back(Pair("templates", stats.nTemplates));
+    obj.push_back(Pair("lastattemptms", stats.nLastAttemptMicros / 1000.0));
+    obj.push_back(Pair("avgattemptms", stats.nAttempts ? stats.nTotalAttemptMicros / 1000.0 / stats.nAttempts : 0.0));
+    obj.push_back(Pair("maxattemptms", stats.nMaxAttemptMicros / 1000.0));
+    obj.push_back(Pair("tiplatencyms", stats.nLastTipLatencyMicros / 1000.0));
+
     return obj;
 }
 
@@ -527,6 +535,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "  \"sizelimit\" : limit of block size\n"
             "  \"bits\" : compressed target of next block\n"
             "  \"height\" : height of the next block\n"
+            "  \"longpollid\" : id to pass back as \"longpollid\" to wait for the next template change\n"
             "  \"payee\" : \"xxx\",                (string) required payee for the next block\n"
             "  \"payee_amount\" : n,               (numeric) required amount to pay\n"
             "  \"votes\" : [\n                     (array) show vote candidates\n"
@@ -538,9 +547,11 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "See https://en.bitcoin.it/wiki/BIP_0022 for full specification.");
 
     std::string strMode = "template";
+    Value lpval = Value::null;
     if (params.size() > 0)
     {
         const Object& oparam = params[0].get_obj();
+        lpval = find_value(oparam, "longpollid");
         const Value& modeval = find_value(oparam, "mode");
         if (modeval.type() == str_type)
             strMode = modeval.get_str();
@@ -558,17 +569,58 @@ Value getblocktemplate(const Array& params, bool fHelp)
     if (vNodes.empty())
         throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "DigitalNote is not connected!");
 
+    if (!pMiningKey)
+        throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found (disabled)");
+
+    if (lpval.type() == str_type)
+    {
+        // BIP22 long poll: wait, without holding any lock, until the best
+        // block changes, or a minute has passed and the mempool has too
+        std::string lpstr = lpval.get_str();
+        if (lpstr.size() < 64)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid longpollid");
+        uint256 hashWatchedChain(lpstr.substr(0, 64));
+        unsigned int nTransactionsUpdatedLastLP = atoi64(lpstr.substr(64));
+
+        int64_t nCheckTxTime = GetTimeMillis() + 60 * 1000;
+        while (true)
+        {
+            unsigned int nTipUpdates = GetTipUpdates();
+            {
+                LOCK(cs_main);
+                if (hashBestChain != hashWatchedChain)
+                    break;
+            }
+            int64_t nNow = GetTimeMillis();
+            if (nNow >= nCheckTxTime)
+            {
+                if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLastLP)
+                    break;
+                nCheckTxTime += 10 * 1000;
+            }
+            if (ShutdownRequested())
+                throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
+            WaitForTipUpdate(nTipUpdates, std::min(nCheckTxTime - nNow, (int64_t)1000));
+        }
+    }
+
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
     //if (IsInitialBlockDownload())
     //    throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "DigitalNote is downloading blocks...");
 
     if (pindexBest->nHeight >= Params().EndPoWBlock())
         throw JSONRPCError(RPC_MISC_ERROR, "No more PoW blocks");
 
-    // Update block
+    // Update block. The template, and the transaction list built from it,
+    // are reused until the tip changes, or the mempool has changed and the
+    // template is more than 5 seconds old; calls in between only refresh
+    // the time.
     static unsigned int nTransactionsUpdatedLast;
     static CBlockIndex* pindexPrev;
     static int64_t nStart;
     static CBlock* pblock;
+    static Array transactions;
     if (pindexPrev != pindexBest ||
         (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
     {
@@ -590,57 +642,57 @@ Value getblocktemplate(const Array& params, bool fHelp)
         if (!pblock)
             throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
 
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
-    }
-
-    // Update nTime
-    pblock->UpdateTime(pindexPrev);
-    pblock->nNonce = 0;
-
-    Array transactions;
-    map<uint256, int64_t> setTxIndex;
-    int i = 0;
-    CTxDB txdb("r");
-    BOOST_FOREACH (CTransaction& tx, pblock->vtx)
-    {
-        uint256 txHash = tx.GetHash();
-        setTxIndex[txHash] = i++;
-
-        if (tx.IsCoinBase() || tx.IsCoinStake())
-            continue;
+        transactions.clear();
+        map<uint256, int64_t> setTxIndex;
+        int i = 0;
+        CTxDB txdb("r");
+        BOOST_FOREACH (CTransaction& tx, pblock->vtx)
+        {
+            uint256 txHash = tx.GetHash();
+            setTxIndex[txHash] = i++;
 
-        Object entry;
+            if (tx.IsCoinBase() || tx.IsCoinStake())
+                continue;
 
-        CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
-        ssTx << tx;
-        entry.push_back(Pair("data", HexStr(ssTx.begin(), ssTx.end())));
+            Object entry;
 
-        entry.push_back(Pair("hash", txHash.GetHex()));
+            CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+            ssTx << tx;
+            entry.push_back(Pair("data", HexStr(ssTx.begin(), ssTx.end())));
 
-        MapPrevTx mapInputs;
-        map<uint256, CTxIndex> mapUnused;
-        bool fInvalid = false;
-        if (tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
-        {
-            entry.push_back(Pair("fee", (int64_t)(tx.GetValueMapIn(mapInputs) - tx.GetValueOut())));
+            entry.push_back(Pair("hash", txHash.GetHex()));
 
-            Array deps;
-            BOOST_FOREACH (MapPrevTx::value_type& inp, mapInputs)
+            MapPrevTx mapInputs;
+            map<uint256, CTxIndex> mapUnused;
+            bool fInvalid = false;
+            if (tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
             {
-                if (setTxIndex.count(inp.first))
-                    deps.push_back(setTxIndex[inp.first]);
+                entry.push_back(Pair("fee", (int64_t)(tx.GetValueMapIn(mapInputs) - tx.GetValueOut())));
+
+                Array deps;
+                BOOST_FOREACH (MapPrevTx::value_type& inp, mapInputs)
+                {
+                    if (setTxIndex.count(inp.first))
+                        deps.push_back(setTxIndex[inp.first]);
+                }
+                entry.push_back(Pair("depends", deps));
+
+                int64_t nSigOps = GetLegacySigOpCount(tx);
+                nSigOps += GetP2SHSigOpCount(tx, mapInputs);
+                entry.push_back(Pair("sigops", nSigOps));
             }
-            entry.push_back(Pair("depends", deps));
 
-            int64_t nSigOps = GetLegacySigOpCount(tx);
-            nSigOps += GetP2SHSigOpCount(tx, mapInputs);
-            entry.push_back(Pair("sigops", nSigOps));
+            transactions.push_back(entry);
         }
 
-        transactions.push_back(entry);
+        // Need to update only after we know CreateNewBlock succeeded
+        pindexPrev = pindexPrevNew;
     }
 
+    // Update nTime
+    pblock->UpdateTime(pindexPrev);
+    pblock->nNonce = 0;
+
     Object aux;
     aux.push_back(Pair("flags", HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end())));
 
@@ -715,6 +767,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     result.push_back(Pair("bits", strprintf("%08x", pblock->nBits)));
     result.push_back(Pair("height", (int64_t)(pindexPrev->nHeight+1)));
     result.push_back(Pair("votes", aVotes));
+    result.push_back(Pair("longpollid", pindexPrev->GetBlockHash().GetHex() + i64tostr(nTransactionsUpdatedLast)));
 
     return result;
 }
@@ -248,6 +248,7 @@ static const CRPCCommand vRPCCommands[] =
     { "getinfo",                &getinfo,                true,      false,     false },
     { "getvelocityinfo",        &getvelocityinfo,        true,      false,     false },
     { "getrawmempool",          &getrawmempool,          true,      false,     false },
+    { "getmempoolinfo",         &getmempoolinfo,         true,      false,     false },
     { "getblock",               &getblock,               false,     false,     false },
     { "getblockbynumber",       &getblockbynumber,       false,     false,     false },
     { "getblockhash",           &getblockhash,           false,     false,     false },
@@ -258,6 +259,7 @@ static const CRPCCommand vRPCCommands[] =
     { "signrawtransaction",     &signrawtransaction,     false,     false,     false },
     { "sendrawtransaction",     &sendrawtransaction,     false,     false,     false },
     { "getcheckpoint",          &getcheckpoint,          true,      false,     false },
+    { "getdbstats",             &getdbstats,             true,      false,     false },
     { "sendalert",              &sendalert,              false,     false,     false },
     { "validateaddress",        &validateaddress,        true,      false,     false },
     { "validatepubkey",         &validatepubkey,         true,      false,     false },
@@ -293,6 +295,7 @@ static const CRPCCommand vRPCCommands[] =
     { "move",                   &movecmd,                false,     false,     true },
     { "sendfrom",               &sendfrom,               false,     false,     true },
     { "sendmany",               &sendmany,               false,     false,     true },
+    { "sendpayouts",            &sendpayouts,            false,     false,     true },
     { "addmultisigaddress",     &addmultisigaddress,     false,     false,     true },
     { "addredeemscript",        &addredeemscript,        false,     false,     true },
     { "gettransaction",         &gettransaction,         false,     false,     true },
@@ -302,14 +305,14 @@ static const CRPCCommand vRPCCommands[] =
     { "getwork",                &getwork,                true,      false,     true },
     { "getworkex",              &getworkex,              true,      false,     true },
     { "listaccounts",           &listaccounts,           false,     false,     true },
-    { "getblocktemplate",       &getblocktemplate,       true,      false,     false },
+    { "getblocktemplate",       &getblocktemplate,       true,      true,      false },
     { "submitblock",            &submitblock,            false,     false,     false },
     { "listsinceblock",         &listsinceblock,         false,     false,     true },
     { "dumpprivkey",            &dumpprivkey,            false,     false,     true },
     { "dumpwallet",             &dumpwallet,             true,      false,     true },
-    { "importprivkey",          &importprivkey,          false,     false,     true },
-    { "importwallet",           &importwallet,           false,     false,     true },
-    { "importaddress",          &importaddress,          false,     false,     true },
+    { "importprivkey",          &importprivkey,          false,     true,      true },
+    { "importwallet",           &importwallet,           false,     true,      true },
+    { "importaddress",          &importaddress,          false,     true,      true },
     { "listunspent",            &listunspent,            false,     false,     true },
     { "cclistcoins",            &cclistcoins,            false,     false,     true },
     { "settxfee",               &settxfee,               false,     false,     true },
@@ -324,7 +327,7 @@ static const CRPCCommand vRPCCommands[] =
     { "checkkernel",            &checkkernel,            true,      false,     true },
     { "getnewstealthaddress",   &getnewstealthaddress,   false,     false,     true },
     { "liststealthaddresses",   &liststealthaddresses,   false,     false,     true },
-    { "scanforalltxns",         &scanforalltxns,         false,     false,     false },
+    { "scanforalltxns",         &scanforalltxns,         false,     true,      false },
     { "scanforstealthtxns",     &scanforstealthtxns,     false,     false,     false },
     { "importstealthaddress",   &importstealthaddress,   false,     false,     true },
     { "sendtostealthaddress",   &sendtostealthaddress,   false,     false,     true },
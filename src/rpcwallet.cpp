@@ -1034,6 +1034,91 @@ Value sendmany(const Array& params, bool fHelp)
     return wtx.GetHash().GetHex();
 }
 
+Value sendpayouts(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 2 || params.size() > 4)
+        throw runtime_error(
+            "sendpayouts \"fromaccount\" {\"address\":amount,...} ( minconf \"comment\" )\n"
+            "\nPay a large number of recipients at once. The payouts are split into as many\n"
+            "transactions as needed to keep each of them within the standard size limit."
+            + HelpRequiringPassphrase() + "\n"
+            "\nArguments:\n"
+            "1. \"fromaccount\"         (string, required) The account to send the funds from, can be \"\" for the default account\n"
+            "2. \"amounts\"             (string, required) A json object with addresses and amounts\n"
+            "    {\n"
+            "      \"address\":amount   (numeric) The DigitalNote address is the key, the numeric amount in XDN is the value\n"
+            "      ,...\n"
+            "    }\n"
+            "3. minconf                 (numeric, optional, default=1) Only use the balance confirmed at least this many times.\n"
+            "4. \"comment\"             (string, optional) A comment stored with every transaction of the batch\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"txids\" : [\"transactionid\",...],  (array of string) The transactions created, in order\n"
+            "  \"fee\" : x.xxx                      (numeric) The total fee paid by the batch\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("sendpayouts", "\"\" \"{\\\"ie6sxvFwLpMsp5tRHpAS6q3cZVewmqYzTg\\\":0.01,\\\"ThiLpx7oYd5YuuhsJAUD5ZsEX2YHgU98Us\\\":0.02}\"") +
+            "\nAs a json rpc call\n"
+            + HelpExampleRpc("sendpayouts", "\"\", \"{\\\"ie6sxvFwLpMsp5tRHpAS6q3cZVewmqYzTg\\\":0.01,\\\"ThiLpx7oYd5YuuhsJAUD5ZsEX2YHgU98Us\\\":0.02}\", 6, \"pool payout\"")
+        );
+
+    string strAccount = AccountFromValue(params[0]);
+    Object sendTo = params[1].get_obj();
+    int nMinDepth = 1;
+    if (params.size() > 2)
+        nMinDepth = params[2].get_int();
+
+    mapValue_t mapValue;
+    if (params.size() > 3 && params[3].type() != null_type && !params[3].get_str().empty())
+        mapValue["comment"] = params[3].get_str();
+
+    set<CDigitalNoteAddress> setAddress;
+    vector<pair<CScript, int64_t> > vecSend;
+
+    int64_t totalAmount = 0;
+    BOOST_FOREACH(const Pair& s, sendTo)
+    {
+        CDigitalNoteAddress address(s.name_);
+        if (!address.IsValid())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, string("Invalid DigitalNote address: ")+s.name_);
+
+        if (setAddress.count(address))
+            throw JSONRPCError(RPC_INVALID_PARAMETER, string("Invalid parameter, duplicated address: ")+s.name_);
+        setAddress.insert(address);
+
+        CScript scriptPubKey;
+        scriptPubKey.SetDestination(address.Get());
+        CAmount nAmount = AmountFromValue(s.value_);
+
+        totalAmount += nAmount;
+
+        vecSend.push_back(make_pair(scriptPubKey, nAmount));
+    }
+
+    EnsureWalletIsUnlocked();
+
+    // Check funds
+    int64_t nBalance = GetAccountBalance(strAccount, nMinDepth, ISMINE_SPENDABLE);
+    if (totalAmount > nBalance)
+        throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS, "Account has insufficient funds");
+
+    // Send
+    vector<CWalletTx> vwtx;
+    int64_t nFee = 0;
+    string strFailReason;
+    if (!pwalletMain->SendPayoutBatch(vecSend, strAccount, mapValue, vwtx, nFee, strFailReason))
+        throw JSONRPCError(RPC_WALLET_ERROR, strFailReason);
+
+    Array txids;
+    BOOST_FOREACH(const CWalletTx& wtx, vwtx)
+        txids.push_back(wtx.GetHash().GetHex());
+
+    Object result;
+    result.push_back(Pair("txids", txids));
+    result.push_back(Pair("fee", ValueFromAmount(nFee)));
+    return result;
+}
+
 // Defined in rpcmisc.cpp
 extern CScript _createmultisig_redeemScript(const Array& params);
 
@@ -2515,6 +2600,7 @@ Value scanforalltxns(const Array& params, bool fHelp)
 
     if (nFromHeight > 0)
     {
+        LOCK(cs_main);
         pindex = mapBlockIndex[hashBestChain];
         while (pindex->nHeight > nFromHeight
             && pindex->pprev)
@@ -2524,14 +2610,11 @@ Value scanforalltxns(const Array& params, bool fHelp)
     if (pindex == NULL)
         throw runtime_error("Genesis Block is not set.");
 
-    {
-        LOCK2(cs_main, pwalletMain->cs_wallet);
-
-        pwalletMain->MarkDirty();
+    pwalletMain->MarkDirty();
 
-        pwalletMain->ScanForWalletTransactions(pindex, true);
-        pwalletMain->ReacceptWalletTransactions();
-    }
+    // Takes cs_main and cs_wallet only while adding what it finds
+    pwalletMain->ScanForWalletTransactions(pindex, true);
+    pwalletMain->ReacceptWalletTransactions();
 
     result.push_back(Pair("result", "Scan complete."));
 
@@ -2501,6 +2501,11 @@ isminetype IsMine(const CKeyStore &keystore, const CTxDestination& dest)
 
 isminetype IsMine(const CKeyStore &keystore, const CScript& scriptPubKey)
 {
+    // Nearly every output seen is someone else's; rule those out with a
+    // single lookup before parsing the script
+    if (!keystore.MayBeMine(scriptPubKey))
+        return ISMINE_NO;
+
     vector<valtype> vSolutions;
     txnouttype whichType;
     if (!Solver(scriptPubKey, whichType, vSolutions)) {
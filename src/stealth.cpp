@@ -7,9 +7,7 @@
 
 
 #include <openssl/rand.h>
-#include <openssl/ec.h>
-#include <openssl/ecdsa.h>
-#include <openssl/obj_mac.h>
+#include <openssl/sha.h>
 
 
 bool CStealthAddress::SetEncoded(const std::string& encodedAddress)
@@ -164,56 +162,68 @@ int GenerateRandomSecret(ec_secret& out)
     return 0;
 };
 
+namespace
+{
+/* Context for the stealth key arithmetic, which needs the signing tables to
+ * multiply G and the verification tables to multiply arbitrary points. */
+class CStealthContext
+{
+public:
+    secp256k1_context* ctx;
+
+    CStealthContext()
+    {
+        ctx = secp256k1_context_create(SECP256K1_CONTEXT_SIGN | SECP256K1_CONTEXT_VERIFY);
+        assert(ctx != NULL);
+    }
+    ~CStealthContext()
+    {
+        secp256k1_context_destroy(ctx);
+    }
+};
+
+CStealthContext stealthContext;
+}
+
+static int SerializeCompressed(const secp256k1_pubkey& pubkey, ec_point& out)
+{
+    size_t len = ec_compressed_size;
+    out.resize(ec_compressed_size);
+    if (!secp256k1_ec_pubkey_serialize(stealthContext.ctx, &out[0], &len, &pubkey, SECP256K1_EC_COMPRESSED)
+        || len != ec_compressed_size)
+        return 1;
+    return 0;
+};
+
+// -- c = H(dP), the secret shared by the holder of d and the holder of P's secret
+static int SharedSecret(const ec_secret& secret, secp256k1_pubkey P, ec_secret& sharedSOut)
+{
+    ec_point vchOutP;
+    if (!secp256k1_ec_pubkey_tweak_mul(stealthContext.ctx, &P, &secret.e[0])
+        || SerializeCompressed(P, vchOutP) != 0)
+        return 1;
+
+    SHA256(&vchOutP[0], vchOutP.size(), &sharedSOut.e[0]);
+    return 0;
+};
+
 int SecretToPublicKey(const ec_secret& secret, ec_point& out)
 {
     // -- public key = private * G
-    int rv = 0;
-    
-    EC_GROUP* ecgrp = EC_GROUP_new_by_curve_name(NID_secp256k1);
-    
-    if (!ecgrp)
+    secp256k1_pubkey pub;
+    if (!secp256k1_ec_pubkey_create(stealthContext.ctx, &pub, &secret.e[0]))
     {
-        LogPrintf("SecretToPublicKey(): EC_GROUP_new_by_curve_name failed.\n");
+        LogPrintf("SecretToPublicKey(): invalid secret.\n");
         return 1;
     };
 
-    BIGNUM* bnIn = BN_bin2bn(&secret.e[0], ec_secret_size, BN_new());
-    if (!bnIn)
+    if (SerializeCompressed(pub, out) != 0)
     {
-        EC_GROUP_free(ecgrp);
-        LogPrintf("SecretToPublicKey(): BN_bin2bn failed\n");
+        LogPrintf("SecretToPublicKey(): serialize failed.\n");
         return 1;
     };
-    
-    EC_POINT* pub = EC_POINT_new(ecgrp);
-    
-    
-    EC_POINT_mul(ecgrp, pub, bnIn, NULL, NULL, NULL);
-    
-    BIGNUM* bnOut = EC_POINT_point2bn(ecgrp, pub, POINT_CONVERSION_COMPRESSED, BN_new(), NULL);
-    if (!bnOut)
-    {
-        LogPrintf("SecretToPublicKey(): point2bn failed\n");
-        rv = 1;
-    } else
-    {
-        out.resize(ec_compressed_size);
-        if (BN_num_bytes(bnOut) != (int) ec_compressed_size
-            || BN_bn2bin(bnOut, &out[0]) != (int) ec_compressed_size)
-        {
-            LogPrintf("SecretToPublicKey(): bnOut incorrect length.\n");
-            rv = 1;
-        };
-        
-        BN_free(bnOut);
-    };
-    
-
-    EC_POINT_free(pub);
-    BN_free(bnIn);
-    EC_GROUP_free(ecgrp);
 
-    return rv;
+    return 0;
 };
 
 
@@ -245,180 +255,40 @@ int StealthSecret(ec_secret& secret, ec_point& pubkey, const ec_point& pkSpend,
     
     
     Recipient gets R' and P
-    
-    test 0 and infinity?
     */
     
-    int rv = 0;
-    std::vector<uint8_t> vchOutQ;
-    
-    BN_CTX* bnCtx   = NULL;
-    BIGNUM* bnEphem = NULL;
-    BIGNUM* bnQ     = NULL;
-    EC_POINT* Q     = NULL;
-    BIGNUM* bnOutQ  = NULL;
-    BIGNUM* bnc     = NULL;
-    EC_POINT* C     = NULL;
-    BIGNUM* bnR     = NULL;
-    EC_POINT* R     = NULL;
-    EC_POINT* Rout  = NULL;
-    BIGNUM* bnOutR  = NULL;
-    
-    EC_GROUP* ecgrp = EC_GROUP_new_by_curve_name(NID_secp256k1);
-    
-    if (!ecgrp)
+    secp256k1_pubkey Q;
+    if (pubkey.empty()
+        || !secp256k1_ec_pubkey_parse(stealthContext.ctx, &Q, &pubkey[0], pubkey.size()))
     {
-        LogPrintf("StealthSecret(): EC_GROUP_new_by_curve_name failed.\n");
+        LogPrintf("StealthSecret(): Q parse failed.\n");
         return 1;
     };
     
-    if (!(bnCtx = BN_CTX_new()))
-    {
-        LogPrintf("StealthSecret(): BN_CTX_new failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnEphem = BN_bin2bn(&secret.e[0], ec_secret_size, BN_new())))
-    {
-        LogPrintf("StealthSecret(): bnEphem BN_bin2bn failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnQ = BN_bin2bn(&pubkey[0], pubkey.size(), BN_new())))
-    {
-        LogPrintf("StealthSecret(): bnQ BN_bin2bn failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(Q = EC_POINT_bn2point(ecgrp, bnQ, NULL, bnCtx)))
-    {
-        LogPrintf("StealthSecret(): Q EC_POINT_bn2point failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    // -- eQ
-    // EC_POINT_mul(const EC_GROUP *group, EC_POINT *r, const BIGNUM *n, const EC_POINT *q, const BIGNUM *m, BN_CTX *ctx);
-    // EC_POINT_mul calculates the value generator * n + q * m and stores the result in r. The value n may be NULL in which case the result is just q * m. 
-    if (!EC_POINT_mul(ecgrp, Q, NULL, Q, bnEphem, bnCtx))
-    {
-        LogPrintf("StealthSecret(): eQ EC_POINT_mul failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnOutQ = EC_POINT_point2bn(ecgrp, Q, POINT_CONVERSION_COMPRESSED, BN_new(), bnCtx)))
-    {
-        LogPrintf("StealthSecret(): Q EC_POINT_bn2point failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    
-    vchOutQ.resize(ec_compressed_size);
-    if (BN_num_bytes(bnOutQ) != (int) ec_compressed_size
-        || BN_bn2bin(bnOutQ, &vchOutQ[0]) != (int) ec_compressed_size)
-    {
-        LogPrintf("StealthSecret(): bnOutQ incorrect length.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    SHA256(&vchOutQ[0], vchOutQ.size(), &sharedSOut.e[0]);
-    
-    if (!(bnc = BN_bin2bn(&sharedSOut.e[0], ec_secret_size, BN_new())))
-    {
-        LogPrintf("StealthSecret(): BN_bin2bn failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    // -- cG
-    if (!(C = EC_POINT_new(ecgrp)))
-    {
-        LogPrintf("StealthSecret(): C EC_POINT_new failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!EC_POINT_mul(ecgrp, C, bnc, NULL, NULL, bnCtx))
-    {
-        LogPrintf("StealthSecret(): C EC_POINT_mul failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnR = BN_bin2bn(&pkSpend[0], pkSpend.size(), BN_new())))
-    {
-        LogPrintf("StealthSecret(): bnR BN_bin2bn failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    
-    if (!(R = EC_POINT_bn2point(ecgrp, bnR, NULL, bnCtx)))
-    {
-        LogPrintf("StealthSecret(): R EC_POINT_bn2point failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!EC_POINT_mul(ecgrp, C, bnc, NULL, NULL, bnCtx))
-    {
-        printf("StealthSecret(): C EC_POINT_mul failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(Rout = EC_POINT_new(ecgrp)))
+    // -- c = H(eQ)
+    if (SharedSecret(secret, Q, sharedSOut) != 0)
     {
-        printf("StealthSecret(): Rout EC_POINT_new failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!EC_POINT_add(ecgrp, Rout, R, C, bnCtx))
-    {
-        LogPrintf("StealthSecret(): Rout EC_POINT_add failed\n");
-        rv = 1;
-        goto End;
+        LogPrintf("StealthSecret(): eQ failed.\n");
+        return 1;
     };
     
-    if (!(bnOutR = EC_POINT_point2bn(ecgrp, Rout, POINT_CONVERSION_COMPRESSED, BN_new(), bnCtx)))
+    secp256k1_pubkey R;
+    if (pkSpend.empty()
+        || !secp256k1_ec_pubkey_parse(stealthContext.ctx, &R, &pkSpend[0], pkSpend.size()))
     {
-        LogPrintf("StealthSecret(): Rout EC_POINT_bn2point failed\n");
-        rv = 1;
-        goto End;
+        LogPrintf("StealthSecret(): R parse failed.\n");
+        return 1;
     };
     
-    
-    pkOut.resize(ec_compressed_size);
-    if (BN_num_bytes(bnOutR) != (int) ec_compressed_size
-        || BN_bn2bin(bnOutR, &pkOut[0]) != (int) ec_compressed_size)
+    // -- R' = R + cG
+    if (!secp256k1_ec_pubkey_tweak_add(stealthContext.ctx, &R, &sharedSOut.e[0])
+        || SerializeCompressed(R, pkOut) != 0)
     {
-        LogPrintf("StealthSecret(): pkOut incorrect length.\n");
-        rv = 1;
-        goto End;
+        LogPrintf("StealthSecret(): R + cG failed.\n");
+        return 1;
     };
     
-    End:
-    if (bnOutR)     BN_free(bnOutR);
-    if (Rout)       EC_POINT_free(Rout);
-    if (R)          EC_POINT_free(R);
-    if (bnR)        BN_free(bnR);
-    if (C)          EC_POINT_free(C);
-    if (bnc)        BN_free(bnc);
-    if (bnOutQ)     BN_free(bnOutQ);
-    if (Q)          EC_POINT_free(Q);
-    if (bnQ)        BN_free(bnQ);
-    if (bnEphem)    BN_free(bnEphem);
-    if (bnCtx)      BN_CTX_free(bnCtx);
-    EC_GROUP_free(ecgrp);
-    
-    return rv;
+    return 0;
 };
 
 
@@ -429,230 +299,80 @@ int StealthSecretSpend(ec_secret& scanSecret, ec_point& ephemPubkey, ec_secret&
     c  = H(dP)
     R' = R + cG     [without decrypting wallet]
        = (f + c)G   [after decryption of wallet]
-         Remember: mod curve.order, pad with 0x00s where necessary?
     */
     
-    int rv = 0;
-    std::vector<uint8_t> vchOutP;
-    
-    BN_CTX* bnCtx           = NULL;
-    BIGNUM* bnScanSecret    = NULL;
-    BIGNUM* bnP             = NULL;
-    EC_POINT* P             = NULL;
-    BIGNUM* bnOutP          = NULL;
-    BIGNUM* bnc             = NULL;
-    BIGNUM* bnOrder         = NULL;
-    BIGNUM* bnSpend         = NULL;
-    
-    EC_GROUP* ecgrp = EC_GROUP_new_by_curve_name(NID_secp256k1);
-    
-    if (!ecgrp)
+    secp256k1_pubkey P;
+    if (ephemPubkey.empty()
+        || !secp256k1_ec_pubkey_parse(stealthContext.ctx, &P, &ephemPubkey[0], ephemPubkey.size()))
     {
-        LogPrintf("StealthSecretSpend(): EC_GROUP_new_by_curve_name failed.\n");
+        LogPrintf("StealthSecretSpend(): P parse failed.\n");
         return 1;
     };
     
-    if (!(bnCtx = BN_CTX_new()))
-    {
-        LogPrintf("StealthSecretSpend(): BN_CTX_new failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnScanSecret = BN_bin2bn(&scanSecret.e[0], ec_secret_size, BN_new())))
-    {
-        LogPrintf("StealthSecretSpend(): bnScanSecret BN_bin2bn failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnP = BN_bin2bn(&ephemPubkey[0], ephemPubkey.size(), BN_new())))
-    {
-        LogPrintf("StealthSecretSpend(): bnP BN_bin2bn failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(P = EC_POINT_bn2point(ecgrp, bnP, NULL, bnCtx)))
-    {
-        LogPrintf("StealthSecretSpend(): P EC_POINT_bn2point failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    // -- dP
-    if (!EC_POINT_mul(ecgrp, P, NULL, P, bnScanSecret, bnCtx))
-    {
-        LogPrintf("StealthSecretSpend(): dP EC_POINT_mul failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnOutP = EC_POINT_point2bn(ecgrp, P, POINT_CONVERSION_COMPRESSED, BN_new(), bnCtx)))
-    {
-        LogPrintf("StealthSecretSpend(): P EC_POINT_bn2point failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    
-    vchOutP.resize(ec_compressed_size);
-    if (BN_num_bytes(bnOutP) != (int) ec_compressed_size
-        || BN_bn2bin(bnOutP, &vchOutP[0]) != (int) ec_compressed_size)
-    {
-        LogPrintf("StealthSecretSpend(): bnOutP incorrect length.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    uint8_t hash1[32];
-    SHA256(&vchOutP[0], vchOutP.size(), (uint8_t*)hash1);
-    
-    
-    if (!(bnc = BN_bin2bn(&hash1[0], 32, BN_new())))
-    {
-        LogPrintf("StealthSecretSpend(): BN_bin2bn failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnOrder = BN_new())
-        || !EC_GROUP_get_order(ecgrp, bnOrder, bnCtx))
+    ec_secret sharedS;
+    if (SharedSecret(scanSecret, P, sharedS) != 0)
     {
-        LogPrintf("StealthSecretSpend(): EC_GROUP_get_order failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnSpend = BN_bin2bn(&spendSecret.e[0], ec_secret_size, BN_new())))
-    {
-        LogPrintf("StealthSecretSpend(): bnSpend BN_bin2bn failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    //if (!BN_add(r, a, b)) return 0;
-    //return BN_nnmod(r, r, m, ctx);
-    if (!BN_mod_add(bnSpend, bnSpend, bnc, bnOrder, bnCtx))
-    {
-        LogPrintf("StealthSecretSpend(): bnSpend BN_mod_add failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (BN_is_zero(bnSpend)) // possible?
-    {
-        LogPrintf("StealthSecretSpend(): bnSpend is zero.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    int nBytes;
-    memset(&secretOut.e[0], 0, ec_secret_size);
-    if ((nBytes = BN_num_bytes(bnSpend)) > (int)ec_secret_size
-        || BN_bn2bin(bnSpend, &secretOut.e[ec_secret_size-nBytes]) != nBytes)
-    {
-        LogPrintf("StealthSecretSpend(): bnSpend incorrect length.\n");
-        rv = 1;
-        goto End;
+        LogPrintf("StealthSecretSpend(): dP failed.\n");
+        return 1;
     };
     
-    End:
-    if (bnSpend)        BN_free(bnSpend);
-    if (bnOrder)        BN_free(bnOrder);
-    if (bnc)            BN_free(bnc);
-    if (bnOutP)         BN_free(bnOutP);
-    if (P)              EC_POINT_free(P);
-    if (bnP)            BN_free(bnP);
-    if (bnScanSecret)   BN_free(bnScanSecret);
-    if (bnCtx)          BN_CTX_free(bnCtx);
-    EC_GROUP_free(ecgrp);
-    
-    return rv;
+    return StealthSharedToSecretSpend(sharedS, spendSecret, secretOut);
 };
 
 
 int StealthSharedToSecretSpend(ec_secret& sharedS, ec_secret& spendSecret, ec_secret& secretOut)
 {
-    int rv = 0;
-    std::vector<uint8_t> vchOutP;
-    
-    BN_CTX* bnCtx           = NULL;
-    BIGNUM* bnc             = NULL;
-    BIGNUM* bnOrder         = NULL;
-    BIGNUM* bnSpend         = NULL;
-    
-    EC_GROUP* ecgrp = EC_GROUP_new_by_curve_name(NID_secp256k1);
-    
-    if (!ecgrp)
+    // -- f + c mod n, fails if the sum is zero
+    memcpy(&secretOut.e[0], &spendSecret.e[0], ec_secret_size);
+    if (!secp256k1_ec_privkey_tweak_add(stealthContext.ctx, &secretOut.e[0], &sharedS.e[0]))
     {
-        LogPrintf("StealthSecretSpend(): EC_GROUP_new_by_curve_name failed.\n");
+        LogPrintf("StealthSharedToSecretSpend(): f + c failed.\n");
         return 1;
     };
     
-    if (!(bnCtx = BN_CTX_new()))
-    {
-        LogPrintf("StealthSecretSpend(): BN_CTX_new failed.\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnc = BN_bin2bn(&sharedS.e[0], ec_secret_size, BN_new())))
-    {
-        LogPrintf("StealthSecretSpend(): BN_bin2bn failed\n");
-        rv = 1;
-        goto End;
-    };
-    
-    if (!(bnOrder = BN_new())
-        || !EC_GROUP_get_order(ecgrp, bnOrder, bnCtx))
-    {
-        LogPrintf("StealthSecretSpend(): EC_GROUP_get_order failed\n");
-        rv = 1;
-        goto End;
-    };
+    return 0;
+};
+
+
+int CStealthScanner::Add(const CStealthAddress& sxAddr)
+{
+    if (sxAddr.scan_secret.size() != ec_secret_size
+        || sxAddr.spend_pubkey.empty())
+        return -1; // -- not owned
     
-    if (!(bnSpend = BN_bin2bn(&spendSecret.e[0], ec_secret_size, BN_new())))
+    CScanKey key;
+    memcpy(&key.scan_secret.e[0], &sxAddr.scan_secret[0], ec_secret_size);
+    if (!secp256k1_ec_pubkey_parse(stealthContext.ctx, &key.spend_pubkey, &sxAddr.spend_pubkey[0], sxAddr.spend_pubkey.size()))
     {
-        LogPrintf("StealthSecretSpend(): bnSpend BN_bin2bn failed.\n");
-        rv = 1;
-        goto End;
+        LogPrintf("CStealthScanner::Add(): spend_pubkey parse failed for %s.\n", sxAddr.Encoded());
+        return -1;
     };
     
-    //if (!BN_add(r, a, b)) return 0;
-    //return BN_nnmod(r, r, m, ctx);
-    if (!BN_mod_add(bnSpend, bnSpend, bnc, bnOrder, bnCtx))
-    {
-        LogPrintf("StealthSecretSpend(): bnSpend BN_mod_add failed.\n");
-        rv = 1;
-        goto End;
-    };
+    vKeys.push_back(key);
+    return vKeys.size() - 1;
+};
+
+bool CStealthScanner::Derive(const ec_point& ephemPubkey, std::vector<ec_point>& vPkOut, std::vector<ec_secret>& vSharedOut) const
+{
+    vPkOut.assign(vKeys.size(), ec_point());
+    vSharedOut.resize(vKeys.size());
     
-    if (BN_is_zero(bnSpend)) // possible?
-    {
-        LogPrintf("StealthSecretSpend(): bnSpend is zero.\n");
-        rv = 1;
-        goto End;
-    };
+    secp256k1_pubkey P;
+    if (ephemPubkey.size() != ec_compressed_size
+        || !secp256k1_ec_pubkey_parse(stealthContext.ctx, &P, &ephemPubkey[0], ephemPubkey.size()))
+        return false;
     
-    int nBytes;
-    memset(&secretOut.e[0], 0, ec_secret_size);
-    if ((nBytes = BN_num_bytes(bnSpend)) > (int)ec_secret_size
-        || BN_bn2bin(bnSpend, &secretOut.e[ec_secret_size-nBytes]) != nBytes)
+    for (size_t i = 0; i < vKeys.size(); ++i)
     {
-        LogPrintf("StealthSecretSpend(): bnSpend incorrect length.\n");
-        rv = 1;
-        goto End;
+        // -- R' = R + H(dP)G
+        secp256k1_pubkey R = vKeys[i].spend_pubkey;
+        if (SharedSecret(vKeys[i].scan_secret, P, vSharedOut[i]) != 0
+            || !secp256k1_ec_pubkey_tweak_add(stealthContext.ctx, &R, &vSharedOut[i].e[0])
+            || SerializeCompressed(R, vPkOut[i]) != 0)
+            vPkOut[i].clear();
     };
     
-    End:
-    if (bnSpend)        BN_free(bnSpend);
-    if (bnOrder)        BN_free(bnOrder);
-    if (bnc)            BN_free(bnc);
-    if (bnCtx)          BN_CTX_free(bnCtx);
-    EC_GROUP_free(ecgrp);
-    
-    return rv;
+    return true;
 };
 
 bool IsStealthAddress(const std::string& encodedAddress)
@@ -14,6 +14,8 @@
 #include "serialize.h"
 #include "key.h"
 
+#include <secp256k1.h>
+
 
 typedef std::vector<uint8_t> data_chunk;
 
@@ -113,6 +115,31 @@ int StealthSecret(ec_secret& secret, ec_point& pubkey, const ec_point& pkSpend,
 int StealthSecretSpend(ec_secret& scanSecret, ec_point& ephemPubkey, ec_secret& spendSecret, ec_secret& secretOut);
 int StealthSharedToSecretSpend(ec_secret& sharedS, ec_secret& spendSecret, ec_secret& secretOut);
 
+/** The scan secrets and parsed spend public keys of the stealth addresses
+ * we own, so that an ephemeral key is parsed once and tested against every
+ * address without re-parsing or re-allocating per output.
+ */
+class CStealthScanner
+{
+private:
+    struct CScanKey
+    {
+        ec_secret scan_secret;
+        secp256k1_pubkey spend_pubkey;
+    };
+    std::vector<CScanKey> vKeys;
+
+public:
+    // -- returns the index of the address, or -1 if not owned or invalid
+    int Add(const CStealthAddress& sxAddr);
+    size_t size() const { return vKeys.size(); }
+    bool empty() const { return vKeys.empty(); }
+
+    // -- vPkOut[i] is the key address i receives at for ephemPubkey, empty
+    //    if it could not be derived; vSharedOut[i] the shared secret c
+    bool Derive(const ec_point& ephemPubkey, std::vector<ec_point>& vPkOut, std::vector<ec_secret>& vSharedOut) const;
+};
+
 bool IsStealthAddress(const std::string& encodedAddress);
 
 
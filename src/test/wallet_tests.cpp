@@ -19,6 +19,19 @@ BOOST_AUTO_TEST_SUITE(wallet_tests)
 static CWallet wallet;
 static vector<COutput> vCoins;
 
+static bool coin_value_less(const COutput& a, const COutput& b)
+{
+    return a.tx->vout[a.i].nValue < b.tx->vout[b.i].nValue;
+}
+
+// SelectCoinsMinConf expects coins sorted by value, equal values in random
+// order, the way SelectCoins callers hand them over
+static void sort_coins()
+{
+    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+    sort(vCoins.begin(), vCoins.end(), coin_value_less);
+}
+
 static void add_coin(int64 nValue, int nAge = 6*24, bool fIsFromMe = false, int nInput=0)
 {
     static int i;
@@ -38,6 +51,7 @@ static void add_coin(int64 nValue, int nAge = 6*24, bool fIsFromMe = false, int
     }
     COutput output(wtx, nInput, nAge);
     vCoins.push_back(output);
+    sort_coins();
 }
 
 static void empty_wallet(void)
@@ -257,6 +271,7 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
             // picking 50 from 100 coins doesn't depend on the shuffle,
             // but does depend on randomness in the stochastic approximation code
             BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, 1, 6, vCoins, setCoinsRet , nValueRet));
+            sort_coins();
             BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, 1, 6, vCoins, setCoinsRet2, nValueRet));
             BOOST_CHECK(!equal_sets(setCoinsRet, setCoinsRet2));
 
@@ -265,7 +280,9 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
             {
                 // selecting 1 from 100 identical coins depends on the shuffle; this test will fail 1% of the time
                 // run the test RANDOM_REPEATS times and only complain if all of them fail
+                sort_coins();
                 BOOST_CHECK(wallet.SelectCoinsMinConf(COIN, 1, 6, vCoins, setCoinsRet , nValueRet));
+                sort_coins();
                 BOOST_CHECK(wallet.SelectCoinsMinConf(COIN, 1, 6, vCoins, setCoinsRet2, nValueRet));
                 if (equal_sets(setCoinsRet, setCoinsRet2))
                     fails++;
@@ -282,7 +299,9 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
             {
                 // selecting 1 from 100 identical coins depends on the shuffle; this test will fail 1% of the time
                 // run the test RANDOM_REPEATS times and only complain if all of them fail
+                sort_coins();
                 BOOST_CHECK(wallet.SelectCoinsMinConf(90*CENT, 1, 6, vCoins, setCoinsRet , nValueRet));
+                sort_coins();
                 BOOST_CHECK(wallet.SelectCoinsMinConf(90*CENT, 1, 6, vCoins, setCoinsRet2, nValueRet));
                 if (equal_sets(setCoinsRet, setCoinsRet2))
                     fails++;
@@ -292,4 +311,35 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     }
 }
 
+BOOST_AUTO_TEST_CASE(coin_selection_exact_tests)
+{
+    vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > > vValue;
+    vector<char> vfBest;
+
+    // largest first, as SelectCoinsMinConf hands them over
+    int64_t values[] = { 9*CENT, 7*CENT, 7*CENT, 5*CENT, 3*CENT, 2*CENT };
+    for (unsigned int i = 0; i < sizeof(values)/sizeof(values[0]); i++)
+        vValue.push_back(make_pair(values[i], make_pair((const CWalletTx*)NULL, i)));
+
+    // 9 + 7 is the first exact subset the search meets
+    BOOST_CHECK(SelectCoinsExact(vValue, 16 * CENT, vfBest));
+    BOOST_CHECK_EQUAL(vfBest.size(), vValue.size());
+    int64_t nTotal = 0;
+    for (unsigned int i = 0; i < vValue.size(); i++)
+        if (vfBest[i])
+            nTotal += vValue[i].first;
+    BOOST_CHECK_EQUAL(nTotal, 16 * CENT);
+
+    // a single coin matching is found too
+    BOOST_CHECK(SelectCoinsExact(vValue, 5 * CENT, vfBest));
+
+    // no subset adds up to 34 cents out of 33 in total, or to 1 cent
+    BOOST_CHECK(!SelectCoinsExact(vValue, 34 * CENT, vfBest));
+    BOOST_CHECK(!SelectCoinsExact(vValue, 1 * CENT, vfBest));
+
+    // the step cap gives up before reaching a subset that does exist
+    BOOST_CHECK(!SelectCoinsExact(vValue, 16 * CENT, vfBest, 2));
+    BOOST_CHECK(SelectCoinsExact(vValue, 16 * CENT, vfBest, 100));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
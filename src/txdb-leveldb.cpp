@@ -26,14 +26,58 @@ using namespace boost;
 
 leveldb::DB *txdb; // global pointer for LevelDB object instance
 
-static leveldb::Options GetOptions() {
+// Profile the database was opened with, and the profile currently used for
+// writes. Buffer sizes are fixed once the database is open, but write
+// durability follows the node in and out of initial block download.
+static DBProfile nOpenProfile = DB_PROFILE_STEADY;
+static DBProfile nWriteProfile = DB_PROFILE_STEADY;
+static bool fCompactPending = false;
+
+static DBProfile GetOpenProfile(const filesystem::path& directory) {
+    string strProfile = GetArg("-dbprofile", "auto");
+    if (strProfile == "ibd")
+        return DB_PROFILE_IBD;
+    if (strProfile == "steady")
+        return DB_PROFILE_STEADY;
+    if (strProfile != "auto")
+        LogPrintf("Unknown -dbprofile=%s, using auto\n", strProfile);
+
+    // A node starting from an empty index or importing blocks is going to
+    // spend the next hours writing, so open it for bulk throughput.
+    if (!filesystem::exists(directory) || mapArgs.count("-loadblock"))
+        return DB_PROFILE_IBD;
+    return DB_PROFILE_STEADY;
+}
+
+static leveldb::Options GetOptions(DBProfile nProfile) {
     leveldb::Options options;
     int nCacheSizeMB = GetArg("-dbcache", 100);
     options.block_cache = leveldb::NewLRUCache(nCacheSizeMB * 1048576);
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+
+    // A large memtable during sync means fewer, larger level-0 files and so
+    // far fewer compactions rewriting the same keys.
+    int nWriteBufferMB = GetArg("-dbwritebuffer", nProfile == DB_PROFILE_IBD ? 64 : 8);
+    options.write_buffer_size = std::max(1, nWriteBufferMB) * 1048576;
+    options.max_open_files = std::max(16, (int)GetArg("-dbmaxopenfiles", 64));
+    options.block_size = std::max(1, (int)GetArg("-dbblocksize", 16)) * 1024;
+    options.compression = GetBoolArg("-dbcompression", true) ? leveldb::kSnappyCompression : leveldb::kNoCompression;
     return options;
 }
 
+static leveldb::WriteOptions GetWriteOptions() {
+    leveldb::WriteOptions options;
+    // Losing the last few blocks on a crash during sync only means fetching
+    // them again, while steady state commits must survive power loss.
+    options.sync = (nWriteProfile == DB_PROFILE_STEADY) && GetBoolArg("-dbsync", true);
+    return options;
+}
+
+DBProfile GetDBProfile()
+{
+    return nOpenProfile;
+}
+
 void init_blockindex(leveldb::Options& options, bool fRemoveOld = false) {
     // First time init.
     filesystem::path directory = GetDataDir() / "txleveldb";
@@ -79,9 +123,17 @@ CTxDB::CTxDB(const char* pszMode)
 
     bool fCreate = strchr(pszMode, 'c');
 
-    options = GetOptions();
+    nOpenProfile = GetOpenProfile(GetDataDir() / "txleveldb");
+    nWriteProfile = nOpenProfile;
+    fCompactPending = (nOpenProfile == DB_PROFILE_IBD);
+
+    options = GetOptions(nOpenProfile);
     options.create_if_missing = true;
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+
+    LogPrintf("LevelDB profile %s: write buffer %dMB, max open files %d, block size %dKB, compression %s\n",
+        nOpenProfile == DB_PROFILE_IBD ? "ibd" : "steady",
+        options.write_buffer_size / 1048576, options.max_open_files,
+        options.block_size / 1024, options.compression == leveldb::kNoCompression ? "off" : "on");
 
     init_blockindex(options); // Init directory
     pdb = txdb;
@@ -143,7 +195,7 @@ bool CTxDB::TxnBegin()
 bool CTxDB::TxnCommit()
 {
     assert(activeBatch);
-    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
+    leveldb::Status status = pdb->Write(GetWriteOptions(), activeBatch);
     delete activeBatch;
     activeBatch = NULL;
     if (!status.ok()) {
@@ -153,6 +205,56 @@ bool CTxDB::TxnCommit()
     return true;
 }
 
+static void ThreadCompactTxDB(leveldb::DB* pdb)
+{
+    RenameThread("DigitalNote-dbcompact");
+    int64_t nStart = GetTimeMillis();
+    LogPrintf("Initial download finished, compacting LevelDB\n");
+    pdb->CompactRange(NULL, NULL);
+    LogPrintf("LevelDB compaction done in %dms\n", GetTimeMillis() - nStart);
+}
+
+void CTxDB::SetInitialDownload(bool fInitialDownload)
+{
+    nWriteProfile = fInitialDownload ? DB_PROFILE_IBD : DB_PROFILE_STEADY;
+    if (fInitialDownload || !fCompactPending || !pdb)
+        return;
+
+    // Compaction was left to pile up behind the big write buffer while
+    // syncing; settle the tree once so steady state reads stay cheap. This
+    // is called under cs_main and a full compaction can take minutes, so it
+    // runs on its own thread; LevelDB serves reads and writes meanwhile and
+    // the global instance is never closed before exit.
+    fCompactPending = false;
+    boost::thread(boost::bind(&ThreadCompactTxDB, pdb)).detach();
+}
+
+bool CTxDB::GetProperty(const string& strProperty, string& strValue)
+{
+    if (!pdb)
+        return false;
+    return pdb->GetProperty(strProperty, &strValue);
+}
+
+uint64_t CTxDB::GetApproximateSize(const string& strPrefix)
+{
+    if (!pdb)
+        return 0;
+
+    // Keys are serialized (string, ...) pairs, so every record of one type
+    // shares the serialized type string as its prefix.
+    CDataStream ssStart(SER_DISK, CLIENT_VERSION);
+    ssStart << strPrefix;
+    string strStart = ssStart.str();
+    string strLimit = strStart;
+    strLimit[strLimit.size() - 1]++;
+
+    leveldb::Range range(strStart, strLimit);
+    uint64_t nSize = 0;
+    pdb->GetApproximateSizes(&range, 1, &nSize);
+    return nSize;
+}
+
 class CBatchScanner : public leveldb::WriteBatch::Handler {
 public:
     std::string needle;
@@ -285,6 +387,22 @@ bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
     return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
 }
 
+bool CTxDB::ReadBlockUndoPos(uint256 hashBlock, CDiskBlockPos& pos)
+{
+    pos.SetNull();
+    return Read(make_pair(string("blockundo"), hashBlock), pos);
+}
+
+bool CTxDB::WriteBlockUndoPos(uint256 hashBlock, const CDiskBlockPos& pos)
+{
+    return Write(make_pair(string("blockundo"), hashBlock), pos);
+}
+
+bool CTxDB::EraseBlockUndoPos(uint256 hashBlock)
+{
+    return Erase(make_pair(string("blockundo"), hashBlock));
+}
+
 bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
 {
     return Read(string("hashBestChain"), hashBestChain);
@@ -295,6 +413,61 @@ bool CTxDB::WriteHashBestChain(uint256 hashBestChain)
     return Write(string("hashBestChain"), hashBestChain);
 }
 
+bool CTxDB::ReadPrunedFlag(bool& fPruned)
+{
+    fPruned = false;
+    return Read(string("pruned"), fPruned);
+}
+
+bool CTxDB::WritePrunedFlag(bool fPruned)
+{
+    return Write(string("pruned"), fPruned);
+}
+
+// Collects the block files that still hold a transaction validation may
+// need to read: one with an unspent output, or one with an output spent by
+// a block at or after nKeepFromFile that could still be disconnected.
+bool CTxDB::FindBlockFilesInUse(unsigned int nKeepFromFile, std::set<unsigned int>& setFilesInUse)
+{
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("tx"), uint256(0));
+    iterator->Seek(ssStartKey.str());
+    while (iterator->Valid())
+    {
+        boost::this_thread::interruption_point();
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.write(iterator->key().data(), iterator->key().size());
+        string strType;
+        ssKey >> strType;
+        if (strType != "tx")
+            break;
+
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue.write(iterator->value().data(), iterator->value().size());
+        CTxIndex txindex;
+        ssValue >> txindex;
+
+        if (!setFilesInUse.count(txindex.pos.nFile))
+        {
+            BOOST_FOREACH(const CDiskTxPos& posSpent, txindex.vSpent)
+            {
+                if (posSpent.IsNull() || posSpent.nFile >= nKeepFromFile)
+                {
+                    setFilesInUse.insert(txindex.pos.nFile);
+                    break;
+                }
+            }
+        }
+        iterator->Next();
+    }
+    leveldb::Status status = iterator->status();
+    delete iterator;
+    if (!status.ok())
+        return error("FindBlockFilesInUse() : %s", status.ToString());
+    return true;
+}
+
 bool CTxDB::ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust)
 {
     return Read(string("bnBestInvalidTrust"), bnBestInvalidTrust);
@@ -436,11 +609,16 @@ bool CTxDB::LoadBlockIndex()
     ReadBestInvalidTrust(bnBestInvalidTrust);
     nBestInvalidTrust = bnBestInvalidTrust.getuint256();
 
+    // Remember whether old block files are gone
+    ReadPrunedFlag(fHavePruned);
+
     // Verify blocks in the best chain
     int nCheckLevel = GetArg("-checklevel", 1);
     int nCheckDepth = GetArg( "-checkblocks", 500);
     if (nCheckDepth == 0)
         nCheckDepth = 1000000000; // suffices until the year 19000
+    if (fHavePruned && nCheckDepth > (int)MIN_BLOCKS_TO_KEEP)
+        nCheckDepth = MIN_BLOCKS_TO_KEEP;
     if (nCheckDepth > nBestHeight)
         nCheckDepth = nBestHeight;
     LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
@@ -9,12 +9,24 @@
 #include "main.h"
 
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+// Tuning profiles for the transaction database. IBD favours write throughput
+// (big memtable, unsynced commits, compaction deferred until sync is done),
+// steady state favours durability and a compact on-disk layout.
+enum DBProfile
+{
+    DB_PROFILE_STEADY,
+    DB_PROFILE_IBD,
+};
+
+DBProfile GetDBProfile();
+
 // Class that provides access to a LevelDB. Note that this class is frequently
 // instantiated on the stack and then destroyed again, so instantiation has to
 // be very cheap. Unfortunately that means, a CTxDB instance is actually just a
@@ -163,6 +175,12 @@ protected:
 
 
 public:
+    // Switches commit durability between the IBD and steady profiles and
+    // runs the deferred full compaction once initial download completes.
+    void SetInitialDownload(bool fInitialDownload);
+    bool GetProperty(const std::string& strProperty, std::string& strValue);
+    uint64_t GetApproximateSize(const std::string& strPrefix);
+
     bool TxnBegin();
     bool TxnCommit();
     bool TxnAbort()
@@ -195,8 +213,14 @@ public:
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx);
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
+    bool ReadBlockUndoPos(uint256 hashBlock, CDiskBlockPos& pos);
+    bool WriteBlockUndoPos(uint256 hashBlock, const CDiskBlockPos& pos);
+    bool EraseBlockUndoPos(uint256 hashBlock);
     bool ReadHashBestChain(uint256& hashBestChain);
     bool WriteHashBestChain(uint256 hashBestChain);
+    bool ReadPrunedFlag(bool& fPruned);
+    bool WritePrunedFlag(bool fPruned);
+    bool FindBlockFilesInUse(unsigned int nKeepFromFile, std::set<unsigned int>& setFilesInUse);
     bool ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust);
     bool WriteBestInvalidTrust(CBigNum bnBestInvalidTrust);
     bool LoadBlockIndex();
@@ -9,8 +9,70 @@
 
 using namespace std;
 
-CTxMemPool::CTxMemPool()
+/** Rolling minimum fee halves every 12 hours once blocks are being found */
+static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+
+// Heap usage of an allocation, assuming the usual 64-bit malloc that rounds
+// up to 16 bytes after an 8 byte header
+static inline size_t MallocUsage(size_t nAlloc)
+{
+    if (nAlloc == 0)
+        return 0;
+    return ((nAlloc + 31) >> 4) << 4;
+}
+
+// A std::map/std::set node is the value plus three pointers and a colour
+static inline size_t TreeNodeUsage(size_t nValue)
+{
+    return MallocUsage(nValue + 4 * sizeof(void*));
+}
+
+static size_t TransactionUsage(const CTransaction& tx)
+{
+    size_t nUsage = MallocUsage(tx.vin.capacity() * sizeof(CTxIn)) + MallocUsage(tx.vout.capacity() * sizeof(CTxOut));
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsage += MallocUsage(txin.scriptSig.capacity());
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsage += MallocUsage(txout.scriptPubKey.capacity());
+    return nUsage;
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry()
+    : nFee(0), nTxSize(0), nTime(0), dPriority(0.0), nHeight(0), nInChainInputValue(0), nSigOps(0), nUsageSize(0)
 {
+    nCountWithAncestors = nCountWithDescendants = 1;
+    nSizeWithAncestors = nSizeWithDescendants = 0;
+    nFeesWithAncestors = nFeesWithDescendants = 0;
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& txIn, int64_t nFeeIn, int64_t nTimeIn, double dPriorityIn,
+                                 unsigned int nHeightIn, int64_t nInChainInputValueIn, unsigned int nSigOpsIn)
+    : tx(txIn), nFee(nFeeIn), nTime(nTimeIn), dPriority(dPriorityIn), nHeight(nHeightIn),
+      nInChainInputValue(nInChainInputValueIn), nSigOps(nSigOpsIn)
+{
+    nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    nUsageSize = TransactionUsage(tx);
+
+    nCountWithAncestors = nCountWithDescendants = 1;
+    nSizeWithAncestors = nSizeWithDescendants = nTxSize;
+    nFeesWithAncestors = nFeesWithDescendants = nFee;
+}
+
+double CTxMemPoolEntry::GetPriority(unsigned int nCurHeight) const
+{
+    if (nCurHeight <= nHeight || nTxSize == 0)
+        return dPriority;
+    return dPriority + (double)nInChainInputValue * (nCurHeight - nHeight) / nTxSize;
+}
+
+CTxMemPool::CTxMemPool() : nTransactionsUpdated(0)
+{
+    nInnerUsage = 0;
+    nLinks = 0;
+    nTotalTxSize = 0;
+    dRollingMinimumFeeRate = 0;
+    nLastRollingFeeUpdate = GetTime();
+    fBlockSinceLastRollingFeeBump = false;
 }
 
 unsigned int CTxMemPool::GetTransactionsUpdated() const
@@ -25,39 +87,263 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+void CTxMemPool::CalculateAncestors(const CTxMemPoolEntry& entry, set<uint256>& setAncestors) const
+{
+    vector<uint256> vStack(entry.setParents.begin(), entry.setParents.end());
+    while (!vStack.empty())
+    {
+        uint256 hash = vStack.back();
+        vStack.pop_back();
+        if (!setAncestors.insert(hash).second)
+            continue;
+        map<uint256, CTxMemPoolEntry>::const_iterator mi = mapTx.find(hash);
+        if (mi != mapTx.end())
+            vStack.insert(vStack.end(), mi->second.setParents.begin(), mi->second.setParents.end());
+    }
+}
+
+void CTxMemPool::CalculateMemPoolAncestors(const uint256& hash, set<uint256>& setAncestors) const
+{
+    LOCK(cs);
+    map<uint256, CTxMemPoolEntry>::const_iterator mi = mapTx.find(hash);
+    if (mi != mapTx.end())
+        CalculateAncestors(mi->second, setAncestors);
+}
+
+void CTxMemPool::CalculateDescendants(const uint256& hash, set<uint256>& setDescendants) const
+{
+    LOCK(cs);
+    map<uint256, CTxMemPoolEntry>::const_iterator mi = mapTx.find(hash);
+    if (mi == mapTx.end())
+        return;
+    vector<uint256> vStack(mi->second.setChildren.begin(), mi->second.setChildren.end());
+    while (!vStack.empty())
+    {
+        uint256 hashChild = vStack.back();
+        vStack.pop_back();
+        if (!setDescendants.insert(hashChild).second)
+            continue;
+        map<uint256, CTxMemPoolEntry>::const_iterator mc = mapTx.find(hashChild);
+        if (mc != mapTx.end())
+            vStack.insert(vStack.end(), mc->second.setChildren.begin(), mc->second.setChildren.end());
+    }
+}
+
+void CTxMemPool::UpdateAncestorState(txiter it, int64_t nSizeDiff, int64_t nFeeDiff, int64_t nCountDiff)
+{
+    CTxMemPoolEntry& entry = it->second;
+    setByAncestorScore.erase(GetAncestorScore(entry, it->first));
+    entry.nSizeWithAncestors += nSizeDiff;
+    entry.nFeesWithAncestors += nFeeDiff;
+    entry.nCountWithAncestors += nCountDiff;
+    setByAncestorScore.insert(GetAncestorScore(entry, it->first));
+}
+
+void CTxMemPool::UpdateDescendantState(txiter it, int64_t nSizeDiff, int64_t nFeeDiff, int64_t nCountDiff)
+{
+    CTxMemPoolEntry& entry = it->second;
+    setByDescendantScore.erase(GetDescendantScore(entry, it->first));
+    entry.nSizeWithDescendants += nSizeDiff;
+    entry.nFeesWithDescendants += nFeeDiff;
+    entry.nCountWithDescendants += nCountDiff;
+    setByDescendantScore.insert(GetDescendantScore(entry, it->first));
+}
+
+void CTxMemPool::RecalculateAncestorState(txiter it)
+{
+    set<uint256> setAncestors;
+    CalculateAncestors(it->second, setAncestors);
+
+    int64_t nSize = it->second.nTxSize, nFees = it->second.nFee, nCount = 1;
+    BOOST_FOREACH(const uint256& hash, setAncestors)
+    {
+        const CTxMemPoolEntry& ancestor = mapTx[hash];
+        nSize += ancestor.nTxSize;
+        nFees += ancestor.nFee;
+        nCount++;
+    }
+    CTxMemPoolEntry& entry = it->second;
+    UpdateAncestorState(it, nSize - (int64_t)entry.nSizeWithAncestors, nFees - entry.nFeesWithAncestors, nCount - (int64_t)entry.nCountWithAncestors);
+}
+
+void CTxMemPool::RecalculateDescendantState(txiter it)
+{
+    set<uint256> setDescendants;
+    CalculateDescendants(it->first, setDescendants);
+
+    int64_t nSize = it->second.nTxSize, nFees = it->second.nFee, nCount = 1;
+    BOOST_FOREACH(const uint256& hash, setDescendants)
+    {
+        const CTxMemPoolEntry& descendant = mapTx[hash];
+        nSize += descendant.nTxSize;
+        nFees += descendant.nFee;
+        nCount++;
+    }
+    CTxMemPoolEntry& entry = it->second;
+    UpdateDescendantState(it, nSize - (int64_t)entry.nSizeWithDescendants, nFees - entry.nFeesWithDescendants, nCount - (int64_t)entry.nCountWithDescendants);
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entryIn)
 {
     // Add to memory pool without checking anything.
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     LOCK(cs);
     {
-        mapTx[hash] = tx;
+        txiter it = mapTx.insert(make_pair(hash, entryIn)).first;
+        CTxMemPoolEntry& entry = it->second;
+        {
+            CReadShard& shard = GetReadShard(hash);
+            boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
+            shard.mapTx[hash] = &entry.tx;
+        }
+        const CTransaction& tx = entry.tx;
         for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+        {
+            mapNextTx[tx.vin[i].prevout] = CInPoint(&entry.tx, i);
+            txiter mi = mapTx.find(tx.vin[i].prevout.hash);
+            if (mi != mapTx.end() && mi != it)
+            {
+                entry.setParents.insert(mi->first);
+                mi->second.setChildren.insert(hash);
+            }
+        }
+
+        // Transactions already in the pool spending this one, e.g. after a
+        // block was disconnected
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            map<COutPoint, CInPoint>::iterator mn = mapNextTx.find(COutPoint(hash, i));
+            if (mn == mapNextTx.end())
+                continue;
+            uint256 hashChild = mn->second.ptx->GetHash();
+            entry.setChildren.insert(hashChild);
+            mapTx[hashChild].setParents.insert(hash);
+        }
+
+        set<uint256> setAncestors;
+        CalculateAncestors(entry, setAncestors);
+        BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+        {
+            const CTxMemPoolEntry& ancestor = mapTx[hashAncestor];
+            entry.nSizeWithAncestors += ancestor.nTxSize;
+            entry.nFeesWithAncestors += ancestor.nFee;
+            entry.nCountWithAncestors++;
+        }
+        setByAncestorScore.insert(GetAncestorScore(entry, hash));
+        setByDescendantScore.insert(GetDescendantScore(entry, hash));
+        setByEntryTime.insert(make_pair(entry.nTime, hash));
+        nInnerUsage += entry.nUsageSize;
+        nLinks += entry.setParents.size() + entry.setChildren.size();
+        nTotalTxSize += entry.nTxSize;
+
+        if (entry.setChildren.empty())
+        {
+            // Common case: the new entry is a leaf, only its ancestors change
+            BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+                UpdateDescendantState(mapTx.find(hashAncestor), entry.nTxSize, entry.nFee, 1);
+        }
+        else
+        {
+            // Linking in the middle of a chain, recompute everything touched
+            set<uint256> setDescendants;
+            CalculateDescendants(hash, setDescendants);
+            set<uint256> setUpdate(setAncestors);
+            BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+            {
+                txiter md = mapTx.find(hashDescendant);
+                RecalculateAncestorState(md);
+                CalculateAncestors(md->second, setUpdate);
+            }
+            setUpdate.insert(hash);
+            BOOST_FOREACH(const uint256& hashUpdate, setUpdate)
+                RecalculateDescendantState(mapTx.find(hashUpdate));
+        }
+
         nTransactionsUpdated++;
     }
     return true;
 }
 
+void CTxMemPool::removeUnchecked(txiter it)
+{
+    const uint256 hash = it->first;
+    CTxMemPoolEntry& entry = it->second;
+
+    set<uint256> setAncestors;
+    CalculateAncestors(entry, setAncestors);
+    set<uint256> setDescendants;
+    CalculateDescendants(hash, setDescendants);
+
+    BOOST_FOREACH(const CTxIn& txin, entry.tx.vin)
+        mapNextTx.erase(txin.prevout);
+    BOOST_FOREACH(const uint256& hashParent, entry.setParents)
+        mapTx[hashParent].setChildren.erase(hash);
+    BOOST_FOREACH(const uint256& hashChild, entry.setChildren)
+        mapTx[hashChild].setParents.erase(hash);
+
+    {
+        CReadShard& shard = GetReadShard(hash);
+        boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
+        shard.mapTx.erase(hash);
+    }
+    setByAncestorScore.erase(GetAncestorScore(entry, hash));
+    setByDescendantScore.erase(GetDescendantScore(entry, hash));
+    setByEntryTime.erase(make_pair(entry.nTime, hash));
+    nInnerUsage -= entry.nUsageSize;
+    nLinks -= entry.setParents.size() + entry.setChildren.size();
+    nTotalTxSize -= entry.nTxSize;
+    int64_t nSize = entry.nTxSize, nFee = entry.nFee;
+    mapTx.erase(it);
+
+    if (setDescendants.empty())
+    {
+        BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+            UpdateDescendantState(mapTx.find(hashAncestor), -nSize, -nFee, -1);
+    }
+    else
+    {
+        // Removing from the middle of a chain (the entry was mined before
+        // its descendants), recompute the affected aggregates
+        BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+            RecalculateAncestorState(mapTx.find(hashDescendant));
+        BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+            RecalculateDescendantState(mapTx.find(hashAncestor));
+    }
+}
+
+void CTxMemPool::removeWithDescendants(const uint256& hash, vector<uint256>* pvRemoved)
+{
+    // Remove descendants first, deepest first, so that every removal is of
+    // a leaf
+    set<uint256> setDescendants;
+    CalculateDescendants(hash, setDescendants);
+    vector<pair<uint64_t, uint256> > vRemove;
+    BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+        vRemove.push_back(make_pair(mapTx[hashDescendant].nCountWithAncestors, hashDescendant));
+    sort(vRemove.rbegin(), vRemove.rend());
+    vRemove.push_back(make_pair(0, hash));
+    for (unsigned int i = 0; i < vRemove.size(); i++)
+    {
+        removeUnchecked(mapTx.find(vRemove[i].second));
+        if (pvRemoved)
+            pvRemoved->push_back(vRemove[i].second);
+    }
+}
+
 bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
 {
     // Remove transaction from memory pool
     {
         LOCK(cs);
         uint256 hash = tx.GetHash();
-        if (mapTx.count(hash))
+        txiter it = mapTx.find(hash);
+        if (it != mapTx.end())
         {
-            if (fRecursive) {
-                for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
-                    if (it != mapNextTx.end())
-                        remove(*it->second.ptx, true);
-                }
-            }
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-                mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
+            if (fRecursive)
+                removeWithDescendants(hash);
+            else
+                removeUnchecked(it);
             nTransactionsUpdated++;
         }
     }
@@ -79,29 +365,172 @@ bool CTxMemPool::removeConflicts(const CTransaction &tx)
     return true;
 }
 
+void CTxMemPool::removeForBlock(const vector<CTransaction>& vtx)
+{
+    LOCK(cs);
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        remove(tx);
+        removeConflicts(tx);
+    }
+    nLastRollingFeeUpdate = GetTime();
+    fBlockSinceLastRollingFeeBump = true;
+}
+
 void CTxMemPool::clear()
 {
     LOCK(cs);
+    for (unsigned int i = 0; i < READ_SHARDS; i++)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(vReadShards[i].mutex);
+        vReadShards[i].mapTx.clear();
+    }
     mapTx.clear();
     mapNextTx.clear();
+    setByAncestorScore.clear();
+    setByDescendantScore.clear();
+    setByEntryTime.clear();
+    nInnerUsage = 0;
+    nLinks = 0;
+    nTotalTxSize = 0;
     ++nTransactionsUpdated;
 }
 
-void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
+void CTxMemPool::queryHashes(std::vector<uint256>& vtxid) const
 {
     vtxid.clear();
 
-    LOCK(cs);
-    vtxid.reserve(mapTx.size());
-    for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
-        vtxid.push_back((*mi).first);
+    for (unsigned int i = 0; i < READ_SHARDS; i++)
+    {
+        boost::shared_lock<boost::shared_mutex> lock(vReadShards[i].mutex);
+        vtxid.reserve(vtxid.size() + vReadShards[i].mapTx.size());
+        for (map<uint256, const CTransaction*>::const_iterator mi = vReadShards[i].mapTx.begin(); mi != vReadShards[i].mapTx.end(); ++mi)
+            vtxid.push_back(mi->first);
+    }
+}
+
+unsigned long CTxMemPool::size() const
+{
+    unsigned long nSize = 0;
+    for (unsigned int i = 0; i < READ_SHARDS; i++)
+    {
+        boost::shared_lock<boost::shared_mutex> lock(vReadShards[i].mutex);
+        nSize += vReadShards[i].mapTx.size();
+    }
+    return nSize;
+}
+
+bool CTxMemPool::exists(uint256 hash) const
+{
+    const CReadShard& shard = GetReadShard(hash);
+    boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
+    return (shard.mapTx.count(hash) != 0);
 }
 
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
-    LOCK(cs);
-    std::map<uint256, CTransaction>::const_iterator i = mapTx.find(hash);
-    if (i == mapTx.end()) return false;
-    result = i->second;
+    // The entry can't be erased while the shard is locked, removeUnchecked
+    // takes the shard lock first
+    const CReadShard& shard = GetReadShard(hash);
+    boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
+    map<uint256, const CTransaction*>::const_iterator mi = shard.mapTx.find(hash);
+    if (mi == shard.mapTx.end())
+        return false;
+    result = *mi->second;
     return true;
 }
+
+size_t CTxMemPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    // mapTx, the read index, mapNextTx, both score indexes and the time
+    // index are trees; every link is kept twice, in the parent's setChildren
+    // and the child's setParents
+    return mapTx.size() * (TreeNodeUsage(sizeof(pair<const uint256, CTxMemPoolEntry>)) + 2 * TreeNodeUsage(sizeof(CMemPoolScore))) +
+           mapTx.size() * TreeNodeUsage(sizeof(pair<int64_t, uint256>)) +
+           mapTx.size() * TreeNodeUsage(sizeof(pair<const uint256, const CTransaction*>)) +
+           mapNextTx.size() * TreeNodeUsage(sizeof(pair<const COutPoint, CInPoint>)) +
+           nLinks * TreeNodeUsage(sizeof(uint256)) + nInnerUsage;
+}
+
+void CTxMemPool::trackPackageRemoved(int64_t nFeeRate)
+{
+    AssertLockHeld(cs);
+    if (nFeeRate > dRollingMinimumFeeRate)
+    {
+        dRollingMinimumFeeRate = nFeeRate;
+        fBlockSinceLastRollingFeeBump = false;
+    }
+}
+
+void CTxMemPool::TrimToSize(size_t nSizeLimit, vector<uint256>* pvRemoved)
+{
+    LOCK(cs);
+
+    unsigned int nTxnRemoved = 0;
+    int64_t nMaxFeeRateRemoved = 0;
+    while (!setByDescendantScore.empty() && DynamicMemoryUsage() > nSizeLimit)
+    {
+        CMemPoolScore worst = *setByDescendantScore.rbegin();
+
+        // The new minimum is the evicted package's fee rate plus the relay
+        // fee, so that a replacement has to pay for its own relay as well
+        int64_t nFeeRate = worst.nFees * 1000 / std::max(worst.nSize, (uint64_t)1) + MIN_RELAY_TX_FEE;
+        trackPackageRemoved(nFeeRate);
+        nMaxFeeRateRemoved = std::max(nMaxFeeRateRemoved, nFeeRate);
+
+        size_t nBefore = mapTx.size();
+        removeWithDescendants(worst.hash, pvRemoved);
+        nTxnRemoved += nBefore - mapTx.size();
+        nTransactionsUpdated++;
+    }
+
+    if (nMaxFeeRateRemoved > 0)
+        LogPrint("mempool", "Removed %u txn, rolling minimum fee bumped to %d per kB\n", nTxnRemoved, nMaxFeeRateRemoved);
+}
+
+int CTxMemPool::Expire(int64_t nTime)
+{
+    LOCK(cs);
+
+    vector<uint256> vExpired;
+    for (set<pair<int64_t, uint256> >::const_iterator it = setByEntryTime.begin(); it != setByEntryTime.end() && it->first < nTime; ++it)
+        vExpired.push_back(it->second);
+
+    size_t nBefore = mapTx.size();
+    BOOST_FOREACH(const uint256& hash, vExpired)
+        if (mapTx.count(hash)) // may already be gone as a descendant
+            removeWithDescendants(hash);
+    if (!vExpired.empty())
+        nTransactionsUpdated++;
+    return nBefore - mapTx.size();
+}
+
+int64_t CTxMemPool::GetMinFee(size_t nSizeLimit) const
+{
+    LOCK(cs);
+    if (!fBlockSinceLastRollingFeeBump || dRollingMinimumFeeRate == 0)
+        return (int64_t)dRollingMinimumFeeRate;
+
+    int64_t nNow = GetTime();
+    if (nNow > nLastRollingFeeUpdate + 10)
+    {
+        // Decay faster while the pool is well below its limit
+        double dHalfLife = ROLLING_FEE_HALFLIFE;
+        size_t nUsage = DynamicMemoryUsage();
+        if (nUsage < nSizeLimit / 4)
+            dHalfLife /= 4;
+        else if (nUsage < nSizeLimit / 2)
+            dHalfLife /= 2;
+
+        dRollingMinimumFeeRate = dRollingMinimumFeeRate / pow(2.0, (nNow - nLastRollingFeeUpdate) / dHalfLife);
+        nLastRollingFeeUpdate = nNow;
+
+        if (dRollingMinimumFeeRate < MIN_RELAY_TX_FEE / 2)
+        {
+            dRollingMinimumFeeRate = 0;
+            return 0;
+        }
+    }
+    return std::max((int64_t)dRollingMinimumFeeRate, MIN_RELAY_TX_FEE);
+}
@@ -5,7 +5,93 @@
 #ifndef BITCOIN_TXMEMPOOL_H
 #define BITCOIN_TXMEMPOOL_H
 
-#include "chain.h"
+#include "main.h"
+
+#include <set>
+
+#include <boost/thread/shared_mutex.hpp>
+
+class CTxMemPool;
+
+/** A transaction in the memory pool, with the data needed to rank it for
+ * block inclusion. The ancestor and descendant aggregates cover all
+ * in-pool transactions this one depends on (or that depend on it),
+ * including the transaction itself, and are kept up to date by CTxMemPool.
+ */
+class CTxMemPoolEntry
+{
+private:
+    CTransaction tx;
+    int64_t nFee;               // fee paid by this transaction
+    unsigned int nTxSize;       // serialized size
+    int64_t nTime;              // local time when entering the pool
+    double dPriority;           // priority when entering the pool
+    unsigned int nHeight;       // chain height when entering the pool
+    int64_t nInChainInputValue; // sum of inputs already in the chain, for priority aging
+    unsigned int nSigOps;       // legacy and P2SH sigops
+    size_t nUsageSize;          // heap memory used by tx
+
+    std::set<uint256> setParents;
+    std::set<uint256> setChildren;
+
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    int64_t nFeesWithAncestors;
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    int64_t nFeesWithDescendants;
+
+    friend class CTxMemPool;
+
+public:
+    CTxMemPoolEntry();
+    CTxMemPoolEntry(const CTransaction& txIn, int64_t nFeeIn, int64_t nTimeIn, double dPriorityIn,
+                    unsigned int nHeightIn, int64_t nInChainInputValueIn, unsigned int nSigOpsIn);
+
+    const CTransaction& GetTx() const { return tx; }
+    int64_t GetFee() const { return nFee; }
+    unsigned int GetTxSize() const { return nTxSize; }
+    int64_t GetTime() const { return nTime; }
+    unsigned int GetHeight() const { return nHeight; }
+    unsigned int GetSigOps() const { return nSigOps; }
+    size_t DynamicMemoryUsage() const { return nUsageSize; }
+
+    // Priority at nCurHeight, growing with the age of the chain inputs
+    double GetPriority(unsigned int nCurHeight) const;
+
+    const std::set<uint256>& GetParents() const { return setParents; }
+    const std::set<uint256>& GetChildren() const { return setChildren; }
+
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    int64_t GetFeesWithAncestors() const { return nFeesWithAncestors; }
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    int64_t GetFeesWithDescendants() const { return nFeesWithDescendants; }
+};
+
+/** Sort key ranking a set of transactions by fee rate, highest first,
+ * with ties broken by hash so that keys are unique.
+ */
+class CMemPoolScore
+{
+public:
+    int64_t nFees;
+    uint64_t nSize;
+    uint256 hash;
+
+    CMemPoolScore(int64_t nFeesIn, uint64_t nSizeIn, const uint256& hashIn) : nFees(nFeesIn), nSize(nSizeIn), hash(hashIn) {}
+
+    friend bool operator<(const CMemPoolScore& a, const CMemPoolScore& b)
+    {
+        // Compare nFees/nSize without dividing
+        double f1 = (double)a.nFees * b.nSize;
+        double f2 = (double)b.nFees * a.nSize;
+        if (f1 == f2)
+            return a.hash < b.hash;
+        return f1 > f2;
+    }
+};
 
 /*
  * CTxMemPool stores valid-according-to-the-current-best-chain
@@ -16,39 +102,113 @@
  * are added to the pool: if a new transaction double-spends
  * an input of a transaction in the pool, it is dropped,
  * as are non-standard transactions.
+ *
+ * Entries are also indexed by ancestor fee rate (the fee rate of the
+ * transaction together with its unconfirmed ancestors), so that block
+ * assembly can take the best packages first without scanning the pool,
+ * and by entry time so that expiry only looks at what is due.
  */
 class CTxMemPool
 {
 private:
     unsigned int nTransactionsUpdated;
 
+    size_t nInnerUsage;         // sum of entry heap usage
+    uint64_t nLinks;            // number of parent/child links between entries
+    uint64_t nTotalTxSize;      // sum of serialized sizes
+
+    // Fee rate (per 1000 bytes) the pool was trimmed at, decaying back to
+    // zero once blocks start draining it again
+    mutable double dRollingMinimumFeeRate;
+    mutable int64_t nLastRollingFeeUpdate;
+    mutable bool fBlockSinceLastRollingFeeBump;
+
+    typedef std::map<uint256, CTxMemPoolEntry>::iterator txiter;
+
+    // Lookups by hash are served from a sharded index of pointers into
+    // mapTx, each shard behind its own reader-writer lock, so that exists(),
+    // lookup(), size() and queryHashes() never wait for cs. Writers already
+    // hold cs and only take the one shard they change.
+    static const unsigned int READ_SHARDS = 16;
+    struct CReadShard
+    {
+        mutable boost::shared_mutex mutex;
+        std::map<uint256, const CTransaction*> mapTx;
+    };
+    CReadShard vReadShards[READ_SHARDS];
+
+    CReadShard& GetReadShard(const uint256& hash) { return vReadShards[*hash.begin() % READ_SHARDS]; }
+    const CReadShard& GetReadShard(const uint256& hash) const { return vReadShards[*hash.begin() % READ_SHARDS]; }
+
+    void CalculateAncestors(const CTxMemPoolEntry& entry, std::set<uint256>& setAncestors) const;
+    void UpdateAncestorState(txiter it, int64_t nSizeDiff, int64_t nFeeDiff, int64_t nCountDiff);
+    void UpdateDescendantState(txiter it, int64_t nSizeDiff, int64_t nFeeDiff, int64_t nCountDiff);
+    void RecalculateAncestorState(txiter it);
+    void RecalculateDescendantState(txiter it);
+    void removeUnchecked(txiter it);
+    void removeWithDescendants(const uint256& hash, std::vector<uint256>* pvRemoved = NULL);
+    void trackPackageRemoved(int64_t nFeeRate);
+
 public:
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
+    std::map<uint256, CTxMemPoolEntry> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
+    std::set<CMemPoolScore> setByAncestorScore;
+    std::set<CMemPoolScore> setByDescendantScore;
+    std::set<std::pair<int64_t, uint256> > setByEntryTime;
 
     CTxMemPool();
 
-    bool addUnchecked(const uint256& hash, CTransaction &tx);
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry);
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
+    void removeForBlock(const std::vector<CTransaction>& vtx);
     void clear();
-    void queryHashes(std::vector<uint256>& vtxid);
+    void queryHashes(std::vector<uint256>& vtxid) const;
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
 
-    unsigned long size() const
+    /** In-pool ancestors/descendants of hash, not including hash itself */
+    void CalculateMemPoolAncestors(const uint256& hash, std::set<uint256>& setAncestors) const;
+    void CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const;
+
+    static CMemPoolScore GetAncestorScore(const CTxMemPoolEntry& entry, const uint256& hash)
     {
-        LOCK(cs);
-        return mapTx.size();
+        return CMemPoolScore(entry.nFeesWithAncestors, entry.nSizeWithAncestors, hash);
+    }
+
+    // Eviction key: the better of the entry's own fee rate and that of the
+    // entry with its descendants, so a well paying child protects its parent
+    static CMemPoolScore GetDescendantScore(const CTxMemPoolEntry& entry, const uint256& hash)
+    {
+        if ((double)entry.nFee * entry.nSizeWithDescendants > (double)entry.nFeesWithDescendants * entry.nTxSize)
+            return CMemPoolScore(entry.nFee, entry.nTxSize, hash);
+        return CMemPoolScore(entry.nFeesWithDescendants, entry.nSizeWithDescendants, hash);
     }
 
-    bool exists(uint256 hash) const
+    /** Approximate heap memory used by the pool, in bytes */
+    size_t DynamicMemoryUsage() const;
+    uint64_t GetTotalTxSize() const
     {
         LOCK(cs);
-        return (mapTx.count(hash) != 0);
+        return nTotalTxSize;
     }
 
+    /** Evict the lowest fee rate packages until usage is below nSizeLimit,
+     * raising the rolling minimum fee to just above what was evicted */
+    void TrimToSize(size_t nSizeLimit, std::vector<uint256>* pvRemoved = NULL);
+
+    /** Remove transactions that entered the pool before nTime, and their
+     * descendants. Returns the number removed. */
+    int Expire(int64_t nTime);
+
+    /** Minimum fee per 1000 bytes needed to enter a pool limited to
+     * nSizeLimit bytes, zero unless the pool has recently been full */
+    int64_t GetMinFee(size_t nSizeLimit) const;
+
+    // Read path, does not take cs
+    unsigned long size() const;
+    bool exists(uint256 hash) const;
     bool lookup(uint256 hash, CTransaction& result) const;
 };
 
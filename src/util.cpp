@@ -1298,7 +1298,73 @@ void FileCommit(FILE *fileout)
     HANDLE hFile = (HANDLE)_get_osfhandle(_fileno(fileout));
     FlushFileBuffers(hFile);
 #else
+    #if defined(__linux__) || defined(__NetBSD__)
+    fdatasync(fileno(fileout));
+    #else
     fsync(fileno(fileout));
+    #endif
+#endif
+}
+
+// fseek/ftell take a long, which is 32 bits on Windows and 32-bit unix
+bool FileSeek(FILE *file, int64_t nOffset, int nOrigin)
+{
+#ifdef WIN32
+    return _fseeki64(file, nOffset, nOrigin) == 0;
+#else
+    return fseeko(file, (off_t)nOffset, nOrigin) == 0;
+#endif
+}
+
+int64_t FileTell(FILE *file)
+{
+#ifdef WIN32
+    return _ftelli64(file);
+#else
+    return (int64_t)ftello(file);
+#endif
+}
+
+bool TruncateFile(FILE *file, unsigned int length)
+{
+#if defined(WIN32)
+    return _chsize_s(_fileno(file), length) == 0;
+#else
+    return ftruncate(fileno(file), length) == 0;
+#endif
+}
+
+// Reserve disk space for a file up front so appends don't fragment it
+// and don't have to grow the file's metadata on every write
+void AllocateFileRange(FILE *file, unsigned int offset, unsigned int length)
+{
+#if defined(WIN32)
+    // Windows-specific version
+    HANDLE hFile = (HANDLE)_get_osfhandle(_fileno(file));
+    LARGE_INTEGER nFileSize;
+    int64_t nEndPos = (int64_t)offset + length;
+    nFileSize.u.LowPart = nEndPos & 0xFFFFFFFF;
+    nFileSize.u.HighPart = nEndPos >> 32;
+    SetFilePointerEx(hFile, nFileSize, 0, FILE_BEGIN);
+    SetEndOfFile(hFile);
+#elif defined(__linux__)
+    // Version using posix_fallocate
+    off_t nEndPos = (off_t)offset + length;
+    if (posix_fallocate(fileno(file), 0, nEndPos) == 0)
+        return;
+    // Fallback version below if the filesystem does not support it
+#endif
+#if !defined(WIN32)
+    static const char buf[65536] = {};
+    if (!FileSeek(file, offset))
+        return;
+    while (length > 0) {
+        unsigned int now = 65536;
+        if (length < now)
+            now = length;
+        fwrite(buf, 1, now, file); // allowed to fail; this function is advisory anyway
+        length -= now;
+    }
 #endif
 }
 
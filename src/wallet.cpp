@@ -23,6 +23,7 @@
 #include "chainparams.h"
 #include "smessage.h"
 #include "webwalletconnector.h"
+#include "init.h"
 
 #include <boost/algorithm/string/replace.hpp>
 
@@ -51,6 +52,20 @@ struct CompareValueOnly
     }
 };
 
+// Orders available coins by value, so that SelectCoinsMinConf can find the
+// coins below a target with a binary search instead of a full scan
+struct CompareCoinValue
+{
+    bool operator()(const COutput& a, const COutput& b) const
+    {
+        return a.tx->vout[a.i].nValue < b.tx->vout[b.i].nValue;
+    }
+    bool operator()(const COutput& a, int64_t nValue) const
+    {
+        return a.tx->vout[a.i].nValue < nValue;
+    }
+};
+
 const CWalletTx* CWallet::GetWalletTx(const uint256& hash) const
 {
     LOCK(cs_wallet);
@@ -60,13 +75,80 @@ const CWalletTx* CWallet::GetWalletTx(const uint256& hash) const
     return &(it->second);
 }
 
+// Children of the keypool chain are derived with hardened indices, so that a
+// leaked child key and the chain's public key reveal nothing about the others
+static const unsigned int HD_HARDENED_KEY_LIMIT = 0x80000000;
+
+// Keypool keys are generated and written in batches of this size, one
+// database transaction each
+static const unsigned int KEYPOOL_BATCH_SIZE = 500;
+
+bool CWallet::UseHDKeys() const
+{
+    // Once a seed exists the wallet keeps deriving from it, so that older
+    // backups go on covering the keys handed out after them
+    return !hdChain.IsNull() || GetBoolArg("-usehd", DEFAULT_USE_HD_WALLET);
+}
+
+// Starts a new key chain from a fresh random seed
+bool CWallet::NewHDSeed()
+{
+    AssertLockHeld(cs_wallet); // mapKeyMetadata
+    CKey seed;
+    seed.MakeNewKey(true);
+    CPubKey pubkey = seed.GetPubKey();
+    int64_t nCreationTime = GetTime();
+    mapKeyMetadata[pubkey.GetID()] = CKeyMetadata(nCreationTime);
+    if (!nTimeFirstKey || nCreationTime < nTimeFirstKey)
+        nTimeFirstKey = nCreationTime;
+
+    // The seed is stored as an ordinary key, encrypted along with the others
+    if (!AddKeyPubKey(seed, pubkey))
+        return error("CWallet::NewHDSeed() : AddKey failed");
+    CHDChain chain;
+    chain.seedID = pubkey.GetID();
+    if (fFileBacked && !CWalletDB(strWalletFile).WriteHDChain(chain))
+        return error("CWallet::NewHDSeed() : writing key chain failed");
+    hdChain = chain;
+    LogPrintf("CWallet::NewHDSeed() : created seed %s\n", CDigitalNoteAddress(chain.seedID).ToString());
+    return true;
+}
+
+// Returns the extended key m/0'/0' whose hardened children are the keypool
+// keys, creating the seed first when -usehd was just switched on
+bool CWallet::GetHDChainKey(CExtKey& chainKeyRet)
+{
+    AssertLockHeld(cs_wallet);
+    if (hdChain.IsNull() && !NewHDSeed())
+        return false;
+
+    CKey seed;
+    if (!GetKey(hdChain.seedID, seed))
+        return error("CWallet::GetHDChainKey() : seed key %s not found", CDigitalNoteAddress(hdChain.seedID).ToString());
+    CExtKey masterKey, accountKey;
+    masterKey.SetMaster(seed.begin(), seed.size());
+    return masterKey.Derive(accountKey, HD_HARDENED_KEY_LIMIT) && accountKey.Derive(chainKeyRet, HD_HARDENED_KEY_LIMIT);
+}
+
 CPubKey CWallet::GenerateNewKey()
 {
     AssertLockHeld(cs_wallet); // mapKeyMetadata
     bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
 
     CKey secret;
-    secret.MakeNewKey(fCompressed);
+    if (fCompressed && UseHDKeys())
+    {
+        CExtKey chainKey, childKey;
+        if (!GetHDChainKey(chainKey))
+            throw std::runtime_error("CWallet::GenerateNewKey() : deriving key chain failed");
+        // Skip invalid children, which occur with probability below 2^-127
+        while (!chainKey.Derive(childKey, hdChain.nChildCounter++ | HD_HARDENED_KEY_LIMIT)) {}
+        if (fFileBacked && !CWalletDB(strWalletFile).WriteHDChain(hdChain))
+            throw std::runtime_error("CWallet::GenerateNewKey() : writing key chain failed");
+        secret = childKey.key;
+    }
+    else
+        secret.MakeNewKey(fCompressed);
 
     // Compressed public keys were introduced in version 0.6.0
     if (fCompressed)
@@ -141,6 +223,12 @@ bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    {
+        LOCK(cs_wallet);
+        fUnspentIndexStale = true;
+        fAddressGroupsStale = true;
+        balanceCache.fValid = false;
+    }
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
@@ -172,6 +260,12 @@ bool CWallet::AddWatchOnly(const CScript &dest)
     if (!CCryptoKeyStore::AddWatchOnly(dest))
         return false;
     nTimeFirstKey = 1; // No birthday information for watch-only keys.
+    {
+        LOCK(cs_wallet);
+        fUnspentIndexStale = true;
+        fAddressGroupsStale = true;
+        balanceCache.fValid = false;
+    }
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteWatchOnly(dest);
@@ -182,6 +276,9 @@ bool CWallet::RemoveWatchOnly(const CScript &dest)
     AssertLockHeld(cs_wallet);
     if (!CCryptoKeyStore::RemoveWatchOnly(dest))
         return false;
+    fUnspentIndexStale = true;
+    fAddressGroupsStale = true;
+    balanceCache.fValid = false;
     if (!HaveWatchOnly())
         NotifyWatchonlyChanged(false);
     if (fFileBacked)
@@ -272,6 +369,7 @@ bool CWallet::Unlock(const SecureString& strWalletPassphrase, bool anonymizeOnly
         fWalletUnlockStakingOnly = stakingOnly;
         UnlockStealthAddresses(vMasterKey);
         SecureMsgWalletUnlocked();
+        WakeStakeMiner(STAKE_WAKE_WALLET);
         return true;
     }
     return false;
@@ -569,6 +667,14 @@ bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
 
         Lock();
         Unlock(strWalletPassphrase);
+        // Unencrypted backups and dumps hold the current seed, so keys made
+        // from now on come from a new one
+        if (!hdChain.IsNull())
+        {
+            hdChain.SetNull();
+            if (!NewHDSeed())
+                LogPrintf("EncryptWallet() : Error: replacing the deterministic key seed failed\n");
+        }
         NewKeyPool();
         Lock();
 
@@ -599,10 +705,166 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        fUnspentIndexStale = true;
+        fAddressGroupsStale = true;
+        balanceCache.fValid = false;
+    }
+}
+
+// True if some output of ours is neither marked spent nor spent by a
+// transaction we know about. Outputs spent by a since conflicted
+// transaction count as spent here until the next MarkDirty().
+bool CWallet::HasUnspentOutput(const CWalletTx& wtx) const
+{
+    uint256 hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        if (IsMine(wtx.vout[i]) == ISMINE_NO)
+            continue;
+        if (!wtx.IsSpent(i) || !mapTxSpends.count(COutPoint(hash, i)))
+            return true;
+    }
+    return false;
+}
+
+void CWallet::UpdateUnspent(const uint256& hash)
+{
+    AssertLockHeld(cs_wallet);
+    balanceCache.fValid = false;
+    if (fUnspentIndexStale)
+        return;
+
+    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+    if (mi != mapWallet.end() && HasUnspentOutput(mi->second))
+        setWalletUnspent.insert(hash);
+    else
+        setWalletUnspent.erase(hash);
+}
+
+const std::set<uint256>& CWallet::GetUnspentIndex() const
+{
+    AssertLockHeld(cs_wallet);
+    if (fUnspentIndexStale)
+    {
+        setWalletUnspent.clear();
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            if (HasUnspentOutput(it->second))
+                setWalletUnspent.insert(it->first);
+        fUnspentIndexStale = false;
+        LogPrint("wallet", "GetUnspentIndex() : %u of %u wallet transactions unspent\n", setWalletUnspent.size(), mapWallet.size());
+    }
+    return setWalletUnspent;
+}
+
+// CStealthAddress only orders, so destinations are compared through operator<
+static bool SameDestination(const CTxDestination& a, const CTxDestination& b)
+{
+    return !(a < b) && !(b < a);
+}
+
+CTxDestination CWallet::FindAddressGroup(const CTxDestination& address) const
+{
+    CTxDestination root = address;
+    map<CTxDestination, CTxDestination>::iterator it;
+    while ((it = mapAddressParent.find(root)) != mapAddressParent.end() && !SameDestination(it->second, root))
+        root = it->second;
+
+    // Point the whole path at the root, so the next lookup is direct
+    CTxDestination next = address;
+    while (!SameDestination(next, root))
+    {
+        it = mapAddressParent.find(next);
+        next = it->second;
+        it->second = root;
+    }
+    return root;
+}
+
+// Adds the outputs of ours in wtx as addresses, and joins its input
+// addresses and change into one group
+void CWallet::GroupAddresses(const CWalletTx& wtx) const
+{
+    vector<CTxDestination> vGroup;
+    if (wtx.vin.size() > 0 && IsMine(wtx.vin[0]))
+    {
+        // group all input addresses with each other
+        BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+        {
+            CTxDestination address;
+            if (!IsMine(txin)) /* If this input isn't mine, ignore it */
+                continue;
+            if (!ExtractDestination(mapWallet.find(txin.prevout.hash)->second.vout[txin.prevout.n].scriptPubKey, address))
+                continue;
+            vGroup.push_back(address);
+        }
+
+        // group change with input addresses
+        if (!vGroup.empty())
+        {
+            BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+            {
+                CTxDestination address;
+                if (IsChange(txout) && ExtractDestination(txout.scriptPubKey, address))
+                    vGroup.push_back(address);
+            }
+        }
+    }
+
+    // lone addrs are groups by themselves
+    BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+    {
+        CTxDestination address;
+        if (IsMine(txout) && ExtractDestination(txout.scriptPubKey, address))
+            mapAddressParent.insert(make_pair(address, address));
+    }
+
+    for (unsigned int i = 0; i < vGroup.size(); i++)
+    {
+        mapAddressParent.insert(make_pair(vGroup[i], vGroup[i]));
+        CTxDestination root = FindAddressGroup(vGroup[i]);
+        CTxDestination rootFirst = FindAddressGroup(vGroup[0]);
+        if (!SameDestination(root, rootFirst))
+            mapAddressParent[root] = rootFirst;
+    }
+}
+
+void CWallet::UpdateAddressGroups(const CWalletTx& wtx)
+{
+    AssertLockHeld(cs_wallet);
+    if (fAddressGroupsStale)
+        return;
+
+    GroupAddresses(wtx);
+
+    // Transactions spending wtx that arrived before it now have inputs of ours
+    uint256 hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        pair<TxSpends::const_iterator, TxSpends::const_iterator> range = mapTxSpends.equal_range(COutPoint(hash, i));
+        for (TxSpends::const_iterator it = range.first; it != range.second; ++it)
+        {
+            map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(it->second);
+            if (mi != mapWallet.end())
+                GroupAddresses(mi->second);
+        }
     }
 }
 
-bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
+const std::map<CTxDestination, CTxDestination>& CWallet::GetAddressGroupIndex() const
+{
+    AssertLockHeld(cs_wallet);
+    if (fAddressGroupsStale)
+    {
+        mapAddressParent.clear();
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            GroupAddresses(it->second);
+        fAddressGroupsStale = false;
+        LogPrint("wallet", "GetAddressGroupIndex() : %u addresses in %u wallet transactions\n", mapAddressParent.size(), mapWallet.size());
+    }
+    return mapAddressParent;
+}
+
+bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletDB* pwalletdb)
 {
     uint256 hash = wtxIn.GetHash();
     if (fFromLoadWallet)
@@ -624,7 +886,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         if (fInsertedNew)
         {
             wtx.nTimeReceived = GetAdjustedTime();
-            wtx.nOrderPos = IncOrderPosNext();
+            wtx.nOrderPos = IncOrderPosNext(pwalletdb);
             wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
 
             wtx.nTimeSmart = wtx.nTimeReceived;
@@ -701,11 +963,29 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
 
         // Write to disk
         if (fInsertedNew || fUpdated)
-            if (!wtx.WriteToDisk())
+            if (!wtx.WriteToDisk(pwalletdb))
                 return false;
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        if (fUpdated)
+            EraseStakeCache(hash);
+
+        // Outputs this spends may now be fully spent, and its own are new
+        if (fInsertedNew)
+        {
+            AddToSpends(hash);
+            if (!wtx.IsCoinBase())
+            {
+                BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+                {
+                    if (mapWallet.count(txin.prevout.hash))
+                        UpdateUnspent(txin.prevout.hash);
+                }
+            }
+            UpdateAddressGroups(wtx);
+        }
+        UpdateUnspent(hash);
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -735,7 +1015,7 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
         if (fExisted && !fUpdate) return false;
 
         mapValue_t mapNarr;
-        FindStealthTransactions(tx, mapNarr);
+        FindStealthTransactions(tx, mapNarr, pblock);
 
         if (fExisted || IsMine(tx) || IsFromMe(tx))
         {
@@ -792,6 +1072,7 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock, bool
             coin.BindWallet(this);
             coin.MarkSpent(txin.prevout.n);
             coin.WriteToDisk();
+            UpdateUnspent(txin.prevout.hash);
             NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
         }
     }
@@ -805,6 +1086,9 @@ void CWallet::EraseFromWallet(const uint256 &hash)
         LOCK(cs_wallet);
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
+        EraseStakeCache(hash);
+        UpdateUnspent(hash);
+        fAddressGroupsStale = true;
     }
     return;
 }
@@ -1061,40 +1345,247 @@ void CWalletTx::AddSupportingTransactions(CTxDB& txdb)
     reverse(vtxPrev.begin(), vtxPrev.end());
 }
 
-bool CWalletTx::WriteToDisk()
+bool CWalletTx::WriteToDisk(CWalletDB* pwalletdb)
 {
+    if (pwalletdb)
+        return pwalletdb->WriteTx(GetHash(), *this);
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
+// Blocks read ahead per batch during a rescan
+static const unsigned int RESCAN_BATCH_BLOCKS = 500;
+
+// Cheap test for transactions that may pay us, used to skip blocks during
+// a rescan without taking the wallet lock per output. It may give false
+// positives, AddToWalletIfInvolvingMe() has the final say; it must never
+// give a false negative.
+class CWalletScanFilter
+{
+private:
+    const CWallet& wallet;
+    std::set<CKeyID> setKeys;
+    bool fWatchOnly;
+    CStealthScanner stealthScanner;
+
+    // Whether an ephemeral key in tx derives, for one of our stealth
+    // addresses, the key of one of its outputs
+    bool IsStealthPayment(const CTransaction& tx, const std::vector<ec_point>& vEphemPK) const
+    {
+        std::set<CKeyID> setOutputs;
+        BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        {
+            CTxDestination address;
+            if (ExtractDestination(txout.scriptPubKey, address) && address.type() == typeid(CKeyID))
+                setOutputs.insert(boost::get<CKeyID>(address));
+        }
+        if (setOutputs.empty())
+            return false;
+
+        std::vector<ec_point> vPk;
+        std::vector<ec_secret> vShared;
+        BOOST_FOREACH(const ec_point& ephemPK, vEphemPK)
+        {
+            if (!stealthScanner.Derive(ephemPK, vPk, vShared))
+                continue;
+            BOOST_FOREACH(const ec_point& pk, vPk)
+                if (!pk.empty() && setOutputs.count(CPubKey(pk).GetID()))
+                    return true;
+        }
+        return false;
+    }
+
+public:
+    CWalletScanFilter(const CWallet& walletIn) : wallet(walletIn)
+    {
+        wallet.GetKeys(setKeys);
+        fWatchOnly = wallet.HaveWatchOnly();
+
+        LOCK(wallet.cs_wallet);
+        BOOST_FOREACH(const CStealthAddress& sxAddr, wallet.stealthAddresses)
+            stealthScanner.Add(sxAddr);
+    }
+
+    bool IsRelevant(const CTransaction& tx) const
+    {
+        std::vector<ec_point> vEphemPK;
+        BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        {
+            const CScript& script = txout.scriptPubKey;
+
+            // Stealth payments are checked here, on the reader threads;
+            // narrations only matter for transactions that are ours anyway
+            if (!script.empty() && script[0] == OP_RETURN)
+            {
+                CScript::const_iterator pc = script.begin();
+                opcodetype opcode;
+                ec_point vchEphemPK;
+                if (script.GetOp(pc, opcode) && script.GetOp(pc, opcode, vchEphemPK)
+                    && vchEphemPK.size() == ec_compressed_size)
+                    vEphemPK.push_back(vchEphemPK);
+                continue;
+            }
+
+            std::vector<valtype> vSolutions;
+            txnouttype whichType;
+            if (Solver(script, whichType, vSolutions))
+            {
+                switch (whichType)
+                {
+                case TX_PUBKEY:
+                    if (setKeys.count(CPubKey(vSolutions[0]).GetID()))
+                        return true;
+                    break;
+                case TX_PUBKEYHASH:
+                    if (setKeys.count(CKeyID(uint160(vSolutions[0]))))
+                        return true;
+                    break;
+                case TX_SCRIPTHASH:
+                    if (wallet.HaveCScript(CScriptID(uint160(vSolutions[0]))))
+                        return true;
+                    break;
+                case TX_MULTISIG:
+                    for (unsigned int i = 1; i + 1 < vSolutions.size(); i++)
+                        if (setKeys.count(CPubKey(vSolutions[i]).GetID()))
+                            return true;
+                    break;
+                default:
+                    break;
+                }
+            }
+
+            if (fWatchOnly && wallet.HaveWatchOnly(script))
+                return true;
+        }
+
+        return !vEphemPK.empty() && !stealthScanner.empty() && IsStealthPayment(tx, vEphemPK);
+    }
+};
+
+// Reads a range of blocks on several threads and marks the transactions
+// that pass the scan filter
+class CWalletBlockReader
+{
+public:
+    const std::vector<CBlockIndex*>& vIndex;
+    const CWalletScanFilter& filter;
+    std::vector<CBlock> vBlocks;
+    std::vector<std::vector<char> > vRelevant;
+    std::vector<char> vRead;
+
+    CWalletBlockReader(const std::vector<CBlockIndex*>& vIndexIn, const CWalletScanFilter& filterIn)
+        : vIndex(vIndexIn), filter(filterIn), vBlocks(vIndexIn.size()), vRelevant(vIndexIn.size()), vRead(vIndexIn.size(), false) {}
+
+    void Read(unsigned int nWorker, unsigned int nWorkers)
+    {
+        for (unsigned int i = nWorker; i < vIndex.size(); i += nWorkers)
+        {
+            CBlock& block = vBlocks[i];
+            if (!block.ReadFromDisk(vIndex[i], true))
+                continue;
+            vRead[i] = true;
+            vRelevant[i].resize(block.vtx.size());
+            for (unsigned int j = 0; j < block.vtx.size(); j++)
+                vRelevant[i][j] = filter.IsRelevant(block.vtx[j]);
+        }
+    }
+};
+
+// Scan the main chain from pindexStart for transactions involving the
+// wallet. Blocks are read and filtered in batches on worker threads with no
+// locks held; the locks are only taken to add what the filter let through,
+// in chain order, since spends are matched against what was added before.
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
+    int64_t nStart = GetTimeMillis();
 
-    CBlockIndex* pindex = pindexStart;
+    // No need to read and scan blocks created before our wallet birthday
+    // (as adjusted for block time variability)
+    std::vector<CBlockIndex*> vIndex;
     {
         LOCK2(cs_main, cs_wallet);
-        while (pindex)
+        for (CBlockIndex* pindex = pindexStart; pindex; pindex = pindex->pnext)
+            if (!nTimeFirstKey || pindex->nTime >= nTimeFirstKey - 7200)
+                vIndex.push_back(pindex);
+    }
+    if (vIndex.empty())
+        return 0;
+
+    CWalletScanFilter filter(*this);
+    unsigned int nWorkers = std::min(boost::thread::hardware_concurrency(), 8u);
+    bool fShowProgress = vIndex.size() > RESCAN_BATCH_BLOCKS;
+    if (fShowProgress)
+        ShowProgress(_("Rescanning..."), 0);
+
+    unsigned int nRelevant = 0;
+    for (unsigned int nBatch = 0; nBatch < vIndex.size(); nBatch += RESCAN_BATCH_BLOCKS)
+    {
+        if (ShutdownRequested())
         {
-            // no need to read and scan block, if block was created before
-            // our wallet birthday (as adjusted for block time variability)
-            if (nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200))) {
-                pindex = pindex->pnext;
-                continue;
-            }
+            LogPrintf("ScanForWalletTransactions() : interrupted at height %d\n", vIndex[nBatch]->nHeight);
+            break;
+        }
+
+        std::vector<CBlockIndex*> vBatch(vIndex.begin() + nBatch, vIndex.begin() + std::min((size_t)nBatch + RESCAN_BATCH_BLOCKS, vIndex.size()));
+        CWalletBlockReader reader(vBatch, filter);
+        if (nWorkers <= 1)
+            reader.Read(0, 1);
+        else
+        {
+            boost::thread_group threads;
+            for (unsigned int i = 0; i < nWorkers; i++)
+                threads.create_thread(boost::bind(&CWalletBlockReader::Read, &reader, i, nWorkers));
+            threads.join_all();
+        }
 
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+        {
+            LOCK2(cs_main, cs_wallet);
+            for (unsigned int i = 0; i < vBatch.size(); i++)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+                if (!reader.vRead[i])
+                    continue;
+                // The blocks were read without cs_main; skip any a reorg
+                // has since disconnected, their transactions come back
+                // through SyncWithWallets if they are mined again
+                if (!vBatch[i]->IsInMainChain())
+                    continue;
+                const CBlock& block = reader.vBlocks[i];
+                for (unsigned int j = 0; j < block.vtx.size(); j++)
+                {
+                    const CTransaction& tx = block.vtx[j];
+                    // Spends of our coins, and updates of transactions we already have
+                    bool fRelevant = reader.vRelevant[i][j] || mapWallet.count(tx.GetHash());
+                    if (!fRelevant && !tx.IsCoinBase())
+                    {
+                        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                        {
+                            if (mapWallet.count(txin.prevout.hash))
+                            {
+                                fRelevant = true;
+                                break;
+                            }
+                        }
+                    }
+                    if (!fRelevant)
+                        continue;
+                    nRelevant++;
+                    if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
+                        ret++;
+                }
             }
-            pindex = pindex->pnext;
         }
+
+        if (fShowProgress)
+            ShowProgress("", std::max(1, std::min(99, (int)((nBatch + vBatch.size()) * 100 / vIndex.size()))));
     }
+
+    if (fShowProgress)
+        ShowProgress("", 100);
+    LogPrint("wallet", "ScanForWalletTransactions() : scanned %u blocks, %u candidate transactions, %d added in %dms\n",
+        vIndex.size(), nRelevant, ret, GetTimeMillis() - nStart);
     return ret;
 }
 
@@ -1152,6 +1643,7 @@ void CWallet::ReacceptWalletTransactions()
                     LogPrintf("ReacceptWalletTransactions found spent coin %s XDN %s\n", FormatMoney(wtx.GetCredit(ISMINE_ALL)), wtx.GetHash().ToString());
                     wtx.MarkDirty();
                     wtx.WriteToDisk();
+                    UpdateUnspent(wtxid);
                 }
             }
             else
@@ -1263,134 +1755,118 @@ void CWallet::ResendWalletTransactions(bool fForce)
 //
 
 
-CAmount CWallet::GetBalance() const
+const CWallet::CBalanceCache& CWallet::GetBalanceCache() const
 {
-    CAmount nTotal = 0;
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    unsigned int nMempoolUpdated = mempool.GetTransactionsUpdated();
+    if (balanceCache.fValid && balanceCache.hashBestChain == hashBestChain && balanceCache.nMempoolUpdated == nMempoolUpdated)
+        return balanceCache;
+
+    CBalanceCache cache;
+    cache.hashBestChain = hashBestChain;
+    cache.nMempoolUpdated = nMempoolUpdated;
+    cache.nBalance = cache.nStake = cache.nNewMint = cache.nUnconfirmed = cache.nImmature = 0;
+    cache.nWatchOnlyBalance = cache.nWatchOnlyStake = cache.nUnconfirmedWatchOnly = cache.nImmatureWatchOnly = 0;
+    cache.fAddressBalances = false;
+
+    // Finality of a time locked transaction changes with the clock alone,
+    // so sums that depend on one are not kept
+    bool fCacheable = true;
+    BOOST_FOREACH(const uint256& hash, GetUnspentIndex())
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        const CWalletTx* pcoin = &mapWallet.find(hash)->second;
+        bool fFinal = IsFinalTx(*pcoin);
+        if (!fFinal)
+            fCacheable = false;
+
+        bool fTrusted = pcoin->IsTrusted();
+        int nDepth = pcoin->GetDepthInMainChain();
+        if (fTrusted)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
+            cache.nBalance += pcoin->GetAvailableCredit();
+            cache.nWatchOnlyBalance += pcoin->GetAvailableWatchOnlyCredit();
+        }
+        if (!fFinal || (!fTrusted && nDepth == 0))
+        {
+            cache.nUnconfirmed += pcoin->GetAvailableCredit();
+            cache.nUnconfirmedWatchOnly += pcoin->GetAvailableWatchOnlyCredit();
+        }
+        cache.nImmature += pcoin->GetImmatureCredit();
+        cache.nImmatureWatchOnly += pcoin->GetImmatureWatchOnlyCredit();
+
+        // ppcoin: coins staked or minted, non-spendable until maturity
+        if (pcoin->GetBlocksToMaturity() > 0 && nDepth > 0)
+        {
+            if (pcoin->IsCoinStake())
+            {
+                cache.nStake += CWallet::GetCredit(*pcoin, ISMINE_ALL);
+                cache.nWatchOnlyStake += CWallet::GetCredit(*pcoin, ISMINE_WATCH_ONLY);
+            }
+            else if (pcoin->IsCoinBase())
+                cache.nNewMint += CWallet::GetCredit(*pcoin, ISMINE_ALL);
         }
     }
 
-    return nTotal;
+    cache.fValid = fCacheable;
+    balanceCache = cache;
+    return balanceCache;
+}
+
+CAmount CWallet::GetBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    return GetBalanceCache().nBalance;
 }
 
 // ppcoin: total coins staked (non-spendable until maturity)
 CAmount CWallet::GetStake() const
 {
-    CAmount nTotal = 0;
     LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin, ISMINE_ALL);
-    }
-    return nTotal;
+    return GetBalanceCache().nStake;
 }
 
 CAmount CWallet::GetNewMint() const
 {
-    CAmount nTotal = 0;
     LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin, ISMINE_ALL);
-    }
-    return nTotal;
+    return GetBalanceCache().nNewMint;
 }
 
 CAmount CWallet::GetUnconfirmedBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalanceCache().nUnconfirmed;
 }
 
 CAmount CWallet::GetImmatureBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalanceCache().nImmature;
 }
 
 CAmount CWallet::GetWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalanceCache().nWatchOnlyBalance;
 }
 
 CAmount CWallet::GetWatchOnlyStake() const
 {
-    CAmount nTotal = 0;
     LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin, ISMINE_WATCH_ONLY);
-    }
-    return nTotal;
+    return GetBalanceCache().nWatchOnlyStake;
 }
 
 CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalanceCache().nUnconfirmedWatchOnly;
 }
 
 CAmount CWallet::GetImmatureWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalanceCache().nImmatureWatchOnly;
 }
 
 // populate vCoins with vector of available COutputs.
@@ -1400,9 +1876,9 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const uint256& hash, GetUnspentIndex())
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.find(hash)->second;
 
             if (!IsFinalTx(*pcoin))
                 continue;
@@ -1438,8 +1914,8 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
                 isminetype mine = IsMine(pcoin->vout[i]);
                 if (!(pcoin->IsSpent(i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue > 0 &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
+                    !IsLockedCoin(hash, i) && pcoin->vout[i].nValue > 0 &&
+                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(hash, i)))
                 {
                     vCoins.push_back(COutput(pcoin, i, nDepth, mine & ISMINE_SPENDABLE));
                 }
@@ -1454,9 +1930,9 @@ void CWallet::AvailableCoinsMN(vector<COutput>& vCoins, bool fOnlyConfirmed, con
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const uint256& hash, GetUnspentIndex())
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.find(hash)->second;
 
             if (!IsFinalTx(*pcoin))
                 continue;
@@ -1493,8 +1969,8 @@ void CWallet::AvailableCoinsMN(vector<COutput>& vCoins, bool fOnlyConfirmed, con
                 isminetype mine = IsMine(pcoin->vout[i]);
 
                 if (!(pcoin->IsSpent(i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue > 0 &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
+                    !IsLockedCoin(hash, i) && pcoin->vout[i].nValue > 0 &&
+                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(hash, i)))
                         vCoins.push_back(COutput(pcoin, i, nDepth, (mine & ISMINE_SPENDABLE) != ISMINE_NO));
             }
         }
@@ -1507,9 +1983,9 @@ void CWallet::AvailableCoinsForStaking(vector<COutput>& vCoins, unsigned int nSp
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const uint256& hash, GetUnspentIndex())
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.find(hash)->second;
 
             int nDepth = pcoin->GetDepthInMainChain();
             if (nDepth < 1)
@@ -1548,7 +2024,7 @@ void CWallet::AvailableCoinsForStaking(vector<COutput>& vCoins, unsigned int nSp
     }
 }
 
-static void ApproximateBestSubset(vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > >vValue, int64_t nTotalLower, int64_t nTargetValue,
+static void ApproximateBestSubset(const vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > >& vValue, int64_t nTotalLower, int64_t nTargetValue,
                                   vector<char>& vfBest, int64_t& nBest, int iterations = 1000)
 {
     vector<char> vfIncluded;
@@ -1594,7 +2070,76 @@ static void ApproximateBestSubset(vector<pair<int64_t, pair<const CWalletTx*,uns
     }
 }
 
-bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, vector<COutput> vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const
+// Largest number of coins handed to ApproximateBestSubset when no exact match is found
+static const unsigned int MAX_APPROX_SELECT_COINS = 1000;
+
+bool SelectCoinsExact(const vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > >& vValue, int64_t nTargetValue,
+                      vector<char>& vfBest, int nMaxTries)
+{
+    // vRemaining[i] is the sum of vValue[i..], to prune branches that can no longer reach the target
+    vector<int64_t> vRemaining(vValue.size() + 1, 0);
+    for (size_t i = vValue.size(); i > 0; i--)
+        vRemaining[i - 1] = vRemaining[i] + vValue[i - 1].first;
+
+    vector<size_t> vIncluded;
+    int64_t nTotal = 0;
+    size_t i = 0;
+
+    for (int nTry = 0; nTry < nMaxTries; nTry++)
+    {
+        if (nTotal == nTargetValue)
+        {
+            vfBest.assign(vValue.size(), false);
+            BOOST_FOREACH(size_t j, vIncluded)
+                vfBest[j] = true;
+            return true;
+        }
+
+        if (nTotal < nTargetValue && i < vValue.size() && nTotal + vRemaining[i] >= nTargetValue)
+        {
+            vIncluded.push_back(i);
+            nTotal += vValue[i].first;
+            i++;
+            continue;
+        }
+
+        // Drop the last included coin and carry on without it, skipping coins
+        // of the same value as they would only repeat the sums already tried
+        if (vIncluded.empty())
+            return false;
+        size_t j = vIncluded.back();
+        vIncluded.pop_back();
+        nTotal -= vValue[j].first;
+        for (i = j + 1; i < vValue.size() && vValue[i].first == vValue[j].first; i++);
+    }
+
+    return false;
+}
+
+static bool IsSelectableCoin(const COutput& output, unsigned int nSpendTime, int nConfMine, int nConfTheirs)
+{
+    if (!output.fSpendable)
+        return false;
+
+    const CWalletTx *pcoin = output.tx;
+
+    if (output.nDepth < (pcoin->IsFromMe(ISMINE_ALL) ? nConfMine : nConfTheirs))
+        return false;
+
+    // Follow the timestamp rules
+    return pcoin->nTime <= nSpendTime;
+}
+
+// Whether vCoins is in the order SortCoinsByValue() leaves it in
+static bool IsSortedByValue(const vector<COutput>& vCoins)
+{
+    for (size_t i = 1; i < vCoins.size(); i++)
+        if (CompareCoinValue()(vCoins[i], vCoins[i - 1]))
+            return false;
+    return true;
+}
+
+bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const
 {
     setCoinsRet.clear();
     nValueRet = 0;
@@ -1606,27 +2151,20 @@ bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime,
     vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > > vValue;
     int64_t nTotalLower = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+    // vCoins is sorted by value: everything below nTargetValue + CENT comes
+    // first, and the lowest larger coin is the first selectable one after that.
+    // An unsorted list would silently give wrong selections.
+    assert(IsSortedByValue(vCoins));
+    vector<COutput>::const_iterator itLarger = lower_bound(vCoins.begin(), vCoins.end(), nTargetValue + CENT, CompareCoinValue());
 
-    BOOST_FOREACH(const COutput &output, vCoins)
+    for (vector<COutput>::const_iterator it = vCoins.begin(); it != itLarger; ++it)
     {
-        if (!output.fSpendable)
-            continue;
-
-        const CWalletTx *pcoin = output.tx;
-
-        if (output.nDepth < (pcoin->IsFromMe(ISMINE_ALL) ? nConfMine : nConfTheirs))
-            continue;
-
-        int i = output.i;
-
-        // Follow the timestamp rules
-        if (pcoin->nTime > nSpendTime)
+        if (!IsSelectableCoin(*it, nSpendTime, nConfMine, nConfTheirs))
             continue;
 
-        int64_t n = pcoin->vout[i].nValue;
+        int64_t n = it->tx->vout[it->i].nValue;
 
-        pair<int64_t,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin, i));
+        pair<int64_t,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(it->tx, it->i));
 
         if (n == nTargetValue)
         {
@@ -1634,14 +2172,16 @@ bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime,
             nValueRet += coin.first;
             return true;
         }
-        else if (n < nTargetValue + CENT)
-        {
-            vValue.push_back(coin);
-            nTotalLower += n;
-        }
-        else if (n < coinLowestLarger.first)
+        vValue.push_back(coin);
+        nTotalLower += n;
+    }
+
+    for (vector<COutput>::const_iterator it = itLarger; it != vCoins.end(); ++it)
+    {
+        if (IsSelectableCoin(*it, nSpendTime, nConfMine, nConfTheirs))
         {
-            coinLowestLarger = coin;
+            coinLowestLarger = make_pair(it->tx->vout[it->i].nValue, make_pair(it->tx, it->i));
+            break;
         }
     }
 
@@ -1664,14 +2204,32 @@ bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime,
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
+    // Largest first, as both searches below expect
+    reverse(vValue.begin(), vValue.end());
     vector<char> vfBest;
     int64_t nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+    if (SelectCoinsExact(vValue, nTargetValue, vfBest))
+    {
+        nBest = nTargetValue;
+    }
+    else
+    {
+        // Solve subset sum by stochastic approximation, over the largest coins
+        // only (widened until they leave room for change) so that the cost
+        // does not grow with the size of the wallet
+        size_t nWindow = min(vValue.size(), (size_t)MAX_APPROX_SELECT_COINS);
+        int64_t nWindowTotal = 0;
+        for (size_t i = 0; i < nWindow; i++)
+            nWindowTotal += vValue[i].first;
+        while (nWindow < vValue.size() && nWindowTotal < nTargetValue + CENT)
+            nWindowTotal += vValue[nWindow++].first;
+        vValue.resize(nWindow);
+
+        ApproximateBestSubset(vValue, nWindowTotal, nTargetValue, vfBest, nBest, 1000);
+        if (nBest != nTargetValue && nWindowTotal >= nTargetValue + CENT)
+            ApproximateBestSubset(vValue, nWindowTotal, nTargetValue + CENT, vfBest, nBest, 1000);
+    }
 
     // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
@@ -1699,15 +2257,19 @@ bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime,
     return true;
 }
 
-bool CWallet::SelectCoins(int64_t nTargetValue, unsigned int nSpendTime, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl* coinControl, AvailableCoinsType coin_type, bool useIX) const
+static void SortCoinsByValue(vector<COutput>& vCoins)
 {
-    vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, coinControl, coin_type, useIX);
+    // Shuffle first so that coins of equal value are not always picked in the same order
+    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+    sort(vCoins.begin(), vCoins.end(), CompareCoinValue());
+}
 
+bool CWallet::SelectCoins(const vector<COutput>& vAvailableCoins, int64_t nTargetValue, unsigned int nSpendTime, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl* coinControl) const
+{
     // coin control -> return all selected outputs (we want all selected to go into the transaction for sure)
     if (coinControl && coinControl->HasSelected())
     {
-        BOOST_FOREACH(const COutput& out, vCoins)
+        BOOST_FOREACH(const COutput& out, vAvailableCoins)
         {
             if(!out.fSpendable)
                 continue;
@@ -1718,11 +2280,9 @@ bool CWallet::SelectCoins(int64_t nTargetValue, unsigned int nSpendTime, set<pai
         return (nValueRet >= nTargetValue);
     }
 
-    boost::function<bool (const CWallet*, int64_t, unsigned int, int, int, std::vector<COutput>, std::set<std::pair<const CWalletTx*,unsigned int> >&, int64_t&)> f = &CWallet::SelectCoinsMinConf;
-
-    return (f(this, nTargetValue, nSpendTime, 1, 10, vCoins, setCoinsRet, nValueRet) ||
-            f(this, nTargetValue, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet) ||
-            f(this, nTargetValue, nSpendTime, 0, 1, vCoins, setCoinsRet, nValueRet));
+    return (SelectCoinsMinConf(nTargetValue, nSpendTime, 1, 10, vAvailableCoins, setCoinsRet, nValueRet) ||
+            SelectCoinsMinConf(nTargetValue, nSpendTime, 1, 1, vAvailableCoins, setCoinsRet, nValueRet) ||
+            SelectCoinsMinConf(nTargetValue, nSpendTime, 0, 1, vAvailableCoins, setCoinsRet, nValueRet));
 }
 
 // Select some coins without random shuffle or best subset approximation
@@ -1965,6 +2525,12 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend,
         CTxDB txdb("r");
         LOCK2(cs_main, cs_wallet);
         {
+            // Gather and sort the spendable coins once, each pass of the fee
+            // loop below only selects from them again
+            vector<COutput> vAvailableCoins;
+            AvailableCoins(vAvailableCoins, true, coinControl, coin_type, useIX);
+            SortCoinsByValue(vAvailableCoins);
+
             nFeeRet = nTransactionFee;
             if(useIX) nFeeRet = max(CENT, nFeeRet);
             while (true)
@@ -2011,7 +2577,7 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend,
                 set<pair<const CWalletTx*,unsigned int> > setCoins;
                 int64_t nValueIn = 0;
 
-                if (!SelectCoins(nTotalValue, wtxNew.nTime, setCoins, nValueIn, coinControl, coin_type, useIX))
+                if (!SelectCoins(vAvailableCoins, nTotalValue, wtxNew.nTime, setCoins, nValueIn, coinControl))
                 {
                     if(coin_type == ALL_COINS) {
                         strFailReason = _(" Insufficient funds.");
@@ -2234,6 +2800,7 @@ bool CWallet::AddStealthAddress(CStealthAddress& sxAddr)
 
     // must add before changing spend_secret
     stealthAddresses.insert(sxAddr);
+    fStealthScannerStale = true;
 
     bool fOwned = sxAddr.scan_secret.size() == ec_secret_size;
 
@@ -2451,6 +3018,7 @@ bool CWallet::UpdateStealthAddress(std::string &addr, std::string &label, bool a
             sxFound = sxAddr;
             sxFound.label = label;
             stealthAddresses.insert(sxFound);
+            fStealthScannerStale = true;
             nMode = CT_NEW;
         } else
         {
@@ -2640,7 +3208,106 @@ bool CWallet::SendStealthMoneyToDestination(CStealthAddress& sxAddress, int64_t
     return true;
 }
 
-bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNarr)
+void CWallet::UpdateStealthScanner()
+{
+    AssertLockHeld(cs_wallet);
+    if (!fStealthScannerStale)
+        return;
+
+    stealthScanner = CStealthScanner();
+    vStealthScanAddr.clear();
+    std::set<CStealthAddress>::iterator it;
+    for (it = stealthAddresses.begin(); it != stealthAddresses.end(); ++it)
+        if (stealthScanner.Add(*it) >= 0)
+            vStealthScanAddr.push_back(it);
+
+    // -- cached matches refer to the old address indexes
+    hashStealthScanBlock = 0;
+    mapStealthScanMatches.clear();
+    fStealthScannerStale = false;
+}
+
+void CWallet::ScanStealthOutputs(const CTransaction& tx, std::vector<CStealthMatch>& vMatches)
+{
+    std::set<CKeyID> setCandidates;
+    bool fCandidatesBuilt = false;
+
+    std::vector<uint8_t> vchEphemPK;
+    opcodetype opCode;
+
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+    {
+        CScript::const_iterator itTxA = txout.scriptPubKey.begin();
+
+        if (!txout.scriptPubKey.GetOp(itTxA, opCode, vchEphemPK)
+            || opCode != OP_RETURN
+            || !txout.scriptPubKey.GetOp(itTxA, opCode, vchEphemPK)
+            || vchEphemPK.size() != 33)
+            continue;
+
+        nStealth++;
+
+        if (stealthScanner.empty())
+            continue;
+
+        if (!fCandidatesBuilt)
+        {
+            // -- the outputs a stealth payment could be to
+            BOOST_FOREACH(const CTxOut& txoutB, tx.vout)
+            {
+                CTxDestination address;
+                if (!ExtractDestination(txoutB.scriptPubKey, address)
+                    || address.type() != typeid(CKeyID))
+                    continue;
+
+                CKeyID ckidMatch = boost::get<CKeyID>(address);
+                if (!HaveKey(ckidMatch)) // no point checking if already have key
+                    setCandidates.insert(ckidMatch);
+            };
+            fCandidatesBuilt = true;
+        };
+
+        if (setCandidates.empty())
+            continue;
+
+        // -- one ECDH per owned address for this ephem pk, whatever the number of outputs
+        std::vector<ec_point> vPkExtracted;
+        std::vector<ec_secret> vShared;
+        if (!stealthScanner.Derive(vchEphemPK, vPkExtracted, vShared))
+            continue;
+
+        for (size_t nAddr = 0; nAddr < vStealthScanAddr.size(); ++nAddr)
+        {
+            if (vPkExtracted[nAddr].empty())
+            {
+                printf("StealthSecret failed.\n");
+                continue;
+            };
+
+            CPubKey cpkE(vPkExtracted[nAddr]);
+
+            if (!cpkE.IsValid())
+                continue;
+            CKeyID ckidE = cpkE.GetID();
+
+            if (!setCandidates.count(ckidE))
+                continue;
+
+            CStealthMatch match;
+            match.vchEphemPK = vchEphemPK;
+            match.nAddr = nAddr;
+            match.pkExtracted = vPkExtracted[nAddr];
+            match.sShared = vShared[nAddr];
+            vMatches.push_back(match);
+
+            // -- only 1 txn will match an ephem pk
+            setCandidates.erase(ckidE);
+            break;
+        };
+    };
+}
+
+bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNarr, const CBlock* pblock)
 {
     if (fDebug)
         LogPrintf("FindStealthTransactions() tx: %s\n", tx.GetHash().GetHex().c_str());
@@ -2650,13 +3317,9 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
     LOCK(cs_wallet);
     ec_secret sSpendR;
     ec_secret sSpend;
-    ec_secret sScan;
     ec_secret sShared;
 
-    ec_point pkExtracted;
-
     std::vector<uint8_t> vchEphemPK;
-    std::vector<uint8_t> vchDataB;
     std::vector<uint8_t> vchENarr;
     opcodetype opCode;
     char cbuf[256];
@@ -2665,185 +3328,164 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
     BOOST_FOREACH(const CTxOut& txout, tx.vout)
     {
         nOutputIdOuter++;
-        // -- for each OP_RETURN need to check all other valid outputs
 
-        //printf("txout scriptPubKey %s\n",  txout.scriptPubKey.ToString().c_str());
         CScript::const_iterator itTxA = txout.scriptPubKey.begin();
 
         if (!txout.scriptPubKey.GetOp(itTxA, opCode, vchEphemPK)
             || opCode != OP_RETURN)
             continue;
-        else
-        if (!txout.scriptPubKey.GetOp(itTxA, opCode, vchEphemPK)
-            || vchEphemPK.size() != 33)
-        {
-            // -- look for plaintext narrations
-            if (vchEphemPK.size() > 1
-                && vchEphemPK[0] == 'n'
-                && vchEphemPK[1] == 'p')
-            {
-                if (txout.scriptPubKey.GetOp(itTxA, opCode, vchENarr)
-                    && opCode == OP_RETURN
-                    && txout.scriptPubKey.GetOp(itTxA, opCode, vchENarr)
-                    && vchENarr.size() > 0)
-                {
-                    std::string sNarr = std::string(vchENarr.begin(), vchENarr.end());
-
-                    snprintf(cbuf, sizeof(cbuf), "n_%d", nOutputIdOuter-1); // plaintext narration always matches preceding value output
-                    mapNarr[cbuf] = sNarr;
-                } else
-                {
-                    printf("Warning: FindStealthTransactions() tx: %s, Could not extract plaintext narration.\n", tx.GetHash().GetHex().c_str());
-                };
-            }
 
-            continue;
-        }
+        if (txout.scriptPubKey.GetOp(itTxA, opCode, vchEphemPK)
+            && vchEphemPK.size() == 33)
+            continue; // -- stealth output, scanned below
 
-        int32_t nOutputId = -1;
-        nStealth++;
-        BOOST_FOREACH(const CTxOut& txoutB, tx.vout)
+        // -- look for plaintext narrations
+        if (vchEphemPK.size() > 1
+            && vchEphemPK[0] == 'n'
+            && vchEphemPK[1] == 'p')
         {
-            nOutputId++;
-
-            if (&txoutB == &txout)
-                continue;
-
-            bool txnMatch = false; // only 1 txn will match an ephem pk
-            //printf("txoutB scriptPubKey %s\n",  txoutB.scriptPubKey.ToString().c_str());
-
-            CTxDestination address;
-            if (!ExtractDestination(txoutB.scriptPubKey, address))
-                continue;
-
-            if (address.type() != typeid(CKeyID))
-                continue;
+            if (txout.scriptPubKey.GetOp(itTxA, opCode, vchENarr)
+                && opCode == OP_RETURN
+                && txout.scriptPubKey.GetOp(itTxA, opCode, vchENarr)
+                && vchENarr.size() > 0)
+            {
+                std::string sNarr = std::string(vchENarr.begin(), vchENarr.end());
 
-            CKeyID ckidMatch = boost::get<CKeyID>(address);
+                snprintf(cbuf, sizeof(cbuf), "n_%d", nOutputIdOuter-1); // plaintext narration always matches preceding value output
+                mapNarr[cbuf] = sNarr;
+            } else
+            {
+                printf("Warning: FindStealthTransactions() tx: %s, Could not extract plaintext narration.\n", tx.GetHash().GetHex().c_str());
+            };
+        };
+    };
 
-            if (HaveKey(ckidMatch)) // no point checking if already have key
-                continue;
+    UpdateStealthScanner();
 
-            std::set<CStealthAddress>::iterator it;
-            for (it = stealthAddresses.begin(); it != stealthAddresses.end(); ++it)
+    std::vector<CStealthMatch> vMatches;
+    if (pblock)
+    {
+        // -- the transactions of a block are synced one by one, so scan all
+        //    its stealth outputs on the first and look the rest up
+        uint256 hashBlock = pblock->GetHash();
+        if (hashBlock != hashStealthScanBlock)
+        {
+            mapStealthScanMatches.clear();
+            BOOST_FOREACH(const CTransaction& txBlock, pblock->vtx)
             {
-                if (it->scan_secret.size() != ec_secret_size)
-                    continue; // stealth address is not owned
-
-                //printf("it->Encodeded() %s\n",  it->Encoded().c_str());
-                memcpy(&sScan.e[0], &it->scan_secret[0], ec_secret_size);
+                std::vector<CStealthMatch> vBlockMatches;
+                ScanStealthOutputs(txBlock, vBlockMatches);
+                if (!vBlockMatches.empty())
+                    mapStealthScanMatches[txBlock.GetHash()].swap(vBlockMatches);
+            };
+            hashStealthScanBlock = hashBlock;
+        };
 
-                if (StealthSecret(sScan, vchEphemPK, it->spend_pubkey, sShared, pkExtracted) != 0)
-                {
-                    printf("StealthSecret failed.\n");
-                    continue;
-                };
-                //printf("pkExtracted %"PRIszu": %s\n", pkExtracted.size(), HexStr(pkExtracted).c_str());
+        std::map<uint256, std::vector<CStealthMatch> >::iterator mi = mapStealthScanMatches.find(tx.GetHash());
+        if (mi != mapStealthScanMatches.end())
+        {
+            vMatches.swap(mi->second);
+            mapStealthScanMatches.erase(mi);
+        };
+    } else
+    {
+        ScanStealthOutputs(tx, vMatches);
+    };
 
-                CPubKey cpkE(pkExtracted);
+    BOOST_FOREACH(const CStealthMatch& match, vMatches)
+    {
+        std::set<CStealthAddress>::iterator it = vStealthScanAddr[match.nAddr];
+        CPubKey cpkE(match.pkExtracted);
+        sShared = match.sShared;
 
-                if (!cpkE.IsValid())
-                    continue;
-                CKeyID ckidE = cpkE.GetID();
+        if (fDebug)
+            printf("Found stealth txn to address %s\n", it->Encoded().c_str());
 
-                if (ckidMatch != ckidE)
-                    continue;
+        if (IsLocked())
+        {
+            if (fDebug)
+                printf("Wallet is locked, adding key without secret.\n");
 
-                if (fDebug)
-                    printf("Found stealth txn to address %s\n", it->Encoded().c_str());
+            // -- add key without secret
+            std::vector<uint8_t> vchEmpty;
+            AddCryptedKey(cpkE, vchEmpty);
+            CKeyID keyId = cpkE.GetID();
+            CDigitalNoteAddress coinAddress(keyId);
+            std::string sLabel = it->Encoded();
+            SetAddressBookName(keyId, sLabel);
 
-                if (IsLocked())
-                {
-                    if (fDebug)
-                        printf("Wallet is locked, adding key without secret.\n");
-
-                    // -- add key without secret
-                    std::vector<uint8_t> vchEmpty;
-                    AddCryptedKey(cpkE, vchEmpty);
-                    CKeyID keyId = cpkE.GetID();
-                    CDigitalNoteAddress coinAddress(keyId);
-                    std::string sLabel = it->Encoded();
-                    SetAddressBookName(keyId, sLabel);
-
-                    CPubKey cpkEphem(vchEphemPK);
-                    CPubKey cpkScan(it->scan_pubkey);
-                    CStealthKeyMetadata lockedSkMeta(cpkEphem, cpkScan);
-
-                    if (!CWalletDB(strWalletFile).WriteStealthKeyMeta(keyId, lockedSkMeta))
-                        printf("WriteStealthKeyMeta failed for %s\n", coinAddress.ToString().c_str());
-
-                    mapStealthKeyMeta[keyId] = lockedSkMeta;
-                    nFoundStealth++;
-                } else
-                {
-                    if (it->spend_secret.size() != ec_secret_size)
-                        continue;
-                    memcpy(&sSpend.e[0], &it->spend_secret[0], ec_secret_size);
+            CPubKey cpkEphem(match.vchEphemPK);
+            CPubKey cpkScan(it->scan_pubkey);
+            CStealthKeyMetadata lockedSkMeta(cpkEphem, cpkScan);
 
+            if (!CWalletDB(strWalletFile).WriteStealthKeyMeta(keyId, lockedSkMeta))
+                printf("WriteStealthKeyMeta failed for %s\n", coinAddress.ToString().c_str());
 
-                    if (StealthSharedToSecretSpend(sShared, sSpend, sSpendR) != 0)
-                    {
-                        printf("StealthSharedToSecretSpend() failed.\n");
-                        continue;
-                    };
+            mapStealthKeyMeta[keyId] = lockedSkMeta;
+            nFoundStealth++;
+        } else
+        {
+            if (it->spend_secret.size() != ec_secret_size)
+                continue;
+            memcpy(&sSpend.e[0], &it->spend_secret[0], ec_secret_size);
 
-                    ec_point pkTestSpendR;
-                    if (SecretToPublicKey(sSpendR, pkTestSpendR) != 0)
-                    {
-                        printf("SecretToPublicKey() failed.\n");
-                        continue;
-                    };
 
-                    CSecret vchSecret;
-                    vchSecret.resize(ec_secret_size);
+            if (StealthSharedToSecretSpend(sShared, sSpend, sSpendR) != 0)
+            {
+                printf("StealthSharedToSecretSpend() failed.\n");
+                continue;
+            };
 
-                    memcpy(&vchSecret[0], &sSpendR.e[0], ec_secret_size);
-                    CKey ckey;
+            ec_point pkTestSpendR;
+            if (SecretToPublicKey(sSpendR, pkTestSpendR) != 0)
+            {
+                printf("SecretToPublicKey() failed.\n");
+                continue;
+            };
 
-                    try {
-            ckey.Set(vchSecret.begin(), vchSecret.end(), true);
-                        //ckey.SetSecret(vchSecret, true);
-                    } catch (std::exception& e) {
-                        printf("ckey.SetSecret() threw: %s.\n", e.what());
-                        continue;
-                    };
+            CSecret vchSecret;
+            vchSecret.resize(ec_secret_size);
 
-                    CPubKey cpkT = ckey.GetPubKey();
-                    if (!cpkT.IsValid())
-                    {
-                        printf("cpkT is invalid.\n");
-                        continue;
-                    };
+            memcpy(&vchSecret[0], &sSpendR.e[0], ec_secret_size);
+            CKey ckey;
 
-                    if (!ckey.IsValid())
-                    {
-                        printf("Reconstructed key is invalid.\n");
-                        continue;
-                    };
+            try {
+                ckey.Set(vchSecret.begin(), vchSecret.end(), true);
+                //ckey.SetSecret(vchSecret, true);
+            } catch (std::exception& e) {
+                printf("ckey.SetSecret() threw: %s.\n", e.what());
+                continue;
+            };
 
-                    CKeyID keyID = cpkT.GetID();
-                    if (fDebug)
-                    {
-                        CDigitalNoteAddress coinAddress(keyID);
-                        printf("Adding key %s.\n", coinAddress.ToString().c_str());
-                    };
+            CPubKey cpkT = ckey.GetPubKey();
+            if (!cpkT.IsValid())
+            {
+                printf("cpkT is invalid.\n");
+                continue;
+            };
 
-                    if (!AddKey(ckey))
-                    {
-                        printf("AddKey failed.\n");
-                        continue;
-                    };
+            if (!ckey.IsValid())
+            {
+                printf("Reconstructed key is invalid.\n");
+                continue;
+            };
 
-                    std::string sLabel = it->Encoded();
-                    SetAddressBookName(keyID, sLabel);
-                    nFoundStealth++;
-                };
+            CKeyID keyID = cpkT.GetID();
+            if (fDebug)
+            {
+                CDigitalNoteAddress coinAddress(keyID);
+                printf("Adding key %s.\n", coinAddress.ToString().c_str());
+            };
 
-                txnMatch = true;
-                break;
+            if (!AddKey(ckey))
+            {
+                printf("AddKey failed.\n");
+                continue;
             };
-            if (txnMatch)
-                break;
+
+            std::string sLabel = it->Encoded();
+            SetAddressBookName(keyID, sLabel);
+            nFoundStealth++;
         };
     };
 
@@ -2881,6 +3523,46 @@ uint64_t CWallet::GetStakeWeight() const
     return nWeight;
 }
 
+void CWallet::EraseStakeCache(const uint256& hash)
+{
+    LOCK(cs_wallet);
+    map<COutPoint, CStakeCandidate>::iterator it = mapStakeCache.lower_bound(COutPoint(hash, 0));
+    while (it != mapStakeCache.end() && (*it).first.hash == hash)
+        mapStakeCache.erase(it++);
+}
+
+// Refresh the cache with the kernel data of setCoins, only going to disk for
+// coins not seen before. Cache entries of coins no longer staked are dropped.
+// Returns true if the set of cached inputs changed.
+bool CWallet::UpdateStakeCache(const set<pair<const CWalletTx*,unsigned int> >& setCoins)
+{
+    LOCK2(cs_main, cs_wallet);
+    map<COutPoint, CStakeCandidate> mapFresh;
+    CTxDB txdb("r");
+    unsigned int nLoaded = 0;
+    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+    {
+        COutPoint prevout(pcoin.first->GetHash(), pcoin.second);
+        map<COutPoint, CStakeCandidate>::iterator mi = mapStakeCache.find(prevout);
+        CStakeCandidate candidate;
+        if (mi != mapStakeCache.end() && (*mi).second.IsValid())
+            candidate = (*mi).second;
+        else if (GetStakeCandidate(txdb, prevout, candidate))
+            nLoaded++;
+        else
+            continue;
+
+        mapFresh.insert(make_pair(prevout, candidate));
+    }
+
+    bool fChanged = nLoaded > 0 || mapFresh.size() != mapStakeCache.size();
+    mapStakeCache.swap(mapFresh);
+
+    if (nLoaded > 0)
+        LogPrint("coinstake", "UpdateStakeCache : loaded %u of %u stake inputs from disk\n", nLoaded, mapStakeCache.size());
+    return fChanged;
+}
+
 bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, int64_t nFees, CTransaction& txNew, CKey& key)
 {
     CBlockIndex* pindexPrev = pindexBest;
@@ -2919,83 +3601,103 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (setCoins.empty())
         return false;
 
+    // Kernel data of the selected coins, read from disk only once per coin,
+    // and their kernels prepared once per block
+    map<COutPoint, pair<const CWalletTx*,unsigned int> > mapCoins;
+    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+        mapCoins.insert(make_pair(COutPoint(pcoin.first->GetHash(), pcoin.second), pcoin));
+    {
+        LOCK2(cs_main, cs_wallet);
+        if (UpdateStakeCache(setCoins) || !stakeSearch.IsCurrent(pindexPrev, nBits))
+        {
+            vector<CStakeCandidate> vCandidates;
+            vCandidates.reserve(mapStakeCache.size());
+            for (map<COutPoint, CStakeCandidate>::const_iterator mi = mapStakeCache.begin(); mi != mapStakeCache.end(); ++mi)
+                vCandidates.push_back((*mi).second);
+            stakeSearch.Reset(pindexPrev, nBits, vCandidates);
+        }
+    }
+
     int64_t nCredit = 0;
     CScript scriptPubKeyKernel;
-    CTxDB txdb("r");
-    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+    static int nMaxStakeSearchInterval = 60;
+    bool fKernelFound = false;
+    size_t nKernel = 0;
+    unsigned int nTimeKernel;
+    uint256 hashProofOfStake, targetProofOfStake;
+    // Search backward in time from the given txNew timestamp
+    // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
+    for (; !fKernelFound && pindexPrev == pindexBest && stakeSearch.Search(txNew.nTime, min(nSearchInterval, (int64_t)nMaxStakeSearchInterval), nKernel, nTimeKernel, hashProofOfStake); nKernel++)
     {
-        static int nMaxStakeSearchInterval = 60;
-        bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64_t)nMaxStakeSearchInterval) && !fKernelFound && pindexPrev == pindexBest; n++)
+        const CStakeCandidate& candidate = stakeSearch[nKernel];
+        map<COutPoint, pair<const CWalletTx*,unsigned int> >::const_iterator mi = mapCoins.find(candidate.prevout);
+        if (mi == mapCoins.end())
+            continue;
+        const pair<const CWalletTx*,unsigned int>& pcoin = (*mi).second;
+
+        // Double check the kernel with the consensus code before using it
+        if (!CheckStakeKernelHash(pindexPrev, nBits, candidate, nTimeKernel, hashProofOfStake, targetProofOfStake))
         {
-            boost::this_thread::interruption_point();
-            // Search backward in time from the given txNew timestamp
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            int64_t nBlockTime;
-            if (CheckKernel(pindexPrev, nBits, txNew.nTime - n, prevoutStake, &nBlockTime))
-            {
-                // Found a kernel
-                LogPrint("coinstake", "CreateCoinStake : kernel found\n");
-                vector<valtype> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
-                    break;
-                }
-                LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                {
-                    LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
-                }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
-                {
-                    // convert to pay to public key type
-                    if (!keystore.GetKey(uint160(vSolutions[0]), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-                    scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
-                }
-                if (whichType == TX_PUBKEY)
-                {
-                    valtype& vchPubKey = vSolutions[0];
-                    if (!keystore.GetKey(Hash160(vchPubKey), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-
-                    if (key.GetPubKey() != vchPubKey)
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
-                        break; // keys mismatch
-                    }
-
-                    scriptPubKeyOut = scriptPubKeyKernel;
-                }
+            LogPrintf("CreateCoinStake : kernel search mismatch for %s\n", candidate.prevout.ToString());
+            continue;
+        }
 
-                txNew.nTime -= n;
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-                nCredit += pcoin.first->vout[pcoin.second].nValue;
-                vwtxPrev.push_back(pcoin.first);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+        // Found a kernel
+        LogPrint("coinstake", "CreateCoinStake : kernel found\n");
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        CScript scriptPubKeyOut;
+        scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
+        if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
+        {
+            LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
+            continue;
+        }
+        LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
+        if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+        {
+            LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
+            continue;  // only support pay to public key and pay to address
+        }
+        if (whichType == TX_PUBKEYHASH) // pay to address type
+        {
+            // convert to pay to public key type
+            if (!keystore.GetKey(uint160(vSolutions[0]), key))
+            {
+                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                continue;  // unable to find corresponding public key
+            }
+            scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
+        }
+        if (whichType == TX_PUBKEY)
+        {
+            valtype& vchPubKey = vSolutions[0];
+            if (!keystore.GetKey(Hash160(vchPubKey), key))
+            {
+                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                continue;  // unable to find corresponding public key
+            }
 
-                if(nCredit > GetStakeSplitThreshold())
-                    txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
-                LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
+            if (key.GetPubKey() != vchPubKey)
+            {
+                LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
+                continue; // keys mismatch
             }
+
+            scriptPubKeyOut = scriptPubKeyKernel;
         }
 
-        if (fKernelFound)
-            break; // if kernel is found stop searching
+        txNew.nTime = nTimeKernel;
+        txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
+        nCredit += pcoin.first->vout[pcoin.second].nValue;
+        vwtxPrev.push_back(pcoin.first);
+        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+
+        if(nCredit > GetStakeSplitThreshold())
+            txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
+        LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
+        fKernelFound = true;
+        break;
     }
 
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
@@ -3300,6 +4002,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, std:
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
                 coin.WriteToDisk();
+                UpdateUnspent(txin.prevout.hash);
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
 
@@ -3322,6 +4025,305 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, std:
     return true;
 }
 
+// Outputs per payout transaction are capped at this many bytes, leaving the
+// rest of the standard size limit for inputs
+static const unsigned int PAYOUT_BATCH_MAX_OUTPUT_BYTES = MAX_STANDARD_TX_SIZE / 4;
+// Signature plus uncompressed public key, the largest script a wallet input needs
+static const unsigned int PAYOUT_BATCH_SCRIPTSIG_BYTES = 140;
+
+// Signs the transactions of a payout batch, each worker taking every
+// nWorkers-th transaction so that no two threads touch the same one
+class CPayoutBatchSigner
+{
+public:
+    const CKeyStore& keystore;
+    vector<CWalletTx>& vwtx;
+    const vector<vector<const CWalletTx*> >& vPrev;
+    vector<char> vfSigned;
+
+    CPayoutBatchSigner(const CKeyStore& keystoreIn, vector<CWalletTx>& vwtxIn, const vector<vector<const CWalletTx*> >& vPrevIn) :
+        keystore(keystoreIn), vwtx(vwtxIn), vPrev(vPrevIn), vfSigned(vwtxIn.size(), false) {}
+
+    void Sign(unsigned int nWorker, unsigned int nWorkers)
+    {
+        for (unsigned int i = nWorker; i < vwtx.size(); i += nWorkers)
+        {
+            bool fSigned = true;
+            for (unsigned int nIn = 0; nIn < vwtx[i].vin.size() && fSigned; nIn++)
+                fSigned = SignSignature(keystore, *vPrev[i][nIn], vwtx[i], nIn);
+            vfSigned[i] = fSigned;
+        }
+    }
+};
+
+struct CoinInSet
+{
+    const set<pair<const CWalletTx*,unsigned int> >& setCoins;
+    CoinInSet(const set<pair<const CWalletTx*,unsigned int> >& setCoinsIn) : setCoins(setCoinsIn) {}
+    bool operator()(const COutput& out) const { return setCoins.count(make_pair(out.tx, (unsigned int)out.i)) > 0; }
+};
+
+bool CWallet::SendPayoutBatch(const vector<pair<CScript, int64_t> >& vecSend, const string& strFromAccount, const mapValue_t& mapValue,
+                              vector<CWalletTx>& vwtxRet, int64_t& nFeeRet, string& strFailReason)
+{
+    vwtxRet.clear();
+    nFeeRet = 0;
+
+    if (vecSend.empty())
+    {
+        strFailReason = _("Transaction amounts must be positive");
+        return false;
+    }
+
+    // Split the recipients into chunks whose outputs stay well below the
+    // standard size limit, leaving the rest of each transaction for inputs
+    vector<vector<pair<CScript, int64_t> > > vChunks(1);
+    unsigned int nChunkBytes = 0;
+    BOOST_FOREACH(const PAIRTYPE(CScript, int64_t)& s, vecSend)
+    {
+        CTxOut txout(s.second, s.first);
+        if (s.second <= 0 || !MoneyRange(s.second))
+        {
+            strFailReason = _("Transaction amounts must be positive");
+            return false;
+        }
+        if (txout.IsDust(MIN_RELAY_TX_FEE))
+        {
+            strFailReason = _("Transaction amount too small");
+            return false;
+        }
+        unsigned int nBytes = ::GetSerializeSize(txout, SER_NETWORK, PROTOCOL_VERSION);
+        if (!vChunks.back().empty() && nChunkBytes + nBytes > PAYOUT_BATCH_MAX_OUTPUT_BYTES)
+        {
+            vChunks.push_back(vector<pair<CScript, int64_t> >());
+            nChunkBytes = 0;
+        }
+        vChunks.back().push_back(s);
+        nChunkBytes += nBytes;
+    }
+
+    vector<int64_t> vChangeKeys;
+    vector<vector<const CWalletTx*> > vPrev(vChunks.size());
+    vwtxRet.resize(vChunks.size());
+
+    // txdb must be opened before the mapWallet lock
+    CTxDB txdb("r");
+    LOCK2(cs_main, cs_wallet);
+
+    // One pass over the wallet for the whole batch, each chunk then takes
+    // its inputs from what the previous chunks left
+    vector<COutput> vAvailableCoins;
+    AvailableCoins(vAvailableCoins, true);
+    SortCoinsByValue(vAvailableCoins);
+
+    bool fOk = true;
+    for (unsigned int c = 0; c < vChunks.size() && fOk; c++)
+    {
+        CWalletTx& wtx = vwtxRet[c];
+        wtx.BindWallet(this);
+        wtx.mapValue = mapValue;
+        wtx.strFromAccount = strFromAccount;
+        wtx.fTimeReceivedIsTxTime = true;
+        wtx.fFromMe = true;
+
+        int64_t nValue = 0;
+        BOOST_FOREACH(const PAIRTYPE(CScript, int64_t)& s, vChunks[c])
+            nValue += s.second;
+
+        int64_t nChangeKey = -1;
+        CScript scriptChange;
+        set<pair<const CWalletTx*,unsigned int> > setCoins;
+        int64_t nFee = nTransactionFee;
+        while (true)
+        {
+            wtx.vin.clear();
+            wtx.vout.clear();
+            setCoins.clear();
+            BOOST_FOREACH(const PAIRTYPE(CScript, int64_t)& s, vChunks[c])
+                wtx.vout.push_back(CTxOut(s.second, s.first));
+
+            int64_t nValueIn = 0;
+            if (!SelectCoins(vAvailableCoins, nValue + nFee, wtx.nTime, setCoins, nValueIn))
+            {
+                strFailReason = _(" Insufficient funds.");
+                fOk = false;
+                break;
+            }
+
+            double dPriority = 0;
+            BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+            {
+                int age = pcoin.first->GetDepthInMainChain();
+                if (age != 0)
+                    age += 1;
+                dPriority += (double)pcoin.first->vout[pcoin.second].nValue * age;
+                wtx.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
+            }
+
+            int64_t nChange = nValueIn - nValue - nFee;
+            if (nChange > 0)
+            {
+                if (nChangeKey == -1)
+                {
+                    CKeyPool keypool;
+                    ReserveKeyFromKeyPool(nChangeKey, keypool);
+                    if (nChangeKey == -1)
+                    {
+                        strFailReason = _("Keypool ran out, please call keypoolrefill first");
+                        fOk = false;
+                        break;
+                    }
+                    vChangeKeys.push_back(nChangeKey);
+                    scriptChange = GetScriptForDestination(keypool.vchPubKey.GetID());
+                }
+                wtx.vout.push_back(CTxOut(nChange, scriptChange));
+
+                // Never create dust outputs; if we would, just add the dust to the fee
+                if (wtx.vout.back().IsDust(MIN_RELAY_TX_FEE))
+                {
+                    wtx.vout.pop_back();
+                    nFee += nChange;
+                }
+                else
+                {
+                    // Move change to a random position
+                    swap(wtx.vout.back(), wtx.vout[GetRandInt(wtx.vout.size())]);
+                }
+            }
+
+            // Inputs are signed later, so size them for the largest signature script
+            unsigned int nBytes = ::GetSerializeSize(*(CTransaction*)&wtx, SER_NETWORK, PROTOCOL_VERSION) + wtx.vin.size() * PAYOUT_BATCH_SCRIPTSIG_BYTES;
+            if (nBytes >= MAX_STANDARD_TX_SIZE)
+            {
+                strFailReason = _(" Transaction too large");
+                fOk = false;
+                break;
+            }
+            dPriority = wtx.ComputePriority(dPriority, nBytes);
+
+            int64_t nPayFee = nTransactionFee * (1 + (int64_t)nBytes / 1000);
+            int64_t nMinFee = GetMinFee(wtx, nBytes, AllowFree(dPriority), GMF_SEND);
+            if (nFee < max(nPayFee, nMinFee))
+            {
+                nFee = max(nPayFee, nMinFee);
+                continue;
+            }
+            break;
+        }
+        if (!fOk)
+            break;
+
+        vPrev[c].reserve(wtx.vin.size());
+        BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+            vPrev[c].push_back(&mapWallet[txin.prevout.hash]);
+        vAvailableCoins.erase(remove_if(vAvailableCoins.begin(), vAvailableCoins.end(), CoinInSet(setCoins)), vAvailableCoins.end());
+        nFeeRet += nFee;
+    }
+
+    if (fOk)
+    {
+        CPayoutBatchSigner signer(*this, vwtxRet, vPrev);
+        unsigned int nWorkers = std::min((unsigned int)vwtxRet.size(), std::min(boost::thread::hardware_concurrency(), 8u));
+        if (nWorkers <= 1)
+            signer.Sign(0, 1);
+        else
+        {
+            boost::thread_group threads;
+            for (unsigned int i = 0; i < nWorkers; i++)
+                threads.create_thread(boost::bind(&CPayoutBatchSigner::Sign, &signer, i, nWorkers));
+            threads.join_all();
+        }
+        for (unsigned int c = 0; c < vwtxRet.size() && fOk; c++)
+        {
+            if (!signer.vfSigned[c])
+            {
+                strFailReason = _(" Signing transaction failed");
+                fOk = false;
+            }
+            else if (::GetSerializeSize(*(CTransaction*)&vwtxRet[c], SER_NETWORK, PROTOCOL_VERSION) >= MAX_STANDARD_TX_SIZE)
+            {
+                strFailReason = _(" Transaction too large");
+                fOk = false;
+            }
+        }
+    }
+
+    if (!fOk)
+    {
+        BOOST_FOREACH(int64_t nIndex, vChangeKeys)
+            ReturnKey(nIndex);
+        vwtxRet.clear();
+        nFeeRet = 0;
+        return false;
+    }
+
+    BOOST_FOREACH(CWalletTx& wtx, vwtxRet)
+    {
+        wtx.AddSupportingTransactions(txdb);
+
+        mapValue_t mapNarr;
+        FindStealthTransactions(wtx, mapNarr);
+        BOOST_FOREACH(const PAIRTYPE(string,string)& item, mapNarr)
+            wtx.mapValue[item.first] = item.second;
+    }
+    BOOST_FOREACH(int64_t nIndex, vChangeKeys)
+        KeepKey(nIndex);
+
+    // Record the whole batch, and the coins it spends, in a single wallet
+    // database transaction. Nothing else may write to the wallet file until
+    // it is committed.
+    {
+        CWalletDB* pwalletdb = fFileBacked ? new CWalletDB(strWalletFile) : NULL;
+        if (pwalletdb && !pwalletdb->TxnBegin())
+        {
+            delete pwalletdb;
+            strFailReason = _("Error writing to wallet database");
+            return false;
+        }
+
+        BOOST_FOREACH(CWalletTx& wtx, vwtxRet)
+        {
+            AddToWallet(wtx, false, pwalletdb);
+            BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+            {
+                CWalletTx &coin = mapWallet[txin.prevout.hash];
+                coin.BindWallet(this);
+                coin.MarkSpent(txin.prevout.n);
+                coin.WriteToDisk(pwalletdb);
+                UpdateUnspent(txin.prevout.hash);
+                NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
+            }
+        }
+
+        // The transactions are signed and already in mapWallet with their
+        // inputs marked spent, so like CommitTransaction the batch counts as
+        // sent even if the records did not reach the disk. Failing here would
+        // have a retrying caller pay every recipient a second time.
+        if (pwalletdb)
+        {
+            if (!pwalletdb->TxnCommit())
+                LogPrintf("SendPayoutBatch() : Error: wallet database commit failed, sending the batch anyway\n");
+            delete pwalletdb;
+        }
+    }
+
+    BOOST_FOREACH(CWalletTx& wtx, vwtxRet)
+    {
+        mapRequestCount[wtx.GetHash()] = 0;
+        if (!wtx.AcceptToMemoryPool(false))
+        {
+            // Already signed and recorded, like in CommitTransaction
+            LogPrintf("SendPayoutBatch() : Error: Transaction %s not valid\n", wtx.GetHash().ToString());
+            continue;
+        }
+        wtx.RelayWalletTransaction();
+    }
+
+    LogPrint("wallet", "SendPayoutBatch() : paid %u recipients in %u transactions, fee %s\n",
+             vecSend.size(), vwtxRet.size(), FormatMoney(nFeeRet));
+    return true;
+}
+
 bool CWallet::AddAccountingEntry(const CAccountingEntry& acentry, CWalletDB & pwalletdb)
 {
     if (!pwalletdb.WriteAccountingEntry_Backend(acentry))
@@ -3450,6 +4452,7 @@ bool CWallet::SetAddressBookName(const CTxDestination& address, const string& st
         std::map<CTxDestination, std::string>::iterator mi = mapAddressBook.find(address);
         fUpdated = mi != mapAddressBook.end();
         mapAddressBook[address] = strName;
+        fAddressGroupsStale = true;
     }
     NotifyAddressBookChanged(this, address, strName, ::IsMine(*this, address) != ISMINE_NO,
                              (fUpdated ? CT_UPDATED : CT_NEW) );
@@ -3473,6 +4476,7 @@ bool CWallet::SetAddressAccountIdAssociation(const CTxDestination& address, cons
         // only allow to create association
         if (mapAddressBook[address] == "") {
             mapAddressBook[address] = strName;
+            fAddressGroupsStale = true;
         }
     }
 
@@ -3487,6 +4491,7 @@ bool CWallet::DelAddressBookName(const CTxDestination& address)
         LOCK(cs_wallet); // mapAddressBook
 
         mapAddressBook.erase(address);
+        fAddressGroupsStale = true;
     }
 
     NotifyAddressBookChanged(this, address, "", ::IsMine(*this, address) != ISMINE_NO, CT_DELETED);
@@ -3522,6 +4527,132 @@ bool CWallet::SetDefaultKey(const CPubKey &vchPubKey)
     return true;
 }
 
+// Generates the keys of a keypool batch, each worker taking every nWorkers-th
+// key. Keys are random, or hardened children of the chain key when one is given.
+class CKeyPoolGenerator
+{
+public:
+    const CExtKey* pchainKey;
+    unsigned int nFirstChild;
+    bool fCompressed;
+    vector<CKey> vKeys;
+    vector<CPubKey> vPubKeys;
+
+    CKeyPoolGenerator(unsigned int nKeys, const CExtKey* pchainKeyIn, unsigned int nFirstChildIn, bool fCompressedIn) :
+        pchainKey(pchainKeyIn), nFirstChild(nFirstChildIn), fCompressed(fCompressedIn), vKeys(nKeys), vPubKeys(nKeys) {}
+
+    void Generate(unsigned int nWorker, unsigned int nWorkers)
+    {
+        for (unsigned int i = nWorker; i < vKeys.size(); i += nWorkers)
+        {
+            if (pchainKey)
+            {
+                // An invalid child leaves its key invalid and its index unused
+                CExtKey childKey;
+                if (!pchainKey->Derive(childKey, (nFirstChild + i) | HD_HARDENED_KEY_LIMIT))
+                    continue;
+                vKeys[i] = childKey.key;
+            }
+            else
+                vKeys[i].MakeNewKey(fCompressed);
+            vPubKeys[i] = vKeys[i].GetPubKey();
+        }
+    }
+};
+
+// Generates up to nKeys new keys and appends them to the keypool, writing
+// keys, pool entries and the chain counter in a single database transaction
+bool CWallet::GenerateKeyPoolBatch(unsigned int nKeys)
+{
+    AssertLockHeld(cs_wallet); // mapKeyMetadata
+    bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
+
+    // Compressed public keys were introduced in version 0.6.0
+    if (fCompressed)
+        SetMinVersion(FEATURE_COMPRPUBKEY);
+
+    CExtKey chainKey;
+    bool fDeterministic = fCompressed && UseHDKeys();
+    if (fDeterministic && !GetHDChainKey(chainKey))
+        return false;
+
+    unsigned int nFirstChild = hdChain.nChildCounter;
+    CKeyPoolGenerator generator(nKeys, fDeterministic ? &chainKey : NULL, nFirstChild, fCompressed);
+    unsigned int nWorkers = std::min(nKeys / 16, std::min(boost::thread::hardware_concurrency(), 8u));
+    if (nWorkers <= 1)
+        generator.Generate(0, 1);
+    else
+    {
+        boost::thread_group threads;
+        for (unsigned int i = 0; i < nWorkers; i++)
+            threads.create_thread(boost::bind(&CKeyPoolGenerator::Generate, &generator, i, nWorkers));
+        threads.join_all();
+    }
+
+    int64_t nCreationTime = GetTime();
+    if (!nTimeFirstKey || nCreationTime < nTimeFirstKey)
+        nTimeFirstKey = nCreationTime;
+
+    // Watch-only entries are erased through their own handle, so before the
+    // transaction is opened
+    for (unsigned int i = 0; i < nKeys; i++)
+    {
+        if (!generator.vKeys[i].IsValid())
+            continue;
+        CScript script = GetScriptForDestination(generator.vPubKeys[i].GetID());
+        if (HaveWatchOnly(script))
+            RemoveWatchOnly(script);
+    }
+
+    CWalletDB walletdb(strWalletFile);
+    if (!walletdb.TxnBegin())
+        return error("CWallet::GenerateKeyPoolBatch() : TxnBegin failed");
+
+    // Crypted keys are written through the batch's handle, as in EncryptWallet
+    pwalletdbEncryption = &walletdb;
+
+    bool fOk = true;
+    int64_t nIndex = setKeyPool.empty() ? 1 : *setKeyPool.rbegin() + 1;
+    vector<int64_t> vIndexAdded;
+    for (unsigned int i = 0; i < nKeys && fOk; i++)
+    {
+        const CKey& secret = generator.vKeys[i];
+        const CPubKey& pubkey = generator.vPubKeys[i];
+        if (!secret.IsValid())
+            continue;
+        CKeyMetadata& meta = mapKeyMetadata[pubkey.GetID()];
+        meta = CKeyMetadata(nCreationTime);
+        fOk = CCryptoKeyStore::AddKeyPubKey(secret, pubkey) &&
+              (IsCrypted() || walletdb.WriteKey(pubkey, secret.GetPrivKey(), meta)) &&
+              walletdb.WritePool(nIndex, CKeyPool(pubkey));
+        vIndexAdded.push_back(nIndex++);
+    }
+
+    if (fOk && fDeterministic)
+    {
+        hdChain.nChildCounter += nKeys;
+        fOk = walletdb.WriteHDChain(hdChain);
+    }
+
+    pwalletdbEncryption = NULL;
+
+    if (!fOk)
+    {
+        walletdb.TxnAbort();
+        hdChain.nChildCounter = nFirstChild;
+        return error("CWallet::GenerateKeyPoolBatch() : writing generated keys failed");
+    }
+    if (!walletdb.TxnCommit())
+    {
+        hdChain.nChildCounter = nFirstChild;
+        return error("CWallet::GenerateKeyPoolBatch() : TxnCommit failed");
+    }
+
+    setKeyPool.insert(vIndexAdded.begin(), vIndexAdded.end());
+    LogPrintf("keypool added %u %s keys, size=%u\n", vIndexAdded.size(), fDeterministic ? "derived" : "random", setKeyPool.size());
+    return true;
+}
+
 //
 // Mark old keypool keys as used,
 // and generate all new keys
@@ -3546,11 +4677,10 @@ bool CWallet::NewKeyPool()
         else
             nKeys = max(GetArg("-keypool", 1000), (int64_t)0);
 
-        for (int i = 0; i < nKeys; i++)
+        while (setKeyPool.size() < (uint64_t)nKeys)
         {
-            int64_t nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
+            if (!GenerateKeyPoolBatch(std::min((unsigned int)(nKeys - setKeyPool.size()), KEYPOOL_BATCH_SIZE)))
+                return false;
         }
         LogPrintf("CWallet::NewKeyPool wrote %d new keys\n", nKeys);
     }
@@ -3565,8 +4695,6 @@ bool CWallet::TopUpKeyPool(unsigned int nSize)
         if (IsLocked())
             return false;
 
-        CWalletDB walletdb(strWalletFile);
-
         // Top up key pool
         unsigned int nTargetSize;
         fLiteMode = GetBoolArg("-litemode", false);
@@ -3580,16 +4708,14 @@ bool CWallet::TopUpKeyPool(unsigned int nSize)
 
         while (setKeyPool.size() < (nTargetSize + 1))
         {
-            int64_t nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error("TopUpKeyPool() : writing generated key failed");
-            setKeyPool.insert(nEnd);
-            LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
-            double dProgress = 100.f * nEnd / (nTargetSize + 1);
-            std::string strMsg = strprintf(_("Loading wallet... (%3.2f %%)"), dProgress);
-            uiInterface.InitMessage(strMsg);
+            if (!GenerateKeyPoolBatch(std::min((unsigned int)(nTargetSize + 1 - setKeyPool.size()), KEYPOOL_BATCH_SIZE)))
+                throw runtime_error("TopUpKeyPool() : writing generated keys failed");
+            if (nTargetSize + 1 > KEYPOOL_BATCH_SIZE)
+            {
+                double dProgress = 100.f * setKeyPool.size() / (nTargetSize + 1);
+                std::string strMsg = strprintf(_("Loading wallet... (%3.2f %%)"), dProgress);
+                uiInterface.InitMessage(strMsg);
+            }
         }
     }
     return true;
@@ -3691,137 +4817,65 @@ int64_t CWallet::GetOldestKeyPoolTime()
 
 std::map<CTxDestination, int64_t> CWallet::GetAddressBalances()
 {
-    map<CTxDestination, int64_t> balances;
+    LOCK2(cs_main, cs_wallet);
 
-    {
-        LOCK(cs_wallet);
-        BOOST_FOREACH(PAIRTYPE(uint256, CWalletTx) walletEntry, mapWallet)
-        {
-            CWalletTx *pcoin = &walletEntry.second;
+    // Only outputs of the unspent index count; every other address of ours
+    // is listed with a zero balance
+    const CBalanceCache& cache = GetBalanceCache();
+    if (cache.fValid && cache.fAddressBalances)
+        return cache.mapAddressBalance;
 
-            if (!IsFinalTx(*pcoin) || !pcoin->IsTrusted())
-                continue;
+    map<CTxDestination, int64_t> balances;
+    BOOST_FOREACH(const uint256& hash, GetUnspentIndex())
+    {
+        const CWalletTx *pcoin = &mapWallet.find(hash)->second;
 
-            if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+        if (!IsFinalTx(*pcoin) || !pcoin->IsTrusted())
+            continue;
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < (pcoin->IsFromMe(ISMINE_ALL) ? 0 : 1))
-                continue;
+        if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
+            continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-            {
-                CTxDestination addr;
-                if (!IsMine(pcoin->vout[i]))
-                    continue;
-                if(!ExtractDestination(pcoin->vout[i].scriptPubKey, addr))
-                    continue;
+        int nDepth = pcoin->GetDepthInMainChain();
+        if (nDepth < (pcoin->IsFromMe(ISMINE_ALL) ? 0 : 1))
+            continue;
 
-                int64_t n = pcoin->IsSpent(i) ? 0 : pcoin->vout[i].nValue;
+        for (unsigned int i = 0; i < pcoin->vout.size(); i++)
+        {
+            CTxDestination addr;
+            if (!IsMine(pcoin->vout[i]))
+                continue;
+            if(!ExtractDestination(pcoin->vout[i].scriptPubKey, addr))
+                continue;
 
-                if (!balances.count(addr))
-                    balances[addr] = 0;
-                balances[addr] += n;
-            }
+            int64_t n = pcoin->IsSpent(i) ? 0 : pcoin->vout[i].nValue;
+            balances[addr] += n;
         }
     }
 
+    const map<CTxDestination, CTxDestination>& mapGroupIndex = GetAddressGroupIndex();
+    for (map<CTxDestination, CTxDestination>::const_iterator it = mapGroupIndex.begin(); it != mapGroupIndex.end(); ++it)
+        balances.insert(make_pair(it->first, (int64_t)0));
+
+    if (balanceCache.fValid)
+    {
+        balanceCache.mapAddressBalance = balances;
+        balanceCache.fAddressBalances = true;
+    }
     return balances;
 }
 
 set< set<CTxDestination> > CWallet::GetAddressGroupings()
 {
     AssertLockHeld(cs_wallet); // mapWallet
-    set< set<CTxDestination> > groupings;
-    set<CTxDestination> grouping;
-
-    BOOST_FOREACH(PAIRTYPE(uint256, CWalletTx) walletEntry, mapWallet)
-    {
-        CWalletTx *pcoin = &walletEntry.second;
-
-        if (pcoin->vin.size() > 0 && IsMine(pcoin->vin[0]))
-        {
-            bool any_mine = false;
-            // group all input addresses with each other
-            BOOST_FOREACH(CTxIn txin, pcoin->vin)
-            {
-                CTxDestination address;
-                if(!IsMine(txin)) /* If this input isn't mine, ignore it */
-                    continue;
-                if(!ExtractDestination(mapWallet[txin.prevout.hash].vout[txin.prevout.n].scriptPubKey, address))
-                    continue;
-                grouping.insert(address);
-                any_mine = true;
-            }
-
-            // group change with input addresses
-            if (any_mine)
-            {
-                BOOST_FOREACH(CTxOut txout, pcoin->vout)
-                {
-                    if (IsChange(txout))
-                    {
-                        CWalletTx tx = mapWallet[pcoin->vin[0].prevout.hash];
-                        CTxDestination txoutAddr;
-                        if(!ExtractDestination(txout.scriptPubKey, txoutAddr))
-                            continue;
-                        grouping.insert(txoutAddr);
-                    }
-                }
-            }
-            if (grouping.size() > 0)
-            {
-                groupings.insert(grouping);
-                grouping.clear();
-            }
-        }
-
-        // group lone addrs by themselves
-        for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-            if (IsMine(pcoin->vout[i]))
-            {
-                CTxDestination address;
-                if(!ExtractDestination(pcoin->vout[i].scriptPubKey, address))
-                    continue;
-                grouping.insert(address);
-                groupings.insert(grouping);
-                grouping.clear();
-            }
-    }
-
-    set< set<CTxDestination>* > uniqueGroupings; // a set of pointers to groups of addresses
-    map< CTxDestination, set<CTxDestination>* > setmap;  // map addresses to the unique group containing it
-    BOOST_FOREACH(set<CTxDestination> grouping, groupings)
-    {
-        // make a set of all the groups hit by this new group
-        set< set<CTxDestination>* > hits;
-        map< CTxDestination, set<CTxDestination>* >::iterator it;
-        BOOST_FOREACH(CTxDestination address, grouping)
-            if ((it = setmap.find(address)) != setmap.end())
-                hits.insert((*it).second);
-
-        // merge all hit groups into a new single group and delete old groups
-        set<CTxDestination>* merged = new set<CTxDestination>(grouping);
-        BOOST_FOREACH(set<CTxDestination>* hit, hits)
-        {
-            merged->insert(hit->begin(), hit->end());
-            uniqueGroupings.erase(hit);
-            delete hit;
-        }
-        uniqueGroupings.insert(merged);
-
-        // update setmap
-        BOOST_FOREACH(CTxDestination element, *merged)
-            setmap[element] = merged;
-    }
+    map<CTxDestination, set<CTxDestination> > mapGroups;
+    const map<CTxDestination, CTxDestination>& mapGroupIndex = GetAddressGroupIndex();
+    for (map<CTxDestination, CTxDestination>::const_iterator it = mapGroupIndex.begin(); it != mapGroupIndex.end(); ++it)
+        mapGroups[FindAddressGroup(it->first)].insert(it->first);
 
     set< set<CTxDestination> > ret;
-    BOOST_FOREACH(set<CTxDestination>* uniqueGrouping, uniqueGroupings)
-    {
-        ret.insert(*uniqueGrouping);
-        delete uniqueGrouping;
-    }
-
+    for (map<CTxDestination, set<CTxDestination> >::const_iterator it = mapGroups.begin(); it != mapGroups.end(); ++it)
+        ret.insert(it->second);
     return ret;
 }
 
@@ -3857,6 +4911,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, bo
                 {
                     pcoin->MarkUnspent(n);
                     pcoin->WriteToDisk();
+                    UpdateUnspent(pcoin->GetHash());
                 }
             }
             else if (IsMine(pcoin->vout[n]) && !pcoin->IsSpent(n) && (txindex.vSpent.size() > n && !txindex.vSpent[n].IsNull()))
@@ -3869,6 +4924,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, bo
                 {
                     pcoin->MarkSpent(n);
                     pcoin->WriteToDisk();
+                    UpdateUnspent(pcoin->GetHash());
                 }
             }
         }
@@ -3892,6 +4948,7 @@ void CWallet::DisableTransaction(const CTransaction &tx)
             {
                 prev.MarkUnspent(txin.prevout.n);
                 prev.WriteToDisk();
+                UpdateUnspent(txin.prevout.hash);
             }
         }
     }
@@ -3961,6 +5018,8 @@ bool CWallet::UpdatedTransaction(const uint256 &hashTx)
         // Only notify UI if this transaction is in this wallet
         map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hashTx);
         if (mi != mapWallet.end()){
+            // A completed transaction lock changes its depth
+            balanceCache.fValid = false;
             NotifyTransactionChanged(this, hashTx, CT_UPDATED);
             return true;
         }
@@ -4081,11 +5140,12 @@ bool CWallet::ImportPrivateKey(CDigitalNoteSecret vchSecret, string strLabel, bo
 
         // whenever a key is imported, we need to scan the whole chain
         nTimeFirstKey = 1; // 0 would be considered 'no value'
+    }
 
-        if (fRescan) {
-            ScanForWalletTransactions(pindexGenesisBlock, true);
-            ReacceptWalletTransactions();
-        }
+    // The rescan takes the locks itself, and only while adding matches
+    if (fRescan) {
+        ScanForWalletTransactions(pindexGenesisBlock, true);
+        ReacceptWalletTransactions();
     }
 
     return true;
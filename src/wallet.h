@@ -14,6 +14,7 @@
 
 #include "crypter.h"
 #include "main.h"
+#include "kernel.h"
 #include "key.h"
 #include "keystore.h"
 #include "script.h"
@@ -42,6 +43,14 @@ typedef std::map<std::string, std::string> mapValue_t;
 
 extern int64_t GetStakeCombineThreshold();
 
+/** Depth first search over vValue (largest first) for a subset adding up to
+ * exactly nTargetValue, giving up after nMaxTries steps */
+bool SelectCoinsExact(const std::vector<std::pair<int64_t, std::pair<const CWalletTx*,unsigned int> > >& vValue, int64_t nTargetValue,
+                      std::vector<char>& vfBest, int nMaxTries = 100000);
+
+/** Default for -usehd, deriving keypool keys from a seed held in the wallet */
+static const bool DEFAULT_USE_HD_WALLET = false;
+
 /** (client) version numbers for particular wallet features */
 enum WalletFeature
 {
@@ -95,9 +104,14 @@ class CWallet : public CCryptoKeyStore, public CWalletInterface
 private:
     bool SelectCoinsForStaking(int64_t nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
     //bool SelectCoins(int64_t nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl=NULL) const;
-    bool SelectCoins(CAmount nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl = NULL, AvailableCoinsType coin_type=ALL_COINS, bool useIX = false) const;
+    bool SelectCoins(const std::vector<COutput>& vAvailableCoins, CAmount nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl = NULL) const;
     CWalletDB *pwalletdbEncryption;
 
+    bool UseHDKeys() const;
+    bool NewHDSeed();
+    bool GetHDChainKey(CExtKey& chainKeyRet);
+    bool GenerateKeyPoolBatch(unsigned int nKeys);
+
     // the current wallet version: clients below this version are not able to load the wallet
     int nWalletVersion;
 
@@ -114,6 +128,84 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    // Kernel data of the coins we stake with, so that the stake miner does not
+    // re-read every input and its block header on each attempt. Entries are
+    // dropped when the wallet tx changes or its block leaves the main chain.
+    std::map<COutPoint, CStakeCandidate> mapStakeCache;
+    // Prepared kernels of mapStakeCache, rebuilt on a new tip or input set.
+    // Only used from CreateCoinStake() by the stake miner.
+    CStakeKernelSearch stakeSearch;
+    void EraseStakeCache(const uint256& hash);
+    bool UpdateStakeCache(const std::set<std::pair<const CWalletTx*,unsigned int> >& setCoins);
+
+    // Wallet transactions with at least one output of ours not yet known to
+    // be spent. Balances and coin selection walk this instead of mapWallet.
+    // Rebuilt on next use after MarkDirty(), since a new key or watch-only
+    // script can turn old outputs into ours.
+    mutable std::set<uint256> setWalletUnspent;
+    mutable bool fUnspentIndexStale;
+    bool HasUnspentOutput(const CWalletTx& wtx) const;
+    void UpdateUnspent(const uint256& hash);
+    const std::set<uint256>& GetUnspentIndex() const;
+
+    // All balance buckets, summed in one pass over setWalletUnspent. Valid
+    // while the tip, the mempool and the wallet are unchanged; depth and
+    // maturity move with every block so the sums are not carried across.
+    struct CBalanceCache
+    {
+        bool fValid;
+        uint256 hashBestChain;
+        unsigned int nMempoolUpdated;
+        CAmount nBalance;
+        CAmount nStake;
+        CAmount nNewMint;
+        CAmount nUnconfirmed;
+        CAmount nImmature;
+        CAmount nWatchOnlyBalance;
+        CAmount nWatchOnlyStake;
+        CAmount nUnconfirmedWatchOnly;
+        CAmount nImmatureWatchOnly;
+        // Filled by the first GetAddressBalances() on these terms
+        bool fAddressBalances;
+        std::map<CTxDestination, CAmount> mapAddressBalance;
+    };
+    mutable CBalanceCache balanceCache;
+    const CBalanceCache& GetBalanceCache() const;
+
+    // Union-find over our addresses for GetAddressGroupings(), each address
+    // mapped to its parent and group roots to themselves. Grown as wallet
+    // transactions arrive; rebuilt on next use after anything that can split
+    // a group, such as new keys or address book changes deciding what change is.
+    mutable std::map<CTxDestination, CTxDestination> mapAddressParent;
+    mutable bool fAddressGroupsStale;
+    CTxDestination FindAddressGroup(const CTxDestination& address) const;
+    void GroupAddresses(const CWalletTx& wtx) const;
+    void UpdateAddressGroups(const CWalletTx& wtx);
+    const std::map<CTxDestination, CTxDestination>& GetAddressGroupIndex() const;
+
+    // An output of a transaction paid to one of our stealth addresses: the
+    // ephemeral key, the address (index into vStealthScanAddr) and what was
+    // derived for it
+    struct CStealthMatch
+    {
+        ec_point vchEphemPK;
+        size_t nAddr;
+        ec_point pkExtracted;
+        ec_secret sShared;
+    };
+
+    // Parsed keys of the stealth addresses we own, kept across transactions
+    // and rebuilt on next use after stealthAddresses changes.
+    CStealthScanner stealthScanner;
+    std::vector<std::set<CStealthAddress>::iterator> vStealthScanAddr;
+    bool fStealthScannerStale;
+    // Matches of the last block synced, found in one pass over all its
+    // stealth outputs and handed out to its transactions as they arrive.
+    uint256 hashStealthScanBlock;
+    std::map<uint256, std::vector<CStealthMatch> > mapStealthScanMatches;
+    void UpdateStealthScanner();
+    void ScanStealthOutputs(const CTransaction& tx, std::vector<CStealthMatch>& vMatches);
+
 public:
     /// Main wallet lock.
     /// This lock protects all the fields added by CWallet
@@ -173,8 +265,13 @@ public:
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
         nTimeFirstKey = 0;
+        hdChain.SetNull();
         nLastFilteredHeight = 0;
         fWalletUnlockAnonymizeOnly = false;
+        fUnspentIndexStale = true;
+        fAddressGroupsStale = true;
+        balanceCache.fValid = false;
+        fStealthScannerStale = true;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -195,6 +292,8 @@ public:
 
     int64_t nTimeFirstKey;
 
+    CHDChain hdChain;
+
     const CWalletTx* GetWalletTx(const uint256& hash) const;
 
     // check whether we are allowed to upgrade (or already support) to the named feature
@@ -203,7 +302,8 @@ public:
     void AvailableCoinsForStaking(std::vector<COutput>& vCoins, unsigned int nSpendTime) const;
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl = NULL, AvailableCoinsType coin_type=ALL_COINS, bool useIX = false) const;
     void AvailableCoinsMN(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl = NULL, AvailableCoinsType coin_type=ALL_COINS, bool useIX = false) const;
-    bool SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
+    // vCoins must be sorted by value, smallest first (asserted)
+    bool SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
 
     bool IsSpent(const uint256& hash, unsigned int n) const;
 
@@ -253,7 +353,7 @@ public:
     int64_t IncOrderPosNext(CWalletDB *pwalletdb = NULL);
 
     void MarkDirty();
-    bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet=false);
+    bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet=false, CWalletDB* pwalletdb=NULL);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock, bool fConnect = true, bool fFixSpentCoins = false);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     void EraseFromWallet(const uint256 &hash);
@@ -279,6 +379,13 @@ public:
     bool CreateTransaction(const std::vector<std::pair<CScript, int64_t> >& vecSend, CWalletTx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, int32_t& nChangePos, std::string& strFailReason, const CCoinControl *coinControl=NULL, AvailableCoinsType coin_type=ALL_COINS, bool useIX=false);
     bool CreateTransaction(CScript scriptPubKey, int64_t nValue, std::string& sNarr, CWalletTx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, const CCoinControl *coinControl=NULL);
     bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, std::string strCommand="tx");
+    /** Pay every recipient in vecSend, split into as many transactions as
+     * the standard size limit needs. Coins are gathered once for the whole
+     * batch, the transactions signed in parallel and written to the wallet
+     * in a single database transaction before being relayed.
+     */
+    bool SendPayoutBatch(const std::vector<std::pair<CScript, int64_t> >& vecSend, const std::string& strFromAccount, const mapValue_t& mapValue,
+                         std::vector<CWalletTx>& vwtxRet, int64_t& nFeeRet, std::string& strFailReason);
 
     bool AddAccountingEntry(const CAccountingEntry&, CWalletDB & pwalletdb);
 
@@ -296,7 +403,7 @@ public:
     bool CreateStealthTransaction(CScript scriptPubKey, int64_t nValue, std::vector<uint8_t>& P, std::vector<uint8_t>& narr, std::string& sNarr, CWalletTx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, const CCoinControl* coinControl=NULL);
     std::string SendStealthMoney(CScript scriptPubKey, int64_t nValue, std::vector<uint8_t>& P, std::vector<uint8_t>& narr, std::string& sNarr, CWalletTx& wtxNew, bool fAskFee=false);
     bool SendStealthMoneyToDestination(CStealthAddress& sxAddress, int64_t nValue, std::string& sNarr, CWalletTx& wtxNew, std::string& sError, bool fAskFee=false);
-    bool FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNarr);
+    bool FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNarr, const CBlock* pblock = NULL);
 
     int GenerateMNengineOutputs(int nTotalValue, std::vector<CTxOut>& vout);
     bool CreateCollateralTransaction(CTransaction& txCollateral, std::string& strReason);
@@ -955,7 +1062,7 @@ public:
         return true;
     }
 
-    bool WriteToDisk();
+    bool WriteToDisk(CWalletDB* pwalletdb=NULL);
 
     int64_t GetTxTime() const;
     int GetRequestCount() const;
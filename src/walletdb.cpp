@@ -183,6 +183,12 @@ bool CWalletDB::WriteMinVersion(int nVersion)
     return Write(std::string("minversion"), nVersion);
 }
 
+bool CWalletDB::WriteHDChain(const CHDChain& chain)
+{
+    nWalletDBUpdated++;
+    return Write(std::string("hdchain"), chain);
+}
+
 bool CWalletDB::ReadAccount(const string& strAccount, CAccount& account)
 {
     account.SetNull();
@@ -220,7 +226,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
 {
     bool fAllAccounts = (strAccount == "*");
 
-    Dbc* pcursor = GetCursor();
+    CDBCursor* pcursor = GetCursor();
     if (!pcursor)
         throw runtime_error("CWalletDB::ListAccountCreditDebit() : cannot create DB cursor");
     unsigned int fFlags = DB_SET_RANGE;
@@ -237,7 +243,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
             break;
         else if (ret != 0)
         {
-            pcursor->close();
+            delete pcursor;
             throw runtime_error("CWalletDB::ListAccountCreditDebit() : error scanning DB");
         }
 
@@ -256,7 +262,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
         entries.push_back(acentry);
     }
 
-    pcursor->close();
+    delete pcursor;
 }
 
 
@@ -572,6 +578,10 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
 
             pwallet->mapStealthKeyMeta[keyId] = sxKeyMeta;
         }
+        else if (strType == "hdchain")
+        {
+            ssValue >> pwallet->hdChain;
+        }
         else if (strType == "defaultkey")
         {
             ssValue >> pwallet->vchDefaultKey;
@@ -624,7 +634,7 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
 static bool IsKeyType(string strType)
 {
     return (strType== "key" || strType == "wkey" ||
-            strType == "mkey" || strType == "ckey");
+            strType == "mkey" || strType == "ckey" || strType == "hdchain");
 }
 
 DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
@@ -645,7 +655,7 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor)
         {
             LogPrintf("Error getting wallet database cursor\n");
@@ -663,6 +673,7 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             else if (ret != 0)
             {
                 LogPrintf("Error reading next record from wallet database\n");
+                delete pcursor;
                 return DB_CORRUPT;
             }
 
@@ -686,7 +697,7 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             if (!strErr.empty())
                 LogPrintf("%s\n", strErr);
         }
-        pcursor->close();
+        delete pcursor;
     }
     catch (boost::thread_interrupted) {
         throw;
@@ -760,7 +771,16 @@ void ThreadFlushWalletDB(const string& strFile)
             nLastWalletUpdate = GetTime();
         }
 
-        if (nLastFlushed != nWalletDBUpdated && GetTime() - nLastWalletUpdate >= 2)
+        if (nLastFlushed != nWalletDBUpdated && GetTime() - nLastWalletUpdate >= 2 && CDB::UseLevelDB())
+        {
+            // Nothing to checkpoint. Handles sync their own writes when they
+            // close, this covers the ones kept open across many writes
+            nLastFlushed = nWalletDBUpdated;
+            int64_t nStart = GetTimeMillis();
+            ldbenv.Sync(strFile);
+            LogPrint("db", "Synced wallet store %dms\n", GetTimeMillis() - nStart);
+        }
+        else if (nLastFlushed != nWalletDBUpdated && GetTime() - nLastWalletUpdate >= 2)
         {
             TRY_LOCK(bitdb.cs_db,lockDb);
             if (lockDb)
@@ -801,6 +821,18 @@ bool BackupWallet(const CWallet& wallet, const string& strDest)
 {
     if (!wallet.fFileBacked)
         return false;
+
+    if (CDB::UseLevelDB())
+    {
+        filesystem::path pathDest(strDest);
+        if (filesystem::is_directory(pathDest) && !filesystem::exists(pathDest / "CURRENT"))
+            pathDest /= CLevelDBEnv::GetPath(wallet.strWalletFile).filename();
+        if (!ldbenv.Backup(wallet.strWalletFile, pathDest))
+            return false;
+        LogPrintf("copied %s to %s\n", wallet.strWalletFile, pathDest.string());
+        return true;
+    }
+
     while (true)
     {
         {
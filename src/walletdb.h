@@ -68,6 +68,41 @@ public:
     }
 };
 
+/** Seed and child counter of the deterministic keypool chain (-usehd) */
+class CHDChain
+{
+public:
+    static const int CURRENT_VERSION=1;
+    int nVersion;
+    uint32_t nChildCounter; // next child of m/0'/0' to derive
+    CKeyID seedID; // wallet key whose secret is the BIP32 seed
+
+    CHDChain()
+    {
+        SetNull();
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(this->nVersion);
+        nVersion = this->nVersion;
+        READWRITE(nChildCounter);
+        READWRITE(seedID);
+    )
+
+    void SetNull()
+    {
+        nVersion = CHDChain::CURRENT_VERSION;
+        nChildCounter = 0;
+        seedID = CKeyID();
+    }
+
+    bool IsNull() const
+    {
+        return seedID == CKeyID();
+    }
+};
+
 class CStealthKeyMetadata
 {
 // -- used to get secret for keys created by stealth transaction with wallet locked
@@ -136,6 +171,8 @@ public:
 
     bool WriteMinVersion(int nVersion);
 
+    bool WriteHDChain(const CHDChain& chain);
+
     bool ReadAccount(const std::string& strAccount, CAccount& account);
     bool WriteAccount(const std::string& strAccount, const CAccount& account);
 private: